@@ -213,9 +213,9 @@ public:
 	}
 
 	template <typename TK, typename TV, typename ...T>
-	TV &&map(TK &&key, TV &&mapped, T &&...args)
+	TV map(TK &&key, TV &&mapped, T &&...args)
 	{
-		return std::move(_map(std::move(val<typename std::remove_reference<TK>::type>()), std::move(key), std::move(mapped), std::move(args)...));
+		return _map(std::move(val<typename std::remove_reference<TK>::type>()), std::move(key), std::move(mapped), std::move(args)...);
 	}
 
 private:
@@ -227,10 +227,10 @@ private:
 	}
 
 	template <typename C, typename TK, typename TV, typename ...T>
-	TV &&_map(C &&val, TK &&key, TV &&mapped, T &&...args)
+	TV _map(C &&val, TK &&key, TV &&mapped, T &&...args)
 	{
 		if (key == val) return std::move(mapped);
-		else return std::move(_map<C, T...>(std::move(val), std::move(args)...));
+		else return _map<C, T...>(std::move(val), std::move(args)...);
 	}
 
 	[[noreturn]]
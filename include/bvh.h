@@ -2,26 +2,77 @@
 #include <vector>
 #include "mesh.h"
 #include "aabb.h"
+#include "thread_pool.h"
 // Bounding Volume Hierarchy (BVH) Interface.
 class BVH {
 	public:
-		enum class Method { CUT_LONGEST_AXIS, SURFACE_AREA_HEURISTIC };
+		enum class Method { CUT_LONGEST_AXIS, SURFACE_AREA_HEURISTIC, BINNED_SURFACE_AREA_HEURISTIC, LINEAR, HIERARCHICAL_LINEAR };
 		BVH();
 		BVH(BVH::Method method);
+		// Uses the given number of threads for the construction, 0 means all hardware threads,
+		// and puts up to maxLeafTriangles triangles into a leaf if the SAH favors it.
+		BVH(BVH::Method method, std::size_t threads, std::size_t maxLeafTriangles);
 		~BVH();
 		// Constructs the BVH from the given mesh.
 		void buildBVH(const Mesh &mesh);
-		unsigned int build(const Mesh &mesh, std::vector<unsigned int> &faceIDs, std::size_t &i);
+		// Returns the SAH cost of the binary tree, relative to the root's surface area.
+		float getSAHCost() const;
+		// Collapses the binary tree into a tree with up to width (4 or 8) children per node.
+		void collapse(std::size_t width);
+		// Returns the number of children per node.
+		std::size_t getWidth() const;
+		// Returns the number of stack entries needed to traverse the tree.
+		std::size_t getStackSize() const;
+		// Flags a leaf in the first value of its node.
+		static const uint32_t LEAF = 0x80000000u;
 		std::vector<uint32_t> triangles;
+		// Two values per node in depth-first order. Inner nodes store the number of nodes
+		// in their subtree, leaves store LEAF | their number of triangles. Both store the
+		// offset of their first triangle.
+		// After collapsing, every node stores the indices of its children (the triangle
+		// offsets for leaf children), followed by the number of triangles of each child
+		// (0 for inner children).
 		std::vector<uint32_t> nodes;
 		std::vector<Vec3f> aabbs;
+		// Child bounding boxes of the collapsed tree, width floats each for min x, min y,
+		// min z, max x, max y and max z per node. Unused children have inverted boxes.
+		std::vector<float> wideAABBs;
 	private:
+		// Nodes, bounding boxes and triangles of a subtree in depth-first order.
+		struct Tree {
+			std::vector<uint32_t> nodes;
+			std::vector<Vec3f> aabbs;
+			std::vector<uint32_t> triangles;
+		};
+		unsigned int build(const Mesh &mesh, std::vector<unsigned int> &faceIDs, Tree &tree);
+		std::size_t getBinaryStackSize(std::size_t i) const;
+		std::size_t collapseNode(std::size_t i, std::vector<uint32_t> &wideNodes, std::vector<float> &wideBoxes) const;
 		void cutFaces(const Mesh &mesh, std::vector<unsigned int> &faceIDs, std::vector<unsigned int> &leftIDs, std::vector<unsigned int> &rightIDs, AABB &bb);
 		void cutFacesLongestAxis(const Mesh &mesh, std::vector<unsigned int> &faceIDs, std::vector<unsigned int> &leftIDs, std::vector<unsigned int> &rightIDs, AABB &bb);
 		void cutFacesMedianCut(const Mesh &mesh, std::vector<unsigned int> &faceIDs, std::vector<unsigned int> &leftIDs, std::vector<unsigned int> &rightIDs, AABB &bb);
 		void cutFacesSAH(const Mesh &mesh, std::vector<unsigned int> &faceIDs, std::vector<unsigned int> &leftIDs, std::vector<unsigned int> &rightIDs, AABB &bb);
+		void cutFacesBinnedSAH(const Mesh &mesh, std::vector<unsigned int> &faceIDs, std::vector<unsigned int> &leftIDs, std::vector<unsigned int> &rightIDs, AABB &bb);
+		void cutFacesMortonCode(const Mesh &mesh, std::vector<unsigned int> &faceIDs, std::vector<unsigned int> &leftIDs, std::vector<unsigned int> &rightIDs, AABB &bb);
+		void sortByMortonCode(std::vector<unsigned int> &faceIDs);
 		BVH::Method method;
+		std::size_t threads;
+		std::size_t maxLeafTriangles;
+		std::size_t width;
+		std::size_t stackSize;
+		// Only set during a parallel build.
+		ThreadPool *pool;
+		// Per-face bounding boxes, centroids and Morton codes, only filled during the build.
+		std::vector<AABB> faceBBs;
+		std::vector<Vec3f> faceCentroids;
+		std::vector<uint32_t> faceCodes;
 };
-inline BVH::BVH() : method(BVH::Method::CUT_LONGEST_AXIS) {}
-inline BVH::BVH(Method method) : method(method) {}
-inline BVH::~BVH() {}
\ No newline at end of file
+inline BVH::BVH() : method(BVH::Method::CUT_LONGEST_AXIS), threads(1), maxLeafTriangles(1), width(2), stackSize(0), pool(nullptr) {}
+inline BVH::BVH(Method method) : method(method), threads(1), maxLeafTriangles(1), width(2), stackSize(0), pool(nullptr) {}
+inline BVH::BVH(Method method, std::size_t threads, std::size_t maxLeafTriangles) : method(method), threads(threads), maxLeafTriangles(maxLeafTriangles), width(2), stackSize(0), pool(nullptr) {}
+inline BVH::~BVH() {}
+inline std::size_t BVH::getWidth() const {
+	return width;
+}
+inline std::size_t BVH::getStackSize() const {
+	return stackSize;
+}
\ No newline at end of file
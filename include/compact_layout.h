@@ -0,0 +1,27 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "vec3.h"
+// Compact layout of the scene buffers, which the kernel decodes on the fly.
+//
+// Vertices are packed into three floats instead of four, and normals are
+// octahedron-encoded into two 16-bit components. The child boxes of wide BVH
+// nodes are quantized to 8- or 16-bit offsets on a grid which covers the node:
+// every node starts with the origin and the spacing of its grid (six floats),
+// followed by the quantized planes in the order of BVH::wideAABBs. Quantized
+// boxes are rounded outwards, so rays hit at least the boxes they hit before.
+// Either layout can also interleave every vertex with its normal in one buffer.
+// Returns the size of the quantized child boxes of one node (in bytes).
+inline std::size_t compactBoundsSize(unsigned int width, unsigned int bits) {
+	return 6 * sizeof(float) + 6 * width * (bits / 8);
+}
+// Quantizes the child boxes of the given number of wide nodes.
+std::vector<unsigned char> quantizeWideAABBs(const float *boxes, std::size_t nodes, unsigned int width, unsigned int bits);
+// Packs the vertices into three floats each.
+std::vector<float> packVertices(const Vec3f *vertices, std::size_t count);
+// Encodes the unit normals on an octahedron, with two 16-bit signed components in 32 bits.
+std::vector<uint32_t> encodeNormals(const Vec3f *normals, std::size_t count);
+// Interleaves every vertex with its normal, either as two float4 or, if the normals are
+// encoded, as a single float4 whose last component holds the bits of the encoded normal.
+std::vector<float> interleaveVertices(const Vec3f *vertices, const Vec3f *normals, std::size_t count, bool encoded);
\ No newline at end of file
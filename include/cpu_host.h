@@ -0,0 +1,102 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "ray_tracer.h"
+#include "render_backend.h"
+#include "scene.h"
+#include "simd.h"
+#include "thread_pool.h"
+#include "vec3.h"
+// Renders on the CPU with the camera, shading and ambient occlusion of the kernel.
+//
+// Primary rays are traced in packets of Packet::SIZE neighbouring supersamples,
+// the ambient occlusion rays of every hit in packets of directions. The rows
+// of a tile are spread over a work-stealing thread pool. The BVH is always
+// traversed with a stack, so the traversal option only matters to the kernel.
+class CPUHost : public RenderBackend {
+	public:
+		// Uses the given number of threads, 0 means all hardware threads.
+		CPUHost(const RayTracer &rt, std::size_t threads = 0);
+		void upload(const Scene &scene) override;
+		bool operator()() override;
+		bool render(unsigned int x, unsigned int y, unsigned int width, unsigned int height, std::size_t device = 0) override;
+		void download(float *image, std::size_t device = 0) override;
+		bool resolve(unsigned int width, unsigned int height, std::size_t device = 0) override;
+		void download(unsigned char *image, unsigned int x, unsigned int y, unsigned int width, unsigned int height, std::size_t device = 0) override;
+		bool renderAdaptive(std::size_t &refined, std::size_t &hits, std::size_t device = 0) override;
+		void setPass(uint32_t pass) override;
+		bool accumulate(unsigned int pass, float &variance, std::size_t device = 0) override;
+		// Packets do not count the tests of their rays, only the kernel does.
+		bool downloadTraversalStats(TraversalStats *stats, std::size_t device = 0) override;
+		// Commands run on the calling thread, so they start as soon as they are queued.
+		std::vector<CommandTiming> getCommandTimings() override;
+		std::size_t getHits() override;
+		std::size_t getDeviceCount() const override;
+		std::string getDeviceName(std::size_t device) const override;
+	private:
+		// Rays of a packet, which all start at the same point.
+		struct Rays {
+			Vec3f origin;
+			Packet dirX, dirY, dirZ;
+			Packet invX, invY, invZ;
+			// Rays only hit boxes and triangles closer than this
+			Packet maxDistance;
+		};
+		// Nearest hits of the rays of a packet.
+		struct Hits {
+			Packet found;
+			Packet distance;
+			// Distance along the ray as computed by the triangle test
+			Packet r;
+			Packet s, t;
+			uint32_t faces[Packet::SIZE];
+		};
+		struct StackEntry {
+			uint32_t node;
+			float entry;
+		};
+		// Records the timing of a command which started at the given time and ends now.
+		void profile(const char *name, CommandTiming::Type type, std::chrono::steady_clock::time_point start, std::size_t bytes = 0);
+		void renderRow(unsigned int x, unsigned int y, unsigned int width, unsigned int tileY, std::vector<StackEntry> &stack);
+		void tracePacket(const unsigned int *xs, const unsigned int *ys, unsigned int count, float *values, std::vector<StackEntry> &stack) const;
+		Packet triangleIntersect(uint32_t face, const Rays &rays, Packet &r, Packet &s, Packet &t, Packet &distance) const;
+		Packet boxIntersect(const float *min, const float *max, std::size_t stride, const Rays &rays, Packet &entry) const;
+		void leafIntersect(uint32_t offset, uint32_t count, Rays &rays, Packet active, Hits &hits) const;
+		Packet leafOccluded(uint32_t offset, uint32_t count, const Rays &rays, Packet active) const;
+		void sceneIntersect(Rays &rays, Packet active, Hits &hits, std::vector<StackEntry> &stack) const;
+		Packet sceneOccluded(const Rays &rays, Packet active, std::vector<StackEntry> &stack) const;
+		float ambientOcclusion(const Vec3f &point, const Vec3f &normal, uint32_t seed, std::vector<StackEntry> &stack) const;
+		Vec3f vertex(const std::vector<float> &array, std::size_t i) const;
+		const RayTracer &rt;
+		ThreadPool pool;
+		// Scene arrays in the layout of the device buffers, vectors are padded to 4 floats
+		std::vector<uint32_t> faces;
+		std::vector<uint32_t> nodes;
+		std::vector<float> aabbs;
+		std::vector<float> vertices;
+		std::vector<float> vnormals;
+		std::vector<float> triangles;
+		unsigned int bvhWidth;
+		std::size_t bvhStackSize;
+		// Directions of the uniform ambient occlusion rays around the y axis
+		std::vector<Vec3f> aoDirections;
+		// Supersamples of the last rendered tile and the pixels of the last resolved one
+		std::vector<float> image;
+		std::vector<unsigned char> pixels;
+		// Sums of the supersamples and their squares over the passes of a progressive render
+		std::vector<float> sums;
+		std::vector<float> squares;
+		// Pass of a progressive render, which is mixed into the seeds of the random samples
+		uint32_t pass;
+		std::atomic<std::size_t> hits;
+		// Timings of the commands so far, relative to the start of the first one
+		std::vector<CommandTiming> commands;
+		std::chrono::steady_clock::time_point firstCommand;
+};
+inline Vec3f CPUHost::vertex(const std::vector<float> &array, std::size_t i) const {
+	return Vec3f(array[i * 4], array[i * 4 + 1], array[i * 4 + 2]);
+}
\ No newline at end of file
@@ -0,0 +1,33 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include <string>
+// Offset basis and prime of the 64 bit FNV-1a hash.
+static const uint64_t HASH_OFFSET = 14695981039346656037ull;
+static const uint64_t HASH_PRIME = 1099511628211ull;
+// FNV-1a over 64 bit words, followed by the remaining bytes. Used to name cache files.
+inline uint64_t hashBytes(const void *data, std::size_t size, uint64_t h = HASH_OFFSET) {
+	const char *bytes = static_cast<const char *>(data);
+	std::size_t i = 0;
+	for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+		uint64_t word;
+		std::memcpy(&word, bytes + i, sizeof(word));
+		h = (h ^ word) * HASH_PRIME;
+	}
+	for (; i < size; ++i) {
+		h = (h ^ (unsigned char) bytes[i]) * HASH_PRIME;
+	}
+	return h;
+}
+inline uint64_t hashBytes(const std::string &data, uint64_t h = HASH_OFFSET) {
+	return hashBytes(data.data(), data.size(), h);
+}
+// Formats a hash as 16 hexadecimal digits.
+inline std::string hashToString(uint64_t h) {
+	std::stringstream ss;
+	ss << std::hex << std::setfill('0') << std::setw(16) << h;
+	return ss.str();
+}
\ No newline at end of file
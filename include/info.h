@@ -10,7 +10,15 @@ class Info {
 		}
 		inline Info() : maxValueSize(100), extraSpace(3) {
 		}
+		// Host phase timed by measure, with its start since the first phase and its duration (in ms)
+		struct Phase {
+			std::string name;
+			double start;
+			double time;
+		};
 		static std::size_t measure(const std::string &jobDescription, const std::function<bool ()> &job, bool synchronous = false);
+		// Returns all phases timed by measure so far, in the order they ended.
+		static const std::vector<Phase> &getPhases();
 		static std::string formatTime(const std::size_t elapsed);
 		inline void setTitle(const std::string &newTitle) {
 			title = newTitle;
@@ -57,6 +65,7 @@ class Info {
 			static const std::string WARNING;
 		};
 	private:
+		static std::vector<Phase> phases;
 		const std::size_t maxValueSize;
 		const std::size_t extraSpace;
 		std::string title;
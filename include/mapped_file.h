@@ -0,0 +1,24 @@
+#pragma once
+#include <cstddef>
+#include <string>
+// Read-only memory mapping of a whole file.
+class MappedFile {
+	public:
+		// Maps the given file, throws if it cannot be read.
+		explicit MappedFile(const std::string &filename);
+		~MappedFile();
+		MappedFile(const MappedFile &) = delete;
+		MappedFile &operator=(const MappedFile &) = delete;
+		// Returns nullptr for empty files.
+		const char *data() const;
+		std::size_t size() const;
+	private:
+		const char *mapping;
+		std::size_t length;
+};
+inline const char *MappedFile::data() const {
+	return mapping;
+}
+inline std::size_t MappedFile::size() const {
+	return length;
+}
\ No newline at end of file
@@ -16,8 +16,8 @@ struct Mesh {
 	std::vector<uint32_t> faces;
 	std::vector<Vec3f> vnormals;
 };
-/* Loads a triangle mesh from an OFF model file. */
-void load_off_mesh(const std::string &filename, Mesh *mesh);
+/* Loads a triangle mesh from an OFF model file and returns the size of the file in bytes. */
+std::size_t load_off_mesh(const std::string &filename, Mesh *mesh);
 /* Saves a triangle mesh to an OFF model file. */
 void save_off_mesh(const Mesh &mesh, const std::string &filename);
 /* Computes vertex normals for the triangle mesh. */
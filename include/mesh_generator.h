@@ -0,0 +1,15 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include "mesh.h"
+// Procedural meshes of controlled size and depth complexity for benchmarks.
+//
+// All meshes lie in front of the camera of the kernel, which is at (0, 0, 2)
+// and looks along -z, and their faces point towards it. Vertex normals are
+// not computed.
+/* Subdivides the faces of an icosahedron the given number of times into a sphere of radius 0.5 around the origin, with 20 * 4^subdivisions triangles. */
+void generate_sphere_mesh(unsigned int subdivisions, Mesh *mesh);
+/* Scatters random triangles over the cube of edge length 1 around the origin, sized so that a ray crosses about depth of them. */
+void generate_triangle_soup(std::size_t triangles, float depth, uint32_t seed, Mesh *mesh);
+/* Tessellates a vaulted nave with an arcade of the given number of columns on either side, with the camera standing in it. */
+void generate_interior_mesh(unsigned int bays, Mesh *mesh);
\ No newline at end of file
@@ -1,9 +1,13 @@
 #pragma once
 #include <CL/cl.hpp>
+#include <deque>
 #include <iostream>
+#include <mutex>
+#include "bvh.h"
 #include "ray_tracer.h"
-#include "vec3.h"
-class OpenCLHost {
+#include "render_backend.h"
+#include "scene.h"
+class OpenCLHost : public RenderBackend {
 	public:
 		static std::string deviceType(const cl_device_type &type) {
 			switch (type) {
@@ -124,15 +128,145 @@ class OpenCLHost {
 					return "UNKNOWN";
 			}
 		}
-		OpenCLHost(const RayTracer &rt);
-		void upload(const std::vector<uint32_t> &faces, const std::vector<uint32_t> &nodes, const std::vector<Vec3f> &aabbs, const std::vector<Vec3f> &vertices, const std::vector<Vec3f> &vnormals);
-		bool operator()();
-		void download(float *image);
+		// Renders on the given devices, which must belong to the same platform. Caches compiled
+		// kernels in the given directory, unless it is empty.
+		OpenCLHost(const RayTracer &rt, const Scene &scene, const std::vector<cl::Device> &devices, const std::string &cacheDir = "");
+		// Selects devices by a comma-separated list of platform:device indices or device types
+		// (gpu, cpu, accelerator, all), optionally splitting each of them into sub-devices.
+		static std::vector<cl::Device> getDevices(const std::string &selection, std::size_t subDevices = 0);
+		void upload(const Scene &scene) override;
+		// Fills the cache with the kernels for all combinations of shading and ambient occlusion.
+		void precompile();
+		// Renders the whole image, which must fit into one tile.
+		bool operator()() override;
+		bool render(unsigned int x, unsigned int y, unsigned int width, unsigned int height, std::size_t device = 0) override;
+		void download(float *image, std::size_t device = 0) override;
+		// Averages the supersamples of the last rendered tile on the device.
+		bool resolve(unsigned int width, unsigned int height, std::size_t device = 0) override;
+		void download(unsigned char *image, unsigned int x, unsigned int y, unsigned int width, unsigned int height, std::size_t device = 0) override;
+		bool renderAdaptive(std::size_t &refined, std::size_t &hits, std::size_t device = 0) override;
+		void setPass(uint32_t pass) override;
+		bool accumulate(unsigned int pass, float &variance, std::size_t device = 0) override;
+		bool downloadTraversalStats(TraversalStats *stats, std::size_t device = 0) override;
+		// Waits for all devices and reads the profiling information of the events of all commands.
+		std::vector<CommandTiming> getCommandTimings() override;
+		std::size_t getHits() override;
+		std::size_t getDeviceCount() const override;
+		std::string getDeviceName(std::size_t device) const override;
 		static void printInfo();
+		// Passes of the wavefront mode, in the order they run.
+		enum Stage { GENERATE, CLOSEST_HIT, GENERATE_AO, SORT_AO, OCCLUSION, ACCUMULATE, STAGE_COUNT };
+		// Prints the device time and the number of items of every pass of the wavefront mode.
+		void printStageTimes() const;
 	private:
+		// Mirrors the Params struct of the kernel.
+		struct Params {
+			cl_uint width;
+			cl_uint height;
+			cl_uint tileWidth;
+			cl_uint tileHeight;
+			cl_float focalLength;
+			cl_uint supersamplesPerAxis;
+			cl_float aoMaxDistance;
+			cl_uint aoNumSamples;
+			cl_int aoAlphaMin;
+			cl_int aoAlphaMax;
+		};
+		// Mirror the queue entries of the wavefront kernels, only their sizes are needed.
+		struct QueuedRay {
+			cl_float4 direction;
+			cl_uint pixel;
+			cl_uint seed;
+		};
+		struct QueuedHit {
+			cl_float4 position;
+			cl_float4 normal;
+			cl_uint pixel;
+			cl_uint seed;
+			cl_float value;
+		};
+		struct Device;
+		// Command whose event is kept until its profiling information is read
+		struct ProfiledCommand {
+			std::string name;
+			CommandTiming::Type type;
+			std::size_t device;
+			std::size_t bytes;
+			cl::Event event;
+		};
+		// Returns the event to enqueue the given command with, or null unless commands are profiled.
+		cl::Event *profile(const std::string &name, CommandTiming::Type type, const Device &d, std::size_t bytes = 0);
+		bool renderWavefront(unsigned int x, unsigned int y, unsigned int width, unsigned int height, Device &d);
+		std::string getBuildOptions(bool shading, bool ao, RayTracer::AmbientOcclusionMethod aoMethod) const;
+		cl::Program compile(const std::string &options);
+		bool loadBinary(const std::string &filename, const std::string &key, const std::string &options, cl::Program &program);
+		void saveBinary(const cl::Program &program, const std::string &filename, const std::string &key);
 		const RayTracer &rt;
+		const std::string cacheDir;
+		const unsigned int bvhWidth;
+		const std::size_t bvhStackSize;
+		// Hits whose ambient occlusion rays are queued at once in the wavefront mode
+		std::size_t aoBatchSize;
+		// Bounds of the scene, which the sort keys of ambient occlusion rays are relative to
+		cl_float4 sceneMin;
+		cl_float4 sceneSize;
+		// Pass of a progressive render, which is mixed into the seeds of the random ambient
+		// occlusion samples
+		cl_uint pass;
+		// Per-device queue, kernels and output buffers. Tiles of different devices can be
+		// rendered concurrently from different threads.
+		struct Device {
+			cl::Device device;
+			cl::CommandQueue queue;
+			cl::Kernel kernel;
+			cl::Kernel resolveKernel;
+			cl::Buffer imageBuffer;
+			cl::Buffer pixelsBuffer;
+			cl::Buffer hitsBuffer;
+			// Counters of every supersample of the tile, written by the instrumented kernel
+			cl::Buffer traversalStatsBuffer;
+			// Kernels of adaptive supersampling, the queue of pixels to refine and the counters
+			cl::Kernel adaptiveBaseKernel;
+			cl::Kernel adaptiveClassifyKernel;
+			cl::Kernel adaptiveRefineKernel;
+			cl::Buffer refineQueueBuffer;
+			cl::Buffer refineCountBuffer;
+			cl::Buffer adaptiveHitsBuffer;
+			// Sums of the values and their squares over the passes of a progressive render
+			cl::Kernel progressiveKernel;
+			cl::Buffer sumsBuffer;
+			cl::Buffer squaresBuffer;
+			cl::Buffer varianceBuffer;
+			// Kernels and queues of the wavefront mode
+			cl::Kernel generateKernel;
+			cl::Kernel closestHitKernel;
+			cl::Kernel generateAOKernel;
+			cl::Kernel occlusionKernel;
+			cl::Kernel accumulateKernel;
+			cl::Buffer rayQueueBuffer;
+			cl::Buffer hitQueueBuffer;
+			cl::Buffer hitCountBuffer;
+			cl::Buffer aoRayQueueBuffer;
+			cl::Buffer occludedBuffer;
+			// Kernels and ping-pong buffers of the sorting of ambient occlusion rays
+			cl::Kernel aoSortKeysKernel;
+			cl::Kernel sortHistogramKernel;
+			cl::Kernel sortScanKernel;
+			cl::Kernel sortScatterKernel;
+			cl::Kernel occlusionSortedKernel;
+			cl::Buffer sortKeysBuffers[2];
+			cl::Buffer sortValuesBuffers[2];
+			cl::Buffer sortHistogramBuffer;
+			// Profiled time (in ns) and number of work items of every pass
+			cl_ulong stageTimes[STAGE_COUNT];
+			std::size_t stageItems[STAGE_COUNT];
+		};
+		std::vector<Device> devices;
+		// Commands of all devices, which are enqueued from the threads of the devices. Events
+		// are filled in after adding them, so they must not move.
+		std::deque<ProfiledCommand> profiledCommands;
+		std::mutex profileMutex;
 		cl::Program program;
-		cl::CommandQueue queue;
 		cl::Context context;
 		// Buffers
 		cl::Buffer facesBuffer;
@@ -140,6 +274,10 @@ class OpenCLHost {
 		cl::Buffer aabbsBuffer;
 		cl::Buffer verticesBuffer;
 		cl::Buffer vnormalsBuffer;
+		cl::Buffer trianglesBuffer;
+		// Directions of the uniform ambient occlusion rays in the frame of the normal, which
+		// the wavefront mode rotates onto every hit
+		cl::Buffer aoDirectionsBuffer;
 // 		cl::Image2D imageBuffer;
-		cl::Buffer imageBuffer;
+		cl::Buffer paramsBuffer;
 };
\ No newline at end of file
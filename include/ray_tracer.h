@@ -1,5 +1,9 @@
 #pragma once
+#include <algorithm>
+#include <cmath>
+#include <vector>
 #include "bvh.h"
+#include "vec3.h"
 class RayTracer {
 	public:
 		// Structure with basic options for raytracer
@@ -13,6 +17,45 @@ class RayTracer {
 		//                      Should be about 10% of the max scene dimension
 		// - aoNumSamples     : Number of samples for each ambient occlusion
 		//                      evaluation
+		// - bvhThreads       : Number of threads for the BVH construction,
+		//                      0 means all hardware threads
+		// - bvhLeafSize      : Maximum number of triangles per BVH leaf
+		// - bvhWidth         : Number of children per BVH node (2, 4 or 8)
+		// - stackTraversal   : switch between the ordered stack traversal and the
+		//                      stackless traversal of binary BVHs
+		// - precomputeTriangles : switch to turn on/off the precomputed triangle
+		//                      buffer (more memory, faster intersections)
+		// - tileSize         : Width and height of the tiles that are rendered one
+		//                      after another (in output pixels), 0 renders the whole
+		//                      image at once
+		// - hostResize       : switch between averaging the supersamples on the
+		//                      host and on the device
+		// - runtimeParams    : switch to pass the image size, the camera and the
+		//                      ambient occlusion parameters as a kernel argument
+		//                      instead of compiling them into the kernel
+		// - wavefront        : switch between the single kernel which traces all rays
+		//                      of a pixel and separate passes connected by ray queues
+		// - sortAORays       : switch to sort the ambient occlusion rays of the
+		//                      wavefront mode by origin and direction before tracing them
+		// - progressive      : switch to keep the sums of the passes of a progressive
+		//                      render, which draw aoNumSamples random samples each
+		// - adaptive         : switch to only trace all supersamples of the pixels
+		//                      whose first supersample stands out from the neighbours
+		// - adaptiveContrast : largest difference of the first supersamples of
+		//                      neighbouring pixels which is not refined
+		// - adaptiveVariance : largest variance of the first supersamples in a 3×3
+		//                      neighbourhood which is not refined
+		// - traversalStats   : switch to build the kernel which counts the bounding
+		//                      box tests, triangle tests and rays of every supersample
+		// - profileCommands  : switch to time every upload, kernel launch and download
+		//                      on the device, for the timing report
+		// - compactBits      : bits of the quantized child boxes of wide BVHs (8 or 16)
+		//                      in the compact layout of the device buffers, which also
+		//                      packs vertices and normals, 0 keeps the float layout
+		// - reorderVertices  : switch to renumber the vertices in the order in which
+		//                      the faces, sorted along the BVH leaves, first use them
+		// - interleaveVertices : switch to upload every vertex next to its normal in
+		//                      a single device buffer
 		enum class AmbientOcclusionMethod { UNIFORM, RANDOM };
 		struct Options {
 			unsigned int width;
@@ -27,14 +70,51 @@ class RayTracer {
 			int aoAlphaMin;
 			int aoAlphaMax;
 			BVH::Method bvhMethod;
+			unsigned int bvhThreads;
+			unsigned int bvhLeafSize;
+			unsigned int bvhWidth;
+			bool stackTraversal;
+			bool precomputeTriangles;
+			unsigned int tileSize;
+			bool hostResize;
+			bool runtimeParams;
+			bool wavefront;
+			bool sortAORays;
+			bool progressive;
+			bool adaptive;
+			float adaptiveContrast;
+			float adaptiveVariance;
+			bool traversalStats;
+			bool profileCommands;
+			unsigned int compactBits;
+			bool reorderVertices;
+			bool interleaveVertices;
 		};
 		RayTracer(Options options) :
 			options(options),
 			totalWidth(options.width * (unsigned int) sqrt(options.nSuperSamples)),
-			totalHeight(options.height * (unsigned int) sqrt(options.nSuperSamples)) {
+			totalHeight(options.height * (unsigned int) sqrt(options.nSuperSamples)),
+			tileWidth(options.tileSize == 0 ? totalWidth : std::min(totalWidth, options.tileSize * (unsigned int) sqrt(options.nSuperSamples))),
+			tileHeight(options.tileSize == 0 ? totalHeight : std::min(totalHeight, options.tileSize * (unsigned int) sqrt(options.nSuperSamples))) {
 		}
 		void resize(float *tmp, unsigned char *image);
+		// Averages the supersamples of a tile with rows of pitch floats into the image.
+		// The position and size of the tile are given in output pixels.
+		void resize(const float *tile, unsigned int pitch, unsigned char *image, unsigned int x, unsigned int y, unsigned int width, unsigned int height) const;
+		// Returns the number of ambient occlusion rays traced for every pixel that hits the scene.
+		// Only the first pass of a progressive render traces the normal and one more sample.
+		unsigned int getAORayCount(bool firstPass = true) const;
+		// Returns the number of ambient occlusion rays which the given number of passes of a
+		// progressive render count for every hit, which weight the passes in their mean.
+		unsigned int getCountedAORays(unsigned int passes) const;
+		// Returns the directions of the uniform ambient occlusion rays in the frame of the normal
+		// (which points along y), in the order in which the kernel traces them. Hosts rotate them
+		// onto every hit, so that they trace exactly getAORayCount() of them.
+		std::vector<Vec3f> getAODirections() const;
 		const Options options;
 		const unsigned int totalWidth;
 		const unsigned int totalHeight;
+		// Size of a tile in supersampled pixels.
+		const unsigned int tileWidth;
+		const unsigned int tileHeight;
 };
\ No newline at end of file
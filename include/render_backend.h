@@ -0,0 +1,75 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "scene.h"
+// Counters of the instrumented kernel for one supersample, summed over its primary ray and
+// all of its ambient occlusion rays. Mirrors the TraversalStats struct of the kernel.
+struct TraversalStats {
+	uint32_t aabbTests;
+	uint32_t triangleTests;
+	uint32_t rays;
+};
+// Timing of one command of a device: an upload, a kernel launch or a download. Times are in ns
+// since the first command of the device, when the command was queued by the host, submitted to
+// the device, started and ended.
+struct CommandTiming {
+	enum class Type { UPLOAD, KERNEL, DOWNLOAD };
+	std::string name;
+	Type type;
+	std::size_t device;
+	// Bytes copied by uploads and downloads, 0 for kernels
+	std::size_t bytes;
+	uint64_t queued;
+	uint64_t submitted;
+	uint64_t started;
+	uint64_t ended;
+};
+// Common interface of the devices that render tiles of the image.
+//
+// A tile is rendered into a buffer of RayTracer::tileWidth by tileHeight
+// supersamples, which is either downloaded as floats or resolved into bytes
+// of output pixels first. Backends with several devices render tiles on all
+// of them concurrently, as long as every device is used by one thread only.
+class RenderBackend {
+	public:
+		virtual ~RenderBackend() {}
+		// Copies the scene to all devices. The scene may be freed afterwards.
+		virtual void upload(const Scene &scene) = 0;
+		// Renders the whole image at once.
+		virtual bool operator()() = 0;
+		// Renders the tile at the given position and size (in supersampled pixels).
+		virtual bool render(unsigned int x, unsigned int y, unsigned int width, unsigned int height, std::size_t device = 0) = 0;
+		// Downloads the last rendered tile, with rows of RayTracer::tileWidth pixels.
+		virtual void download(float *image, std::size_t device = 0) = 0;
+		// Averages the supersamples of the last rendered tile into bytes.
+		// The size of the tile is given in output pixels.
+		virtual bool resolve(unsigned int width, unsigned int height, std::size_t device = 0) = 0;
+		// Downloads the last resolved tile into the image at the given position (in output pixels).
+		virtual void download(unsigned char *image, unsigned int x, unsigned int y, unsigned int width, unsigned int height, std::size_t device = 0) = 0;
+		// Renders the whole image adaptively: one supersample of every pixel first, then all
+		// supersamples of the pixels which stand out from their neighbours, while the first
+		// supersample stands in for all of the others. Sets the number of refined pixels and
+		// of traced supersamples hitting the scene, which is not what resolving counts.
+		virtual bool renderAdaptive(std::size_t &refined, std::size_t &hits, std::size_t device = 0) = 0;
+		// Sets the pass of a progressive render which the following renders draw their random
+		// ambient occlusion samples for. It is mixed into the seeds of the samples, so that
+		// every pass draws new ones.
+		virtual void setPass(uint32_t pass) = 0;
+		// Adds the last rendered tile to the sums of all passes of a progressive render, which
+		// start over with the first pass, and replaces it by the mean of the passes. Sets the
+		// largest variance of the mean of a supersample, which is 0 after the first pass.
+		virtual bool accumulate(unsigned int pass, float &variance, std::size_t device = 0) = 0;
+		// Downloads the traversal counters of every supersample of the last tile rendered at
+		// once, with rows of RayTracer::tileWidth supersamples. Returns false unless the backend
+		// was built with RayTracer::Options::traversalStats and can count them.
+		virtual bool downloadTraversalStats(TraversalStats *stats, std::size_t device = 0) = 0;
+		// Returns the timings of all commands so far, in the order they were queued on every
+		// device. Empty unless the backend was built with RayTracer::Options::profileCommands.
+		virtual std::vector<CommandTiming> getCommandTimings() = 0;
+		// Returns the number of supersamples hitting the scene in all resolved tiles.
+		virtual std::size_t getHits() = 0;
+		virtual std::size_t getDeviceCount() const = 0;
+		virtual std::string getDeviceName(std::size_t device) const = 0;
+};
@@ -0,0 +1,70 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "bvh.h"
+#include "mapped_file.h"
+#include "mesh.h"
+#include "vec3.h"
+// Scene data in exactly the layout of the device buffers.
+//
+// A scene holds the faces sorted along the BVH leaves, the BVH nodes and
+// bounding boxes, the vertices, their normals and the optional precomputed
+// triangles. It is either built from a mesh and its BVH, or loaded from a
+// cache file, in which case the arrays point straight into the mapped file.
+class Scene {
+	public:
+		// Raw bytes of one device buffer.
+		struct Array {
+			const void *data;
+			std::size_t size;
+		};
+		// Identifies the mesh file and the settings a scene was built with.
+		struct Key {
+			uint64_t meshHash;
+			uint32_t bvhMethod;
+			uint32_t bvhLeafSize;
+			uint32_t bvhWidth;
+			uint32_t precomputeTriangles;
+			uint32_t reorderVertices;
+		};
+		Scene();
+		// Sorts the faces along the BVH and takes over the data of the mesh and the BVH.
+		// Optionally renumbers the vertices in the order in which the sorted faces use them.
+		void build(Mesh &mesh, BVH &bvh, bool precomputeTriangles, bool reorderVertices = false);
+		// Maps a cache file. Returns false if it is missing, invalid or built for another key.
+		bool load(const std::string &filename, const Key &key);
+		// Writes the scene to a cache file, along with the time it took to build it.
+		void save(const std::string &filename, const Key &key, std::size_t buildTime) const;
+		// Frees the data once it has been uploaded.
+		void clear();
+		// Returns the time it took to build the scene when it was saved (in ms).
+		std::size_t getBuildTime() const;
+		// Returns a hash of the contents of the given file.
+		static uint64_t hashFile(const std::string &filename);
+		Array faces;
+		Array nodes;
+		Array aabbs;
+		Array vertices;
+		Array vnormals;
+		Array triangles;
+		unsigned int bvhWidth;
+		std::size_t bvhStackSize;
+	private:
+		void setArrays();
+		void reorderVertices();
+		std::vector<uint32_t> faceData;
+		std::vector<uint32_t> nodeData;
+		std::vector<Vec3f> aabbData;
+		std::vector<float> wideAABBData;
+		std::vector<Vec3f> vertexData;
+		std::vector<Vec3f> vnormalData;
+		std::vector<Vec3f> triangleData;
+		std::unique_ptr<MappedFile> file;
+		std::size_t buildTime;
+};
+inline std::size_t Scene::getBuildTime() const {
+	return buildTime;
+}
\ No newline at end of file
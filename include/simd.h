@@ -0,0 +1,162 @@
+#pragma once
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+// Floats of all rays of a packet, one per lane.
+//
+// Uses AVX with 8 lanes or SSE with 4 lanes, depending on the instruction set
+// the file is compiled for, and plain arrays of 4 floats on other targets.
+// Comparisons return masks with all bits of the matching lanes set, which
+// select(), any() and bits() take.
+class Packet {
+	public:
+#if defined(__AVX__)
+		static constexpr unsigned int SIZE = 8;
+		typedef __m256 Type;
+#elif defined(__SSE2__)
+		static constexpr unsigned int SIZE = 4;
+		typedef __m128 Type;
+#else
+		static constexpr unsigned int SIZE = 4;
+		struct Type {
+			float lanes[SIZE];
+		};
+#endif
+		Packet() {}
+		Packet(Type v) : v(v) {}
+		// Sets all lanes to the value.
+		explicit Packet(float value);
+		// Loads SIZE floats, which need not be aligned.
+		static Packet load(const float *values);
+		void store(float *values) const;
+		// Returns a mask of the first count lanes.
+		static Packet firstLanes(unsigned int count);
+		Type v;
+};
+#if defined(__AVX__)
+inline Packet::Packet(float value) : v(_mm256_set1_ps(value)) {}
+inline Packet Packet::load(const float *values) { return _mm256_loadu_ps(values); }
+inline void Packet::store(float *values) const { _mm256_storeu_ps(values, v); }
+inline Packet operator+(Packet a, Packet b) { return _mm256_add_ps(a.v, b.v); }
+inline Packet operator-(Packet a, Packet b) { return _mm256_sub_ps(a.v, b.v); }
+inline Packet operator*(Packet a, Packet b) { return _mm256_mul_ps(a.v, b.v); }
+inline Packet operator/(Packet a, Packet b) { return _mm256_div_ps(a.v, b.v); }
+inline Packet operator<(Packet a, Packet b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+inline Packet operator<=(Packet a, Packet b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ); }
+inline Packet operator>(Packet a, Packet b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ); }
+inline Packet operator>=(Packet a, Packet b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ); }
+inline Packet operator&(Packet a, Packet b) { return _mm256_and_ps(a.v, b.v); }
+inline Packet operator|(Packet a, Packet b) { return _mm256_or_ps(a.v, b.v); }
+// Returns a & ~b.
+inline Packet andNot(Packet a, Packet b) { return _mm256_andnot_ps(b.v, a.v); }
+inline Packet min(Packet a, Packet b) { return _mm256_min_ps(a.v, b.v); }
+inline Packet max(Packet a, Packet b) { return _mm256_max_ps(a.v, b.v); }
+inline Packet sqrt(Packet a) { return _mm256_sqrt_ps(a.v); }
+inline Packet abs(Packet a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v); }
+// Takes the lanes of a where the mask is set and the lanes of b elsewhere.
+inline Packet select(Packet mask, Packet a, Packet b) { return _mm256_blendv_ps(b.v, a.v, mask.v); }
+inline int bits(Packet mask) { return _mm256_movemask_ps(mask.v); }
+#elif defined(__SSE2__)
+inline Packet::Packet(float value) : v(_mm_set1_ps(value)) {}
+inline Packet Packet::load(const float *values) { return _mm_loadu_ps(values); }
+inline void Packet::store(float *values) const { _mm_storeu_ps(values, v); }
+inline Packet operator+(Packet a, Packet b) { return _mm_add_ps(a.v, b.v); }
+inline Packet operator-(Packet a, Packet b) { return _mm_sub_ps(a.v, b.v); }
+inline Packet operator*(Packet a, Packet b) { return _mm_mul_ps(a.v, b.v); }
+inline Packet operator/(Packet a, Packet b) { return _mm_div_ps(a.v, b.v); }
+inline Packet operator<(Packet a, Packet b) { return _mm_cmplt_ps(a.v, b.v); }
+inline Packet operator<=(Packet a, Packet b) { return _mm_cmple_ps(a.v, b.v); }
+inline Packet operator>(Packet a, Packet b) { return _mm_cmpgt_ps(a.v, b.v); }
+inline Packet operator>=(Packet a, Packet b) { return _mm_cmpge_ps(a.v, b.v); }
+inline Packet operator&(Packet a, Packet b) { return _mm_and_ps(a.v, b.v); }
+inline Packet operator|(Packet a, Packet b) { return _mm_or_ps(a.v, b.v); }
+inline Packet andNot(Packet a, Packet b) { return _mm_andnot_ps(b.v, a.v); }
+inline Packet min(Packet a, Packet b) { return _mm_min_ps(a.v, b.v); }
+inline Packet max(Packet a, Packet b) { return _mm_max_ps(a.v, b.v); }
+inline Packet sqrt(Packet a) { return _mm_sqrt_ps(a.v); }
+inline Packet abs(Packet a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a.v); }
+// SSE2 has no blend instruction
+inline Packet select(Packet mask, Packet a, Packet b) { return _mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v)); }
+inline int bits(Packet mask) { return _mm_movemask_ps(mask.v); }
+#else
+// Applies an expression to every lane of a and b
+#define PACKET_LANES(expression) \
+	Packet r; \
+	for (auto i = 0u; i < Packet::SIZE; ++i) { \
+		const float x = a.v.lanes[i]; \
+		const float y = b.v.lanes[i]; \
+		(void) y; \
+		r.v.lanes[i] = (expression); \
+	} \
+	return r;
+inline float maskLane(bool set) {
+	const uint32_t value = set ? 0xFFFFFFFFu : 0u;
+	float lane;
+	std::memcpy(&lane, &value, sizeof(lane));
+	return lane;
+}
+inline uint32_t laneBits(float lane) {
+	uint32_t value;
+	std::memcpy(&value, &lane, sizeof(value));
+	return value;
+}
+inline Packet::Packet(float value) {
+	for (auto i = 0u; i < SIZE; ++i) {
+		v.lanes[i] = value;
+	}
+}
+inline Packet Packet::load(const float *values) {
+	Packet r;
+	std::memcpy(r.v.lanes, values, sizeof(r.v.lanes));
+	return r;
+}
+inline void Packet::store(float *values) const { std::memcpy(values, v.lanes, sizeof(v.lanes)); }
+inline Packet operator+(Packet a, Packet b) { PACKET_LANES(x + y) }
+inline Packet operator-(Packet a, Packet b) { PACKET_LANES(x - y) }
+inline Packet operator*(Packet a, Packet b) { PACKET_LANES(x * y) }
+inline Packet operator/(Packet a, Packet b) { PACKET_LANES(x / y) }
+inline Packet operator<(Packet a, Packet b) { PACKET_LANES(maskLane(x < y)) }
+inline Packet operator<=(Packet a, Packet b) { PACKET_LANES(maskLane(x <= y)) }
+inline Packet operator>(Packet a, Packet b) { PACKET_LANES(maskLane(x > y)) }
+inline Packet operator>=(Packet a, Packet b) { PACKET_LANES(maskLane(x >= y)) }
+inline Packet operator&(Packet a, Packet b) { PACKET_LANES(maskLane((laneBits(x) & laneBits(y)) != 0)) }
+inline Packet operator|(Packet a, Packet b) { PACKET_LANES(maskLane((laneBits(x) | laneBits(y)) != 0)) }
+inline Packet andNot(Packet a, Packet b) { PACKET_LANES(laneBits(y) != 0 ? 0.0f : x) }
+inline Packet min(Packet a, Packet b) { PACKET_LANES(y < x ? y : x) }
+inline Packet max(Packet a, Packet b) { PACKET_LANES(y > x ? y : x) }
+inline Packet sqrt(Packet a) { const Packet b = a; PACKET_LANES(std::sqrt(x)) }
+inline Packet abs(Packet a) { const Packet b = a; PACKET_LANES(std::fabs(x)) }
+inline Packet select(Packet mask, Packet a, Packet b) {
+	Packet r;
+	for (auto i = 0u; i < Packet::SIZE; ++i) {
+		r.v.lanes[i] = laneBits(mask.v.lanes[i]) != 0 ? a.v.lanes[i] : b.v.lanes[i];
+	}
+	return r;
+}
+inline int bits(Packet mask) {
+	int r = 0;
+	for (auto i = 0u; i < Packet::SIZE; ++i) {
+		r |= (laneBits(mask.v.lanes[i]) != 0) << i;
+	}
+	return r;
+}
+#undef PACKET_LANES
+#endif
+inline Packet Packet::firstLanes(unsigned int count) {
+	float lanes[SIZE];
+	for (auto i = 0u; i < SIZE; ++i) {
+		lanes[i] = i < count ? 0.0f : 1.0f;
+	}
+	return load(lanes) < Packet(0.5f);
+}
+inline bool any(Packet mask) {
+	return bits(mask) != 0;
+}
+inline bool all(Packet mask) {
+	return bits(mask) == (1 << Packet::SIZE) - 1;
+}
\ No newline at end of file
@@ -0,0 +1,31 @@
+#pragma once
+#include <cstddef>
+#include <vector>
+#include "render_backend.h"
+#include "ray_tracer.h"
+// Renders frames on all devices of a host at once.
+//
+// Without tiles, the frame is split into bands of rows, whose heights follow
+// the throughput every device reached in the previous frame. With tiles,
+// every device takes the next unrendered tile until none are left. Every
+// device renders and resolves on its own thread and queue.
+class SplitRenderer {
+	public:
+		SplitRenderer(const RayTracer &rt, RenderBackend &host);
+		// Renders one frame into the image of output pixels.
+		bool operator()(unsigned char *image);
+		// Prints the share of the last frame and the throughput of every device.
+		void printStats() const;
+	private:
+		bool renderBands(unsigned char *image);
+		bool renderTiles(unsigned char *image);
+		void balance();
+		const RayTracer &rt;
+		RenderBackend &host;
+		// Fraction of the rows of the next frame per device
+		std::vector<double> shares;
+		// Output rows or tiles of the last frame per device
+		std::vector<std::size_t> work;
+		// Time of the last frame per device (in ms)
+		std::vector<double> times;
+};
\ No newline at end of file
@@ -0,0 +1,61 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+// Work-stealing thread pool.
+//
+// Every worker owns a task queue. Tasks spawned by a worker are pushed to
+// its own queue, which it processes in LIFO order, while idle workers steal
+// the oldest tasks from the other queues. Threads that wait for a task help
+// processing other tasks in the meantime, so tasks may spawn and wait for
+// further tasks without blocking the pool.
+class ThreadPool {
+	public:
+		class Task;
+		typedef std::shared_ptr<Task> Handle;
+		// Creates a pool with the given number of threads (including the
+		// calling thread), 0 means one thread per hardware thread.
+		explicit ThreadPool(std::size_t threads = 0);
+		~ThreadPool();
+		// Schedules a job and returns a handle to wait for it.
+		Handle spawn(std::function<void ()> job);
+		// Waits until the task is done and rethrows its exception, if any.
+		void wait(const Handle &task);
+		// Calls job(begin, end) for consecutive chunks of [0, n) of the given
+		// size in parallel. The chunks do not depend on the number of threads.
+		void parallelFor(std::size_t n, std::size_t chunkSize, const std::function<void (std::size_t, std::size_t)> &job);
+		// Returns the number of threads (including the calling thread).
+		std::size_t size() const;
+		// Returns the number of hardware threads.
+		static std::size_t hardwareThreads();
+	private:
+		struct Queue {
+			std::mutex mutex;
+			std::deque<Handle> tasks;
+		};
+		bool runOne(std::size_t self);
+		void work(std::size_t self);
+		std::size_t self() const;
+		std::vector<std::unique_ptr<Queue>> queues;
+		std::vector<std::thread> workers;
+		std::atomic<std::size_t> pending;
+		std::mutex sleepMutex;
+		std::condition_variable sleep;
+		bool stop;
+};
+class ThreadPool::Task {
+	public:
+		inline Task(std::function<void ()> job) : job(std::move(job)), done(false) {}
+	private:
+		friend class ThreadPool;
+		std::function<void ()> job;
+		std::exception_ptr exception;
+		std::atomic<bool> done;
+};
\ No newline at end of file
@@ -11,14 +11,17 @@ template <typename T> class Vec3 {
 		}
 		explicit Vec3(T value) {
 			std::fill(v, v + 3, value);
+			fourth = (T) 0;
 		}
 		Vec3(const T &nx, const T &ny, const T &nz) {
 			v[X] = nx;
 			v[Y] = ny;
 			v[Z] = nz;
+			fourth = (T) 0;
 		}
 		Vec3(const Vec3<T> &src) {
 			std::copy(src.v, src.v + 3, v);
+			fourth = (T) 0;
 		}
 		Vec3<T> operator=(const Vec3<T> rhs) {
 			std::copy(rhs.v, rhs.v + 3, v);
@@ -91,6 +94,7 @@ template <typename T> class Vec3 {
 		}
 	private:
 		T v[3];
+		// Pads vectors to the size of an OpenCL float4, zero so four component arithmetic works
 		T fourth;
 };
 typedef Vec3<float> Vec3f;
\ No newline at end of file
@@ -1,10 +1,120 @@
-#include <iomanip>
+#include <algorithm>
+#include <array>
+#include <functional>
 #include <iostream>
 #include <limits>
+#include <memory>
 #include "aabb.h"
 #include "bvh.h"
 #include "mesh.h"
 #include "triangle.h"
+// Number of centroid bins per axis for the binned SAH.
+static const std::size_t SAH_BINS = 32;
+// Nodes up to this size are cut by a full SAH sweep instead of binning.
+static const std::size_t SAH_SWEEP_MAX_FACES = 2 * SAH_BINS;
+// Number of Morton code bits per axis.
+static const unsigned int MORTON_BITS = 10;
+// Nodes of the hierarchical linear BVH are cut by the binned SAH as long as their faces
+// differ in the upper 3 * MORTON_CLUSTER_BITS bits of their Morton codes.
+static const unsigned int MORTON_CLUSTER_BITS = 4;
+// Number of bits sorted per radix sort pass.
+static const unsigned int RADIX_BITS = 10;
+// Costs of traversing a node and intersecting a triangle.
+static const float SAH_TRAVERSAL_COST = 1.0f;
+static const float SAH_INTERSECTION_COST = 1.0f;
+// Subtrees with at least this many faces are built as separate tasks.
+static const std::size_t PARALLEL_MIN_TASK_FACES = 4096;
+// Nodes with at least this many faces are bounded and partitioned in parallel, in chunks of the given size.
+static const std::size_t PARALLEL_MIN_PASS_FACES = 65536;
+static const std::size_t PARALLEL_CHUNK_FACES = 16384;
+/*
+* Calls job(begin, end, chunk) on consecutive chunks of [0, n), in parallel if a pool is given and n is large.
+* Returns the number of chunks, which only depends on n.
+*/
+inline std::size_t forChunks(ThreadPool *pool, std::size_t n, const std::function<void (std::size_t, std::size_t, std::size_t)> &job) {
+	if (pool == nullptr || n < PARALLEL_MIN_PASS_FACES) {
+		job(0, n, 0);
+		return 1;
+	}
+	pool->parallelFor(n, PARALLEL_CHUNK_FACES, [&](std::size_t begin, std::size_t end) {
+		job(begin, end, begin / PARALLEL_CHUNK_FACES);
+	});
+	return (n + PARALLEL_CHUNK_FACES - 1) / PARALLEL_CHUNK_FACES;
+}
+inline std::size_t countChunks(ThreadPool *pool, std::size_t n) {
+	return pool == nullptr || n < PARALLEL_MIN_PASS_FACES ? 1 : (n + PARALLEL_CHUNK_FACES - 1) / PARALLEL_CHUNK_FACES;
+}
+/*
+* Splits the face IDs into two lists, keeping their order. isLeft(i) decides where faceIDs[i] goes.
+*/
+inline void partitionFaces(ThreadPool *pool, const std::vector<unsigned int> &faceIDs, const std::function<bool (std::size_t)> &isLeft, std::vector<unsigned int> &leftIDs, std::vector<unsigned int> &rightIDs) {
+	std::vector<unsigned char> left(faceIDs.size());
+	std::vector<std::size_t> leftOffsets(countChunks(pool, faceIDs.size()) + 1);
+	forChunks(pool, faceIDs.size(), [&](std::size_t begin, std::size_t end, std::size_t chunk) {
+		std::size_t count = 0;
+		for (auto i = begin; i < end; ++i) {
+			left[i] = isLeft(i);
+			count += left[i];
+		}
+		leftOffsets[chunk + 1] = count;
+	});
+	for (auto chunk = 1u; chunk < leftOffsets.size(); ++chunk) {
+		leftOffsets[chunk] += leftOffsets[chunk - 1];
+	}
+	leftIDs.resize(leftOffsets.back());
+	rightIDs.resize(faceIDs.size() - leftOffsets.back());
+	forChunks(pool, faceIDs.size(), [&](std::size_t begin, std::size_t end, std::size_t chunk) {
+		std::size_t l = leftOffsets[chunk];
+		std::size_t r = begin - leftOffsets[chunk];
+		for (auto i = begin; i < end; ++i) {
+			if (left[i]) {
+				leftIDs[l++] = faceIDs[i];
+			}
+			else {
+				rightIDs[r++] = faceIDs[i];
+			}
+		}
+	});
+}
+/*
+* Generates the bounding box and the bounding box of the centroids from the cached face bounds.
+*/
+inline void getCachedBBAndBBCentroid(ThreadPool *pool, const std::vector<AABB> &faceBBs, const std::vector<Vec3f> &faceCentroids, const std::vector<unsigned int> &faceIDs, AABB &bb, AABB &bbCentroid) {
+	std::vector<std::pair<AABB, AABB>> chunkBBs(countChunks(pool, faceIDs.size()));
+	forChunks(pool, faceIDs.size(), [&](std::size_t begin, std::size_t end, std::size_t chunk) {
+		for (auto i = begin; i < end; ++i) {
+			chunkBBs[chunk].first.merge(faceBBs[faceIDs[i]]);
+			chunkBBs[chunk].second.merge(faceCentroids[faceIDs[i]]);
+		}
+	});
+	for (auto chunk = 0u; chunk < chunkBBs.size(); ++chunk) {
+		bb.merge(chunkBBs[chunk].first);
+		bbCentroid.merge(chunkBBs[chunk].second);
+	}
+}
+/*
+* Inserts two zero bits in front of each of the lower 10 bits.
+*/
+inline uint32_t expandBits(uint32_t v) {
+	v = (v * 0x00010001u) & 0xFF0000FFu;
+	v = (v * 0x00000101u) & 0x0F00F00Fu;
+	v = (v * 0x00000011u) & 0xC30C30C3u;
+	v = (v * 0x00000005u) & 0x49249249u;
+	return v;
+}
+/*
+* Returns the 30 bit Morton code of a point inside of the bounding box.
+*/
+inline uint32_t getMortonCode(const Vec3f &point, const AABB &bb) {
+	uint32_t code = 0;
+	for (int axis = 0; axis < 3; ++axis) {
+		const float extent = bb.max[axis] - bb.min[axis];
+		const float cells = (1u << MORTON_BITS) - 1;
+		const uint32_t cell = extent > 0 ? (uint32_t) std::min(cells, std::max(0.0f, (point[axis] - bb.min[axis]) / extent * cells)) : 0;
+		code |= expandBits(cell) << (2 - axis);
+	}
+	return code;
+}
 /*
 * Generates the bounding box and the bounding box of the centroids of the triangles.
 */
@@ -34,13 +144,40 @@ inline void getBB(const Mesh &mesh, std::vector<unsigned int> &faceIDs, AABB &bb
 /*
 * Returns the surface area of a bounding box.
 */
-inline float getSurfaceArea(AABB &bb) {
+inline float getSurfaceArea(const AABB &bb) {
 	float bbWidth  = bb.max[0] - bb.min[0];
 	float bbHeight = bb.max[1] - bb.min[1];
 	float bbDepth  = bb.max[2] - bb.min[2];
 	return 2.0 * (bbWidth * bbHeight + bbHeight * bbDepth + bbDepth * bbWidth);
 }
 /*
+* Returns the number of nodes to skip to get past the node with the given first value.
+*/
+inline uint32_t getSubtreeSize(uint32_t node) {
+	return node & BVH::LEAF ? 1 : node;
+}
+/*
+* Returns true iff intersecting all faces of a node is not more expensive than cutting them into the given halves by the SAH.
+*/
+inline bool isLeafCheaper(const Mesh &mesh, const std::vector<unsigned int> &leftIDs, const std::vector<unsigned int> &rightIDs) {
+	AABB leftBB, rightBB;
+	for (auto id : leftIDs) {
+		leftBB.merge(Triangle(&mesh, id).getAABB());
+	}
+	for (auto id : rightIDs) {
+		rightBB.merge(Triangle(&mesh, id).getAABB());
+	}
+	AABB bb = leftBB;
+	bb.merge(rightBB);
+	const float area = getSurfaceArea(bb);
+	if (area <= 0) {
+		return true;
+	}
+	const float leafCost = SAH_INTERSECTION_COST * (leftIDs.size() + rightIDs.size());
+	const float cutCost = SAH_TRAVERSAL_COST + SAH_INTERSECTION_COST * (getSurfaceArea(leftBB) * leftIDs.size() + getSurfaceArea(rightBB) * rightIDs.size()) / area;
+	return leafCost <= cutCost;
+}
+/*
 * Cuts the face IDs into two pieces.
 */
 void BVH::cutFaces(const Mesh &mesh, std::vector<unsigned int> &faceIDs, std::vector<unsigned int> &leftIDs, std::vector<unsigned int> &rightIDs, AABB &bb) {
@@ -51,6 +188,13 @@ void BVH::cutFaces(const Mesh &mesh, std::vector<unsigned int> &faceIDs, std::ve
 		case BVH::Method::SURFACE_AREA_HEURISTIC:
 			cutFacesSAH(mesh, faceIDs, leftIDs, rightIDs, bb);
 			break;
+		case BVH::Method::BINNED_SURFACE_AREA_HEURISTIC:
+			cutFacesBinnedSAH(mesh, faceIDs, leftIDs, rightIDs, bb);
+			break;
+		case BVH::Method::LINEAR:
+		case BVH::Method::HIERARCHICAL_LINEAR:
+			cutFacesMortonCode(mesh, faceIDs, leftIDs, rightIDs, bb);
+			break;
 	}
 }
 /*
@@ -60,7 +204,20 @@ void BVH::cutFacesLongestAxis(const Mesh &mesh, std::vector<unsigned int> &faceI
 //	std::cout << "\rCutting..." << std::flush;
 	/* The problem states that we need to create a bounding box of all the centroids as well. */
 	AABB bbCentroid;
-	getBBAndBBCentroid(mesh, faceIDs, bb, bbCentroid);
+	std::vector<std::pair<AABB, AABB>> chunkBBs(countChunks(pool, faceIDs.size()));
+	forChunks(pool, faceIDs.size(), [&](std::size_t begin, std::size_t end, std::size_t chunk) {
+		for (auto i = begin; i < end; ++i) {
+			/* Get the triangle from the mesh */
+			Triangle tri(&mesh, faceIDs[i]);
+			/* Add its centroid and bounding box */
+			chunkBBs[chunk].first.merge(tri.getAABB());
+			chunkBBs[chunk].second.merge(tri.getCentroid());
+		}
+	});
+	for (auto chunk = 0u; chunk < chunkBBs.size(); ++chunk) {
+		bb.merge(chunkBBs[chunk].first);
+		bbCentroid.merge(chunkBBs[chunk].second);
+	}
 	/* Now we need to take care of the longest axis and its bisection. */
 	/* Get the longest axis */
 	int longestAxis = bbCentroid.getLongestAxis();
@@ -69,18 +226,10 @@ void BVH::cutFacesLongestAxis(const Mesh &mesh, std::vector<unsigned int> &faceI
 	bbCentroid.max[longestAxis] = (bbCentroid.max[longestAxis] + bbCentroid.min[longestAxis]) / 2;
 	/* Set the centroid BV's new maximum extent */
 	/* Since we need to split up the IDs into two lists, we'll just go ahead and create those here.*/
-	for (auto i = 0u; i < faceIDs.size(); ++i) {
-		/* Get the triangle from the mesh */
-		Triangle tri(&mesh, faceIDs[i]);
-		/* Get the current centroid */
-		Vec3f centroid = tri.getCentroid();
-		if (bbCentroid.inside(centroid)) {
-			leftIDs.push_back(faceIDs[i]);
-		}
-		else {
-			rightIDs.push_back(faceIDs[i]);
-		}
-	}
+	partitionFaces(pool, faceIDs, [&](std::size_t i) {
+		/* Get the triangle from the mesh and test its centroid */
+		return bbCentroid.inside(Triangle(&mesh, faceIDs[i]).getCentroid());
+	}, leftIDs, rightIDs);
 	// ensure left is not (I think this won't happen)
 	if (leftIDs.size() == 0) {
 		leftIDs.push_back(rightIDs[rightIDs.size() - 1]);
@@ -96,43 +245,159 @@ void BVH::cutFacesLongestAxis(const Mesh &mesh, std::vector<unsigned int> &faceI
 * The "bootstrap" for building the BVH.
 */
 void BVH::buildBVH(const Mesh &mesh) {
+	std::unique_ptr<ThreadPool> threadPool;
+	if (threads != 1) {
+		threadPool.reset(new ThreadPool(threads));
+		pool = threadPool.get();
+	}
 	std::size_t size = mesh.faces.size() / 3;
 	std::vector<uint32_t> faceIDs(size);
 	for (auto i = 0u; i < size; ++i) {
 		faceIDs[i] = i;
 	}
-	triangles.reserve(size);
-	nodes = std::vector<uint32_t>(size * 2 - 1);
-	aabbs = std::vector<Vec3f>((size * 2 - 1) * 2);
-	std::size_t i = 0;
-	build(mesh, faceIDs, i);
-	nodes.resize(nodes[0]);
-	aabbs.resize(nodes[0] * 2);
+	if (method != BVH::Method::CUT_LONGEST_AXIS && method != BVH::Method::SURFACE_AREA_HEURISTIC) {
+		/* These methods touch every triangle once per level, so cache their bounds. */
+		faceBBs.resize(size);
+		faceCentroids.resize(size);
+		forChunks(pool, size, [&](std::size_t begin, std::size_t end, std::size_t) {
+			for (auto i = begin; i < end; ++i) {
+				Triangle tri(&mesh, i);
+				faceBBs[i] = tri.getAABB();
+				faceCentroids[i] = tri.getCentroid();
+			}
+		});
+	}
+	if (method == BVH::Method::LINEAR || method == BVH::Method::HIERARCHICAL_LINEAR) {
+		sortByMortonCode(faceIDs);
+	}
+	Tree tree;
+	tree.triangles.reserve(size);
+	tree.nodes.reserve((size * 2 - 1) * 2);
+	tree.aabbs.reserve((size * 2 - 1) * 2);
+	build(mesh, faceIDs, tree);
+	triangles = std::move(tree.triangles);
+	nodes = std::move(tree.nodes);
+	aabbs = std::move(tree.aabbs);
+	stackSize = getBinaryStackSize(0);
+	faceBBs = std::vector<AABB>();
+	faceCentroids = std::vector<Vec3f>();
+	faceCodes = std::vector<uint32_t>();
+	pool = nullptr;
 }
 /*
-* Builds an node of the BVH and returns the count of nodes (incl. the current node)
+* Sums up the surface areas of all nodes weighted by their costs.
 */
-unsigned int BVH::build(const Mesh &mesh, std::vector<unsigned int> &faceIDs, std::size_t &i) {
-	uint32_t & node = nodes.at(i);
-	AABB bb;
-	if (faceIDs.size() <= /*MAX_LEAF_TRIANGLES*/1) {
-// 		node.triangles_offset = triangles.size() * 3;
-// 		node.triangles_length = faceIDs.size();
-		/* Push all of our triangles into the node. */
-		for (auto k = 0u; k < faceIDs.size(); ++k) {
-			Triangle tri(&mesh, faceIDs[k]);    /* Get the triangle from the mesh */
-			bb.merge(tri.getAABB());
-			triangles.push_back(tri.getFaceID());
-		}
-		aabbs.at(i * 2) = bb.min;
-		aabbs.at(i * 2 + 1) = bb.max;
-		node = 1;
+float BVH::getSAHCost() const {
+	if (nodes.empty()) {
+		return 0;
+	}
+	float cost = 0;
+	for (auto i = 0u; i < nodes.size(); i += 2) {
+		// Nodes and bounding boxes both have two values per node
+		const float area = getSurfaceArea(AABB(aabbs[i], aabbs[i + 1]));
+		cost += area * (nodes[i] & BVH::LEAF ? (nodes[i] & ~BVH::LEAF) * SAH_INTERSECTION_COST : SAH_TRAVERSAL_COST);
+	}
+	return cost / getSurfaceArea(AABB(aabbs[0], aabbs[1]));
+}
+/*
+* Returns the stack size needed to traverse the binary subtree of node i, the traversal pushes one child per inner node on its way down.
+*/
+std::size_t BVH::getBinaryStackSize(std::size_t i) const {
+	if (nodes[i * 2] & BVH::LEAF) {
+		return 0;
+	}
+	const std::size_t left = i + 1;
+	const std::size_t right = left + getSubtreeSize(nodes[left * 2]);
+	return 1 + std::max(getBinaryStackSize(left), getBinaryStackSize(right));
+}
+void BVH::collapse(std::size_t width) {
+	this->width = width;
+	std::vector<uint32_t> wideNodes;
+	std::vector<float> wideBoxes;
+	stackSize = collapseNode(0, wideNodes, wideBoxes);
+	nodes = std::move(wideNodes);
+	aabbs = std::vector<Vec3f>();
+	wideAABBs = std::move(wideBoxes);
+}
+/*
+* Collapses the binary node i and the nodes below it into wide nodes, appends them and returns the stack size needed to traverse them.
+*/
+std::size_t BVH::collapseNode(std::size_t i, std::vector<uint32_t> &wideNodes, std::vector<float> &wideBoxes) const {
+	std::vector<std::size_t> children;
+	if (nodes[i * 2] & BVH::LEAF) {
+		/* Only happens if the root is a leaf. */
+		children.push_back(i);
 	}
 	else {
-		std::vector<unsigned int> leftIDs;
-		leftIDs.reserve(faceIDs.size());
-		std::vector<unsigned int> rightIDs;
-		rightIDs.reserve(faceIDs.size());
+		children.push_back(i + 1);
+		children.push_back(i + 1 + getSubtreeSize(nodes[(i + 1) * 2]));
+	}
+	// Replace the inner child with the largest surface area by its children until the node is full
+	while (children.size() < width) {
+		std::size_t best = children.size();
+		float bestArea = -1;
+		for (auto k = 0u; k < children.size(); ++k) {
+			const std::size_t child = children[k];
+			if (nodes[child * 2] & BVH::LEAF) {
+				continue;
+			}
+			const float area = getSurfaceArea(AABB(aabbs[child * 2], aabbs[child * 2 + 1]));
+			if (area > bestArea) {
+				best = k;
+				bestArea = area;
+			}
+		}
+		if (best == children.size()) {
+			break;
+		}
+		const std::size_t child = children[best];
+		children[best] = child + 1;
+		children.insert(children.begin() + best + 1, child + 1 + getSubtreeSize(nodes[(child + 1) * 2]));
+	}
+	const std::size_t w = wideNodes.size() / (2 * width);
+	wideNodes.resize(wideNodes.size() + 2 * width, 0);
+	wideBoxes.resize(wideBoxes.size() + 6 * width);
+	for (auto k = 0u; k < width; ++k) {
+		/* Unused children keep the inverted box. */
+		AABB bb;
+		if (k < children.size()) {
+			bb = AABB(aabbs[children[k] * 2], aabbs[children[k] * 2 + 1]);
+		}
+		for (auto axis = 0u; axis < 3; ++axis) {
+			wideBoxes[(w * 6 + axis) * width + k] = bb.min[axis];
+			wideBoxes[(w * 6 + 3 + axis) * width + k] = bb.max[axis];
+		}
+	}
+	std::size_t innerChildren = 0;
+	std::size_t childStackSize = 0;
+	for (auto k = 0u; k < children.size(); ++k) {
+		const std::size_t child = children[k];
+		if (nodes[child * 2] & BVH::LEAF) {
+			wideNodes[w * 2 * width + k] = nodes[child * 2 + 1];
+			wideNodes[w * 2 * width + width + k] = nodes[child * 2] & ~BVH::LEAF;
+		}
+		else {
+			wideNodes[w * 2 * width + k] = wideNodes.size() / (2 * width);
+			childStackSize = std::max(childStackSize, collapseNode(child, wideNodes, wideBoxes));
+			++innerChildren;
+		}
+	}
+	// All inner children are pushed, and the others stay on the stack while one of them is traversed
+	return innerChildren == 0 ? 0 : std::max(innerChildren, innerChildren - 1 + childStackSize);
+}
+/*
+* Builds an node of the BVH and its children, appends them to the tree and returns the count of nodes (incl. the current node)
+*/
+unsigned int BVH::build(const Mesh &mesh, std::vector<unsigned int> &faceIDs, Tree &tree) {
+	const std::size_t i = tree.nodes.size() / 2;
+	tree.nodes.push_back(1);
+	tree.nodes.push_back(tree.triangles.size());
+	tree.aabbs.resize(tree.aabbs.size() + 2);
+	AABB bb;
+	std::vector<unsigned int> leftIDs;
+	std::vector<unsigned int> rightIDs;
+	bool leaf = faceIDs.size() <= 1;
+	if (!leaf) {
 		cutFaces(mesh, faceIDs, leftIDs, rightIDs, bb);
 		if (leftIDs.size() == 0 && rightIDs.size() == 0) {
 			std::cout << "ERROR: invalid cut left/right" << std::endl;
@@ -146,19 +411,57 @@ unsigned int BVH::build(const Mesh &mesh, std::vector<unsigned int> &faceIDs, st
 			std::cout << "ERROR: invalid right cut" << std::endl;
 			std::exit(1);
 		}
-		aabbs.at(i * 2) = bb.min;
-		aabbs.at(i * 2 + 1) = bb.max;
-// 		node.triangles_offset = 0;
-// 		node.triangles_length = 0;
-		++i;
-		node = build(mesh, leftIDs, i);
-		leftIDs.clear();
-		++i;
-		node += build(mesh, rightIDs, i) + 1;
-		rightIDs.clear();
+		/* Small nodes become leaves if the cut does not pay off. */
+		leaf = faceIDs.size() <= maxLeafTriangles && isLeafCheaper(mesh, leftIDs, rightIDs);
+	}
+	if (leaf) {
+		/* Push all of our triangles into the node. */
+		bb = AABB();
+		for (auto k = 0u; k < faceIDs.size(); ++k) {
+			Triangle tri(&mesh, faceIDs[k]);    /* Get the triangle from the mesh */
+			bb.merge(tri.getAABB());
+			tree.triangles.push_back(tri.getFaceID());
+		}
+		tree.nodes[i * 2] = BVH::LEAF | faceIDs.size();
+		tree.aabbs[i * 2] = bb.min;
+		tree.aabbs[i * 2 + 1] = bb.max;
+		return 1;
+	}
+	unsigned int count = 1;
+	if (pool != nullptr && faceIDs.size() >= PARALLEL_MIN_TASK_FACES) {
+		// The right subtree is built into its own arrays and appended afterwards.
+		// Node counts are relative, only its triangle offsets have to be moved.
+		Tree right;
+		unsigned int rightCount = 0;
+		ThreadPool::Handle task = pool->spawn([&] {
+			rightCount = build(mesh, rightIDs, right);
+		});
+		count += build(mesh, leftIDs, tree);
+		pool->wait(task);
+		const uint32_t offset = tree.triangles.size();
+		for (auto k = 1u; k < right.nodes.size(); k += 2) {
+			right.nodes[k] += offset;
+		}
+		tree.nodes.insert(tree.nodes.end(), right.nodes.begin(), right.nodes.end());
+		tree.aabbs.insert(tree.aabbs.end(), right.aabbs.begin(), right.aabbs.end());
+		tree.triangles.insert(tree.triangles.end(), right.triangles.begin(), right.triangles.end());
+		count += rightCount;
 	}
-	//std::cout << nodes.at(i).node_count << std::endl;
-	return node;
+	else {
+		count += build(mesh, leftIDs, tree);
+		count += build(mesh, rightIDs, tree);
+	}
+	if (bb.min[0] > bb.max[0]) {
+		// The cut did not need the bounding box, so merge it from the children
+		const std::size_t left = i + 1;
+		const std::size_t right = left + getSubtreeSize(tree.nodes[left * 2]);
+		bb = AABB(tree.aabbs[left * 2], tree.aabbs[left * 2 + 1]);
+		bb.merge(AABB(tree.aabbs[right * 2], tree.aabbs[right * 2 + 1]));
+	}
+	tree.aabbs[i * 2] = bb.min;
+	tree.aabbs[i * 2 + 1] = bb.max;
+	tree.nodes[i * 2] = count;
+	return count;
 }
 class sortByAxis {
 	public:
@@ -199,7 +502,6 @@ void BVH::cutFacesSAH(const Mesh &mesh, std::vector<unsigned int> &faceIDs, std:
 		countRight = countFaceIDs - 1;
 		// Iterate from the second to the next to last element, so that a subnode isn't empty
 		for (auto i = 1u; i < countFaceIDs - 1; ++i) {
-			std::cout << "\rCutting " << countFaceIDs << " face IDs into two parts... Processing (Axis: " << (int) axis << ") " << std::setw(5) << std::setfill('0') << std::left << (10000 * (i + axis * countFaceIDs) / (countFaceIDs * 3)) / 100.0f << "%..." << std::flush;
 			// Compute right bounding box
 			for (decltype(i) j = i; j < countFaceIDs; ++j) {
 				bbRight.merge(Triangle(&mesh, faceIDs[j]).getAABB());
@@ -234,4 +536,258 @@ void BVH::cutFacesSAH(const Mesh &mesh, std::vector<unsigned int> &faceIDs, std:
 	// Split
 	leftIDs.assign(faceIDs.begin(), faceIDs.begin() + bestPos);
 	rightIDs.assign(faceIDs.begin() + bestPos, faceIDs.end());
+}
+/*
+* Cuts the face IDs by evaluating the SAH between every pair of neighbouring centroids.
+* Unlike cutFacesSAH, the right-hand bounding boxes are accumulated in one sweep.
+*/
+inline void cutFacesSweepSAH(const std::vector<AABB> &faceBBs, const std::vector<Vec3f> &faceCentroids, std::vector<unsigned int> &faceIDs, std::vector<unsigned int> &leftIDs, std::vector<unsigned int> &rightIDs, const AABB &bb) {
+	const std::size_t countFaceIDs = faceIDs.size();
+	const float SACurrent = getSurfaceArea(bb);
+	float minCosts = std::numeric_limits<float>::max();
+	std::size_t bestAxis = 0;
+	std::size_t bestPos = countFaceIDs / 2;
+	std::vector<float> rightCosts(countFaceIDs);
+	std::vector<unsigned int> sorted[3];
+	for (std::size_t axis = 0; axis < 3; ++axis) {
+		sorted[axis] = faceIDs;
+		std::sort(sorted[axis].begin(), sorted[axis].end(), [&](unsigned int i, unsigned int j) {
+			return faceCentroids[i][axis] < faceCentroids[j][axis];
+		});
+		AABB bbRight;
+		for (std::size_t i = countFaceIDs - 1; i > 0; --i) {
+			bbRight.merge(faceBBs[sorted[axis][i]]);
+			rightCosts[i] = getSurfaceArea(bbRight) * (countFaceIDs - i);
+		}
+		AABB bbLeft;
+		for (std::size_t i = 1; i < countFaceIDs; ++i) {
+			bbLeft.merge(faceBBs[sorted[axis][i - 1]]);
+			const float currentCosts = SAH_TRAVERSAL_COST + (getSurfaceArea(bbLeft) * i + rightCosts[i]) / SACurrent * SAH_INTERSECTION_COST;
+			if (currentCosts < minCosts) {
+				minCosts = currentCosts;
+				bestAxis = axis;
+				bestPos = i;
+			}
+		}
+	}
+	leftIDs.assign(sorted[bestAxis].begin(), sorted[bestAxis].begin() + bestPos);
+	rightIDs.assign(sorted[bestAxis].begin() + bestPos, sorted[bestAxis].end());
+}
+/*
+* Cuts the face IDs by evaluating the SAH at the borders of equally sized centroid bins.
+* The best border of each axis is then refined by a full sweep over the faces of its two
+* neighbouring bins, which separates large triangles from small ones with similar centroids.
+* Small nodes are cut by a full sweep right away, since they would leave most bins empty.
+*/
+void BVH::cutFacesBinnedSAH(const Mesh &, std::vector<unsigned int> &faceIDs, std::vector<unsigned int> &leftIDs, std::vector<unsigned int> &rightIDs, AABB &bb) {
+	AABB bbCentroid;
+	getCachedBBAndBBCentroid(pool, faceBBs, faceCentroids, faceIDs, bb, bbCentroid);
+	if (faceIDs.size() <= SAH_SWEEP_MAX_FACES) {
+		cutFacesSweepSAH(faceBBs, faceCentroids, faceIDs, leftIDs, rightIDs, bb);
+		return;
+	}
+	struct Bin {
+		AABB bb;
+		std::size_t count = 0;
+	};
+	std::vector<std::array<Bin, SAH_BINS>> chunkBins(countChunks(pool, faceIDs.size()));
+	const float SACurrent = getSurfaceArea(bb);
+	const std::size_t countFaceIDs = faceIDs.size();
+	std::vector<unsigned char> bin(countFaceIDs);
+	// Positions (into faceIDs) of the faces around the best border, sorted along the axis
+	std::vector<std::size_t> border, bestBorder;
+	std::vector<float> rightCosts;
+	float minCosts = std::numeric_limits<float>::max();
+	int bestAxis = -1;
+	std::size_t bestSplit = 0;
+	std::size_t bestPos = 0;
+	for (int axis = 0; axis < 3; ++axis) {
+		const float extent = bbCentroid.max[axis] - bbCentroid.min[axis];
+		if (extent <= 0) {
+			continue;
+		}
+		const float scale = SAH_BINS / extent;
+		forChunks(pool, countFaceIDs, [&](std::size_t begin, std::size_t end, std::size_t chunk) {
+			std::array<Bin, SAH_BINS> &bins = chunkBins[chunk];
+			bins.fill(Bin());
+			for (auto i = begin; i < end; ++i) {
+				bin[i] = std::min(SAH_BINS - 1, (std::size_t) ((faceCentroids[faceIDs[i]][axis] - bbCentroid.min[axis]) * scale));
+				bins[bin[i]].bb.merge(faceBBs[faceIDs[i]]);
+				++bins[bin[i]].count;
+			}
+		});
+		std::array<Bin, SAH_BINS> bins = chunkBins[0];
+		for (auto chunk = 1u; chunk < chunkBins.size(); ++chunk) {
+			for (std::size_t b = 0; b < SAH_BINS; ++b) {
+				bins[b].bb.merge(chunkBins[chunk][b].bb);
+				bins[b].count += chunkBins[chunk][b].count;
+			}
+		}
+		// Sweep from the right to get the costs of all right sides, then from the left
+		float binRightCosts[SAH_BINS];
+		AABB bbRight;
+		std::size_t countRight = 0;
+		for (std::size_t b = SAH_BINS - 1; b > 0; --b) {
+			bbRight.merge(bins[b].bb);
+			countRight += bins[b].count;
+			binRightCosts[b] = countRight == 0 ? 0 : getSurfaceArea(bbRight) * countRight;
+		}
+		float axisCosts = std::numeric_limits<float>::max();
+		std::size_t split = 0;
+		AABB bbLeft;
+		std::size_t countLeft = 0;
+		for (std::size_t b = 1; b < SAH_BINS; ++b) {
+			bbLeft.merge(bins[b - 1].bb);
+			countLeft += bins[b - 1].count;
+			if (countLeft == 0 || countLeft == countFaceIDs) {
+				continue;
+			}
+			const float currentCosts = getSurfaceArea(bbLeft) * countLeft + binRightCosts[b];
+			if (currentCosts < axisCosts) {
+				axisCosts = currentCosts;
+				split = b;
+			}
+		}
+		if (split == 0) {
+			continue;
+		}
+		// Refine the border by sweeping over the faces of the bins split - 1 and split
+		bbLeft = AABB();
+		bbRight = AABB();
+		countLeft = 0;
+		countRight = 0;
+		for (std::size_t b = 0; b + 1 < split; ++b) {
+			bbLeft.merge(bins[b].bb);
+			countLeft += bins[b].count;
+		}
+		for (std::size_t b = split + 1; b < SAH_BINS; ++b) {
+			bbRight.merge(bins[b].bb);
+			countRight += bins[b].count;
+		}
+		border.clear();
+		for (auto i = 0u; i < countFaceIDs; ++i) {
+			if (bin[i] + 1u == split || bin[i] == split) {
+				border.push_back(i);
+			}
+		}
+		std::sort(border.begin(), border.end(), [&](std::size_t i, std::size_t j) {
+			return faceCentroids[faceIDs[i]][axis] < faceCentroids[faceIDs[j]][axis];
+		});
+		rightCosts.resize(border.size() + 1);
+		for (std::size_t k = border.size(); ; --k) {
+			rightCosts[k] = countRight == 0 ? 0 : getSurfaceArea(bbRight) * countRight;
+			if (k == 0) {
+				break;
+			}
+			bbRight.merge(faceBBs[faceIDs[border[k - 1]]]);
+			++countRight;
+		}
+		for (std::size_t k = 0; ; ++k) {
+			if (countLeft != 0 && countLeft != countFaceIDs) {
+				const float currentCosts = SAH_TRAVERSAL_COST + (getSurfaceArea(bbLeft) * countLeft + rightCosts[k]) / SACurrent * SAH_INTERSECTION_COST;
+				if (currentCosts < minCosts) {
+					minCosts = currentCosts;
+					bestAxis = axis;
+					bestSplit = split;
+					bestPos = k;
+				}
+			}
+			if (k == border.size()) {
+				break;
+			}
+			bbLeft.merge(faceBBs[faceIDs[border[k]]]);
+			++countLeft;
+		}
+		if (bestAxis == axis) {
+			bestBorder.swap(border);
+		}
+	}
+	if (bestAxis < 0) {
+		// All centroids coincide, so any split is as good as any other
+		const std::size_t half = countFaceIDs / 2;
+		leftIDs.assign(faceIDs.begin(), faceIDs.begin() + half);
+		rightIDs.assign(faceIDs.begin() + half, faceIDs.end());
+		return;
+	}
+	// Faces below the border bins go left, the border faces as decided by the sweep
+	const float scale = SAH_BINS / (bbCentroid.max[bestAxis] - bbCentroid.min[bestAxis]);
+	std::vector<unsigned char> side(countFaceIDs, 0);
+	for (std::size_t k = 0; k < bestBorder.size(); ++k) {
+		side[bestBorder[k]] = k < bestPos ? 1 : 2;
+	}
+	partitionFaces(pool, faceIDs, [&](std::size_t i) {
+		if (side[i] != 0) {
+			return side[i] == 1;
+		}
+		const std::size_t b = std::min(SAH_BINS - 1, (std::size_t) ((faceCentroids[faceIDs[i]][bestAxis] - bbCentroid.min[bestAxis]) * scale));
+		return b + 1 < bestSplit;
+	}, leftIDs, rightIDs);
+}
+/*
+* Computes the Morton codes of the face centroids and sorts the face IDs by them (LSD radix sort).
+*/
+void BVH::sortByMortonCode(std::vector<unsigned int> &faceIDs) {
+	AABB bb, bbCentroid;
+	getCachedBBAndBBCentroid(pool, faceBBs, faceCentroids, faceIDs, bb, bbCentroid);
+	faceCodes.resize(faceIDs.size());
+	forChunks(pool, faceIDs.size(), [&](std::size_t begin, std::size_t end, std::size_t) {
+		for (auto i = begin; i < end; ++i) {
+			faceCodes[i] = getMortonCode(faceCentroids[i], bbCentroid);
+		}
+	});
+	const std::size_t buckets = 1u << RADIX_BITS;
+	const std::size_t chunks = countChunks(pool, faceIDs.size());
+	std::vector<unsigned int> sorted(faceIDs.size());
+	std::vector<std::size_t> offsets(chunks * buckets);
+	for (unsigned int shift = 0; shift < 3 * MORTON_BITS; shift += RADIX_BITS) {
+		// Count the digits per chunk, the offsets are ordered by digit first and by chunk second to keep the sort stable
+		std::fill(offsets.begin(), offsets.end(), 0);
+		forChunks(pool, faceIDs.size(), [&](std::size_t begin, std::size_t end, std::size_t chunk) {
+			for (auto i = begin; i < end; ++i) {
+				++offsets[chunk * buckets + ((faceCodes[faceIDs[i]] >> shift) & (buckets - 1))];
+			}
+		});
+		std::size_t offset = 0;
+		for (std::size_t digit = 0; digit < buckets; ++digit) {
+			for (std::size_t chunk = 0; chunk < chunks; ++chunk) {
+				const std::size_t count = offsets[chunk * buckets + digit];
+				offsets[chunk * buckets + digit] = offset;
+				offset += count;
+			}
+		}
+		forChunks(pool, faceIDs.size(), [&](std::size_t begin, std::size_t end, std::size_t chunk) {
+			for (auto i = begin; i < end; ++i) {
+				sorted[offsets[chunk * buckets + ((faceCodes[faceIDs[i]] >> shift) & (buckets - 1))]++] = faceIDs[i];
+			}
+		});
+		faceIDs.swap(sorted);
+	}
+}
+/*
+* Cuts the face IDs, which are sorted by their Morton codes, at the highest bit in which the codes differ.
+* This cuts the space along the longest remaining axis of the Morton code grid.
+*/
+void BVH::cutFacesMortonCode(const Mesh &mesh, std::vector<unsigned int> &faceIDs, std::vector<unsigned int> &leftIDs, std::vector<unsigned int> &rightIDs, AABB &bb) {
+	const uint32_t first = faceCodes[faceIDs.front()];
+	const uint32_t last = faceCodes[faceIDs.back()];
+	const unsigned int clusterShift = 3 * (MORTON_BITS - MORTON_CLUSTER_BITS);
+	if (method == BVH::Method::HIERARCHICAL_LINEAR && faceIDs.size() > SAH_SWEEP_MAX_FACES && (first >> clusterShift) != (last >> clusterShift)) {
+		// The binned SAH keeps the order of the faces, so both sides remain sorted by their Morton codes
+		cutFacesBinnedSAH(mesh, faceIDs, leftIDs, rightIDs, bb);
+		return;
+	}
+	// The bounding box is not needed for the cut, build() merges it from the children
+	std::size_t split = faceIDs.size() / 2;
+	if (first != last) {
+		uint32_t bit = 1u << (3 * MORTON_BITS - 1);
+		while (((first ^ last) & bit) == 0) {
+			bit >>= 1;
+		}
+		// All codes share the bits above, so the ones without the differing bit come first
+		split = std::partition_point(faceIDs.begin(), faceIDs.end(), [&](unsigned int faceID) {
+			return (faceCodes[faceID] & bit) == 0;
+		}) - faceIDs.begin();
+	}
+	leftIDs.assign(faceIDs.begin(), faceIDs.begin() + split);
+	rightIDs.assign(faceIDs.begin() + split, faceIDs.end());
 }
\ No newline at end of file
@@ -0,0 +1,129 @@
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include "compact_layout.h"
+/*
+* Returns the spacing of a grid of top steps from lo which reaches hi. Powers of two make the
+* products of the quantized offsets and the spacing exact, so the kernel decodes the same
+* planes as the host, and spacings of at least an ulp keep the inverted boxes of unused
+* children inverted.
+*/
+inline float gridSpacing(float lo, float hi, uint32_t top) {
+	int exponent;
+	std::frexp(std::max({ (hi - lo) / top, std::max(std::fabs(lo), std::fabs(hi)) * FLT_EPSILON, FLT_MIN }), &exponent);
+	float spacing = std::ldexp(1.0f, exponent);
+	while (lo + top * spacing < hi) {
+		spacing *= 2;
+	}
+	return spacing;
+}
+/*
+* Stores a quantized value with the given number of bits.
+*/
+inline void storeQuantized(unsigned char *data, uint32_t value, unsigned int bits) {
+	if (bits == 8) {
+		*data = (unsigned char) value;
+	}
+	else {
+		const uint16_t value16 = (uint16_t) value;
+		std::memcpy(data, &value16, sizeof(value16));
+	}
+}
+std::vector<unsigned char> quantizeWideAABBs(const float *boxes, std::size_t nodes, unsigned int width, unsigned int bits) {
+	const uint32_t top = (1u << bits) - 1;
+	const std::size_t size = compactBoundsSize(width, bits);
+	std::vector<unsigned char> data(nodes * size);
+	for (std::size_t n = 0; n < nodes; ++n) {
+		const float *node = boxes + n * 6 * width;
+		unsigned char *out = data.data() + n * size;
+		// The grid covers the used children, unused ones have inverted boxes
+		float origin[3], spacing[3];
+		for (auto axis = 0u; axis < 3; ++axis) {
+			float lo = std::numeric_limits<float>::infinity();
+			float hi = -std::numeric_limits<float>::infinity();
+			for (auto k = 0u; k < width; ++k) {
+				if (node[axis * width + k] <= node[(3 + axis) * width + k]) {
+					lo = std::min(lo, node[axis * width + k]);
+					hi = std::max(hi, node[(3 + axis) * width + k]);
+				}
+			}
+			if (lo > hi) {
+				lo = hi = 0.0f;
+			}
+			origin[axis] = lo;
+			spacing[axis] = gridSpacing(lo, hi, top);
+		}
+		std::memcpy(out, origin, sizeof(origin));
+		std::memcpy(out + sizeof(origin), spacing, sizeof(spacing));
+		out += sizeof(origin) + sizeof(spacing);
+		for (auto k = 0u; k < width; ++k) {
+			const bool used = node[k] <= node[3 * width + k];
+			for (auto axis = 0u; axis < 3; ++axis) {
+				const float min = node[axis * width + k];
+				const float max = node[(3 + axis) * width + k];
+				uint32_t qMin = top, qMax = 0;
+				if (used) {
+					// Round outwards, and once more wherever the float planes fall short
+					qMin = (uint32_t) std::min<float>(top, std::max(0.0f, std::floor((min - origin[axis]) / spacing[axis])));
+					qMax = (uint32_t) std::min<float>(top, std::max(0.0f, std::ceil((max - origin[axis]) / spacing[axis])));
+					while (qMin > 0 && origin[axis] + qMin * spacing[axis] > min) {
+						--qMin;
+					}
+					while (qMax < top && origin[axis] + qMax * spacing[axis] < max) {
+						++qMax;
+					}
+				}
+				storeQuantized(out + (axis * width + k) * (bits / 8), qMin, bits);
+				storeQuantized(out + ((3 + axis) * width + k) * (bits / 8), qMax, bits);
+			}
+		}
+	}
+	return data;
+}
+std::vector<float> packVertices(const Vec3f *vertices, std::size_t count) {
+	std::vector<float> data(count * 3);
+	for (std::size_t i = 0; i < count; ++i) {
+		std::copy(&vertices[i][X], &vertices[i][X] + 3, data.begin() + i * 3);
+	}
+	return data;
+}
+/*
+* Projects the normal onto the octahedron |x| + |y| + |z| = 1 and folds the lower half over
+* the diagonals, so that x and y alone identify it.
+*/
+std::vector<uint32_t> encodeNormals(const Vec3f *normals, std::size_t count) {
+	std::vector<uint32_t> data(count);
+	for (std::size_t i = 0; i < count; ++i) {
+		const Vec3f &n = normals[i];
+		const float length = std::fabs(n[X]) + std::fabs(n[Y]) + std::fabs(n[Z]);
+		float x = length > 0.0f ? n[X] / length : 0.0f;
+		float y = length > 0.0f ? n[Y] / length : 0.0f;
+		if (n[Z] < 0.0f) {
+			const float folded = (1.0f - std::fabs(y)) * std::copysign(1.0f, x);
+			y = (1.0f - std::fabs(x)) * std::copysign(1.0f, y);
+			x = folded;
+		}
+		const int16_t qX = (int16_t) std::lround(std::min(std::max(x, -1.0f), 1.0f) * 32767.0f);
+		const int16_t qY = (int16_t) std::lround(std::min(std::max(y, -1.0f), 1.0f) * 32767.0f);
+		data[i] = (uint32_t) (uint16_t) qX | (uint32_t) (uint16_t) qY << 16;
+	}
+	return data;
+}
+std::vector<float> interleaveVertices(const Vec3f *vertices, const Vec3f *normals, std::size_t count, bool encoded) {
+	const std::size_t stride = encoded ? 4 : 8;
+	std::vector<float> data(count * stride, 0.0f);
+	const std::vector<uint32_t> codes = encoded ? encodeNormals(normals, count) : std::vector<uint32_t>();
+	for (std::size_t i = 0; i < count; ++i) {
+		float *out = data.data() + i * stride;
+		std::copy(&vertices[i][X], &vertices[i][X] + 3, out);
+		if (encoded) {
+			std::memcpy(out + 3, &codes[i], sizeof(uint32_t));
+		}
+		else {
+			std::copy(&normals[i][X], &normals[i][X] + 3, out + 4);
+		}
+	}
+	return data;
+}
\ No newline at end of file
@@ -0,0 +1,735 @@
+#include <algorithm>
+#include <bitset>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include "bvh.h"
+#include "cpu_host.h"
+// Constants of the kernel
+static const float PARALLEL_EPSILON = 0.000001f;
+static const float BARYCENTRIC_EPSILON = 0.00001f;
+static const float PRIMARY_MAX_DISTANCE = 100000.0f;
+static const float AO_OFFSET = 1.0f / 100000.0f;
+template <typename T> inline std::vector<T> copyArray(const Scene::Array &array) {
+	std::vector<T> data(array.size / sizeof(T));
+	if (!data.empty()) {
+		std::memcpy(data.data(), array.data, data.size() * sizeof(T));
+	}
+	return data;
+}
+// Returns the number of nodes to skip to get past the given node of a binary BVH and its children.
+inline uint32_t subtreeSize(uint32_t node) {
+	return node & BVH::LEAF ? 1 : node;
+}
+inline std::size_t countLanes(Packet mask) {
+	return std::bitset<Packet::SIZE>(bits(mask)).count();
+}
+// Returns the smallest value of the lanes in the mask.
+inline float horizontalMin(Packet values, Packet mask) {
+	float lanes[Packet::SIZE];
+	values.store(lanes);
+	const int set = bits(mask);
+	float result = std::numeric_limits<float>::infinity();
+	for (auto i = 0u; i < Packet::SIZE; ++i) {
+		if (set >> i & 1) {
+			result = std::min(result, lanes[i]);
+		}
+	}
+	return result;
+}
+// Returns the largest value of the lanes in the mask.
+inline float horizontalMax(Packet values, Packet mask) {
+	float lanes[Packet::SIZE];
+	values.store(lanes);
+	const int set = bits(mask);
+	float result = -std::numeric_limits<float>::infinity();
+	for (auto i = 0u; i < Packet::SIZE; ++i) {
+		if (set >> i & 1) {
+			result = std::max(result, lanes[i]);
+		}
+	}
+	return result;
+}
+// Xorshift generator of the random ambient occlusion, as in the kernel
+inline uint32_t randomInt(uint32_t *v) {
+	const uint32_t t = v[0] ^ (v[0] << 11u);
+	v[0] = v[1];
+	v[1] = v[2];
+	v[2] = v[3];
+	return v[3] = v[3] ^ (v[3] >> 19u) ^ (t ^ (t >> 8u));
+}
+inline void randomSeed(uint32_t *v, uint32_t seed) {
+	v[0] = (123456789u ^ seed) * 88675123u;
+	v[1] = (362436069u ^ seed) * 123456789u;
+	v[2] = (521288629u ^ seed) * 362436069u;
+	v[3] = (88675123u ^ seed) * 521288629u;
+	randomInt(v);
+}
+// Same as random_sample_seed in the kernel
+inline uint32_t randomSampleSeed(uint32_t index, uint32_t pass) {
+	uint64_t z = (((uint64_t) pass << 32) | index) + 0x9E3779B97F4A7C15u;
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9u;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBu;
+	return (uint32_t) (z ^ (z >> 31));
+}
+inline float randomFloat(uint32_t *v) {
+	return 2.32830643653869629E-10f * randomInt(v);
+}
+/*
+* The directions of the uniform ambient occlusion are precomputed in the frame of the normal,
+* so that every hit only has to rotate them.
+*/
+CPUHost::CPUHost(const RayTracer &rt, std::size_t threads) : rt(rt), pool(threads), bvhWidth(2), bvhStackSize(0), aoDirections(rt.getAODirections()), pass(0), hits(0) {
+}
+void CPUHost::upload(const Scene &scene) {
+	const auto start = std::chrono::steady_clock::now();
+	faces = copyArray<uint32_t>(scene.faces);
+	nodes = copyArray<uint32_t>(scene.nodes);
+	aabbs = copyArray<float>(scene.aabbs);
+	vertices = copyArray<float>(scene.vertices);
+	vnormals = copyArray<float>(scene.vnormals);
+	triangles = copyArray<float>(scene.triangles);
+	bvhWidth = scene.bvhWidth;
+	bvhStackSize = scene.bvhStackSize;
+	const std::size_t n = rt.totalWidth / rt.options.width;
+	image.assign(rt.tileWidth * rt.tileHeight, 0.0f);
+	pixels.assign((rt.tileWidth / n) * (rt.tileHeight / n), 0);
+	if (rt.options.progressive) {
+		sums.assign(image.size(), 0.0f);
+		squares.assign(image.size(), 0.0f);
+	}
+	hits = 0;
+	profile("scene", CommandTiming::Type::UPLOAD, start, scene.faces.size + scene.nodes.size + scene.aabbs.size + scene.vertices.size + scene.vnormals.size + scene.triangles.size);
+}
+bool CPUHost::operator()() {
+	return render(0, 0, rt.totalWidth, rt.totalHeight);
+}
+bool CPUHost::render(unsigned int x, unsigned int y, unsigned int width, unsigned int height, std::size_t) {
+	const auto start = std::chrono::steady_clock::now();
+	pool.parallelFor(height, 1, [&](std::size_t begin, std::size_t end) {
+		std::vector<StackEntry> stack;
+		stack.reserve(bvhStackSize + bvhWidth);
+		for (auto row = begin; row < end; ++row) {
+			renderRow(x, y + row, width, row, stack);
+		}
+	});
+	profile("intersect", CommandTiming::Type::KERNEL, start);
+	return true;
+}
+void CPUHost::download(float *image, std::size_t) {
+	const auto start = std::chrono::steady_clock::now();
+	std::copy(this->image.begin(), this->image.end(), image);
+	profile("image", CommandTiming::Type::DOWNLOAD, start, this->image.size() * sizeof(float));
+}
+bool CPUHost::resolve(unsigned int width, unsigned int height, std::size_t) {
+	const auto start = std::chrono::steady_clock::now();
+	const unsigned int n = rt.totalWidth / rt.options.width;
+	pool.parallelFor(height, 16, [&](std::size_t begin, std::size_t end) {
+		std::size_t count = 0;
+		for (auto y = begin; y < end; ++y) {
+			for (auto x = 0u; x < width; ++x) {
+				float total = 0.0f;
+				for (auto ssY = 0u; ssY < n; ++ssY) {
+					for (auto ssX = 0u; ssX < n; ++ssX) {
+						const float value = image[(y * n + ssY) * rt.tileWidth + (x * n + ssX)];
+						total += value;
+						count += value > 0.0f;
+					}
+				}
+				pixels[y * (rt.tileWidth / n) + x] = (unsigned char) (std::min(std::max(total / (n * n), 0.0f), 1.0f) * 255);
+			}
+		}
+		hits += count;
+	});
+	profile("resolve", CommandTiming::Type::KERNEL, start);
+	return true;
+}
+void CPUHost::download(unsigned char *image, unsigned int x, unsigned int y, unsigned int width, unsigned int height, std::size_t) {
+	const auto start = std::chrono::steady_clock::now();
+	const std::size_t pitch = rt.tileWidth / (rt.totalWidth / rt.options.width);
+	for (auto row = 0u; row < height; ++row) {
+		std::copy(pixels.begin() + row * pitch, pixels.begin() + row * pitch + width, image + (y + row) * rt.options.width + x);
+	}
+	profile("pixels", CommandTiming::Type::DOWNLOAD, start, width * height);
+}
+/*
+* Same passes as the adaptive kernels. The first supersamples of a row of pixels and the other
+* supersamples of a refined pixel are traced in packets.
+*/
+bool CPUHost::renderAdaptive(std::size_t &refined, std::size_t &hits, std::size_t) {
+	const auto start = std::chrono::steady_clock::now();
+	const unsigned int n = rt.totalWidth / rt.options.width;
+	const unsigned int base = n / 2;
+	const unsigned int width = rt.options.width;
+	const unsigned int height = rt.options.height;
+	std::atomic<std::size_t> traced(0);
+	pool.parallelFor(height, 1, [&](std::size_t begin, std::size_t end) {
+		std::vector<StackEntry> stack;
+		stack.reserve(bvhStackSize + bvhWidth);
+		std::size_t count = 0;
+		for (auto y = begin; y < end; ++y) {
+			for (auto x = 0u; x < width; x += Packet::SIZE) {
+				const unsigned int lanes = std::min(Packet::SIZE, width - x);
+				unsigned int xs[Packet::SIZE], ys[Packet::SIZE];
+				float values[Packet::SIZE];
+				for (auto lane = 0u; lane < lanes; ++lane) {
+					xs[lane] = (x + lane) * n + base;
+					ys[lane] = y * n + base;
+				}
+				tracePacket(xs, ys, lanes, values, stack);
+				for (auto lane = 0u; lane < lanes; ++lane) {
+					image[ys[lane] * rt.tileWidth + xs[lane]] = values[lane];
+					count += values[lane] > 0.0f;
+				}
+			}
+		}
+		traced += count;
+	});
+	// Neighbours only read the first supersamples, which are not written here
+	const auto first = [&](unsigned int x, unsigned int y) {
+		return image[(y * n + base) * rt.tileWidth + x * n + base];
+	};
+	std::vector<char> refine(width * height, 0);
+	pool.parallelFor(height, 16, [&](std::size_t begin, std::size_t end) {
+		for (auto y = (unsigned int) begin; y < end; ++y) {
+			for (auto x = 0u; x < width; ++x) {
+				const float value = first(x, y);
+				float difference = 0.0f;
+				float sum = 0.0f;
+				float squares = 0.0f;
+				unsigned int count = 0;
+				for (auto ny = std::max(y, 1u) - 1; ny <= std::min(y + 1, height - 1); ++ny) {
+					for (auto nx = std::max(x, 1u) - 1; nx <= std::min(x + 1, width - 1); ++nx) {
+						const float neighbour = first(nx, ny);
+						difference = std::max(difference, std::fabs(neighbour - value));
+						sum += neighbour;
+						squares += neighbour * neighbour;
+						++count;
+					}
+				}
+				const float mean = sum / count;
+				if (difference > rt.options.adaptiveContrast || squares / count - mean * mean > rt.options.adaptiveVariance) {
+					refine[y * width + x] = 1;
+					continue;
+				}
+				for (auto k = 0u; k < n * n; ++k) {
+					if (k != base * n + base) {
+						image[(y * n + k / n) * rt.tileWidth + x * n + k % n] = value;
+					}
+				}
+			}
+		}
+	});
+	std::vector<uint32_t> queue;
+	for (auto pixel = 0u; pixel < refine.size(); ++pixel) {
+		if (refine[pixel]) {
+			queue.push_back(pixel);
+		}
+	}
+	pool.parallelFor(queue.size(), 16, [&](std::size_t begin, std::size_t end) {
+		std::vector<StackEntry> stack;
+		stack.reserve(bvhStackSize + bvhWidth);
+		std::size_t count = 0;
+		unsigned int xs[Packet::SIZE], ys[Packet::SIZE];
+		float values[Packet::SIZE];
+		unsigned int lanes = 0;
+		const auto flush = [&] {
+			tracePacket(xs, ys, lanes, values, stack);
+			for (auto lane = 0u; lane < lanes; ++lane) {
+				image[ys[lane] * rt.tileWidth + xs[lane]] = values[lane];
+				count += values[lane] > 0.0f;
+			}
+			lanes = 0;
+		};
+		for (auto i = begin; i < end; ++i) {
+			const unsigned int x = queue[i] % width;
+			const unsigned int y = queue[i] / width;
+			for (auto k = 0u; k < n * n; ++k) {
+				if (k == base * n + base) {
+					continue;
+				}
+				xs[lanes] = x * n + k % n;
+				ys[lanes] = y * n + k / n;
+				if (++lanes == Packet::SIZE) {
+					flush();
+				}
+			}
+		}
+		if (lanes > 0) {
+			flush();
+		}
+		traced += count;
+	});
+	// Pixels of a single supersample have nothing to refine
+	refined = n > 1 ? queue.size() : 0;
+	hits = traced;
+	profile("adaptive", CommandTiming::Type::KERNEL, start);
+	return true;
+}
+void CPUHost::setPass(uint32_t pass) {
+	this->pass = pass;
+}
+/*
+* Same as the progressive_accumulate kernel, every block of rows keeps its own largest variance.
+*/
+bool CPUHost::accumulate(unsigned int pass, float &variance, std::size_t) {
+	const auto start = std::chrono::steady_clock::now();
+	std::atomic<float> maxVariance(0.0f);
+	const float weight = rt.getCountedAORays(pass + 1) - rt.getCountedAORays(pass);
+	const float total = rt.getCountedAORays(pass + 1);
+	pool.parallelFor(rt.tileHeight, 16, [&](std::size_t begin, std::size_t end) {
+		float blockVariance = 0.0f;
+		for (auto i = begin * rt.tileWidth; i < end * rt.tileWidth; ++i) {
+			const float value = image[i];
+			sums[i] = pass == 0 ? weight * value : sums[i] + weight * value;
+			squares[i] = pass == 0 ? weight * value * value : squares[i] + weight * value * value;
+			const float n = pass + 1;
+			const float mean = sums[i] / total;
+			image[i] = mean;
+			if (pass > 0) {
+				blockVariance = std::max(blockVariance, (squares[i] / total - mean * mean) / (n - 1.0f));
+			}
+		}
+		float current = maxVariance;
+		while (blockVariance > current && !maxVariance.compare_exchange_weak(current, blockVariance)) {
+		}
+	});
+	variance = maxVariance;
+	profile("progressive_accumulate", CommandTiming::Type::KERNEL, start);
+	return true;
+}
+bool CPUHost::downloadTraversalStats(TraversalStats *, std::size_t) {
+	return false;
+}
+std::vector<CommandTiming> CPUHost::getCommandTimings() {
+	return commands;
+}
+std::size_t CPUHost::getHits() {
+	return hits;
+}
+std::size_t CPUHost::getDeviceCount() const {
+	return 1;
+}
+std::string CPUHost::getDeviceName(std::size_t) const {
+#if defined(__AVX__)
+	const std::string instructions = "AVX";
+#elif defined(__SSE2__)
+	const std::string instructions = "SSE";
+#else
+	const std::string instructions = "scalar";
+#endif
+	return "CPU (" + std::to_string(pool.size()) + " threads, " + instructions + " packets of " + std::to_string(Packet::SIZE) + " rays)";
+}
+void CPUHost::profile(const char *name, CommandTiming::Type type, std::chrono::steady_clock::time_point start, std::size_t bytes) {
+	if (!rt.options.profileCommands) {
+		return;
+	}
+	if (commands.empty()) {
+		firstCommand = start;
+	}
+	const uint64_t started = std::chrono::duration_cast<std::chrono::nanoseconds>(start - firstCommand).count();
+	const uint64_t ended = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - firstCommand).count();
+	commands.push_back({ name, type, 0, bytes, started, started, started, ended });
+}
+/*
+* Traces the primary rays of a row of the tile in packets of neighbouring pixels.
+*/
+void CPUHost::renderRow(unsigned int x, unsigned int y, unsigned int width, unsigned int tileY, std::vector<StackEntry> &stack) {
+	for (auto tileX = 0u; tileX < width; tileX += Packet::SIZE) {
+		const unsigned int count = std::min(Packet::SIZE, width - tileX);
+		unsigned int xs[Packet::SIZE], ys[Packet::SIZE];
+		for (auto lane = 0u; lane < count; ++lane) {
+			xs[lane] = x + tileX + lane;
+			ys[lane] = y;
+		}
+		tracePacket(xs, ys, count, &image[tileY * rt.tileWidth + tileX], stack);
+	}
+}
+/*
+* Traces the primary rays of count supersamples at the given positions of the whole image
+* in a packet and stores their values. Unused lanes repeat the last ray.
+*/
+void CPUHost::tracePacket(const unsigned int *xs, const unsigned int *ys, unsigned int count, float *values, std::vector<StackEntry> &stack) const {
+	const float w = rt.totalWidth;
+	const float h = rt.totalHeight;
+	const float a = rt.options.focalLength * std::max(w, h);
+	Rays rays;
+	rays.origin = Vec3f(0.0f, 0.0f, 2.0f);
+	Vec3f directions[Packet::SIZE];
+	float dirX[Packet::SIZE], dirY[Packet::SIZE], dirZ[Packet::SIZE];
+	for (auto lane = 0u; lane < Packet::SIZE; ++lane) {
+		const float pixelX = xs[std::min(lane, count - 1)];
+		const float pixelY = ys[std::min(lane, count - 1)];
+		directions[lane] = Vec3f((pixelX + 0.5f) / a - w / (2.0f * a), -((pixelY + 0.5f) / a - h / (2.0f * a)), -1.0f).normalized();
+		dirX[lane] = directions[lane][X];
+		dirY[lane] = directions[lane][Y];
+		dirZ[lane] = directions[lane][Z];
+	}
+	rays.dirX = Packet::load(dirX);
+	rays.dirY = Packet::load(dirY);
+	rays.dirZ = Packet::load(dirZ);
+	rays.invX = Packet(1.0f) / rays.dirX;
+	rays.invY = Packet(1.0f) / rays.dirY;
+	rays.invZ = Packet(1.0f) / rays.dirZ;
+	rays.maxDistance = Packet(PRIMARY_MAX_DISTANCE);
+	Hits hits;
+	hits.found = Packet(0.0f) < Packet(0.0f);
+	hits.distance = Packet(std::numeric_limits<float>::infinity());
+	hits.r = hits.s = hits.t = Packet(0.0f);
+	sceneIntersect(rays, Packet::firstLanes(count), hits, stack);
+	float r[Packet::SIZE], s[Packet::SIZE], t[Packet::SIZE];
+	hits.r.store(r);
+	hits.s.store(s);
+	hits.t.store(t);
+	const int found = bits(hits.found);
+	for (auto lane = 0u; lane < count; ++lane) {
+		float value = 0.0f;
+		if (found >> lane & 1) {
+			const uint32_t face = hits.faces[lane];
+			const float b0 = 1.0f - s[lane] - t[lane];
+			const Vec3f normal = (vertex(vnormals, faces[face]) * b0 + vertex(vnormals, faces[face + 1]) * s[lane] + vertex(vnormals, faces[face + 2]) * t[lane]).normalized();
+			value = 1.0f;
+			if (rt.options.enableShading) {
+				value = std::min(std::max(-normal.dot(directions[lane]), 0.0f), 1.0f);
+			}
+			if (rt.options.enableAO) {
+				const Vec3f position = rays.origin + directions[lane] * r[lane];
+				value *= ambientOcclusion(position, normal, randomSampleSeed(ys[lane] * rt.totalWidth + xs[lane], pass), stack);
+			}
+		}
+		values[lane] = value;
+	}
+}
+/*
+* Tests all rays of the packet against one triangle with the test the kernel uses for the
+* triangle layout. Returns the mask of the rays which hit it.
+*/
+Packet CPUHost::triangleIntersect(uint32_t face, const Rays &rays, Packet &r, Packet &s, Packet &t, Packet &distance) const {
+	const Packet one(1.0f + BARYCENTRIC_EPSILON);
+	const Packet zero(-BARYCENTRIC_EPSILON);
+	if (rt.options.precomputeTriangles) {
+		// Möller-Trumbore test on the first vertex and both edges
+		const Vec3f v0 = vertex(triangles, face);
+		const Vec3f e1 = vertex(triangles, face + 1);
+		const Vec3f e2 = vertex(triangles, face + 2);
+		const Packet pX = rays.dirY * Packet(e2[Z]) - rays.dirZ * Packet(e2[Y]);
+		const Packet pY = rays.dirZ * Packet(e2[X]) - rays.dirX * Packet(e2[Z]);
+		const Packet pZ = rays.dirX * Packet(e2[Y]) - rays.dirY * Packet(e2[X]);
+		const Packet det = Packet(e1[X]) * pX + Packet(e1[Y]) * pY + Packet(e1[Z]) * pZ;
+		const Packet invDet = Packet(1.0f) / det;
+		// All rays start at the same point, so w and q are the same for all of them
+		const Vec3f w = rays.origin - v0;
+		const Vec3f q = w.cross(e1);
+		s = (Packet(w[X]) * pX + Packet(w[Y]) * pY + Packet(w[Z]) * pZ) * invDet;
+		t = (rays.dirX * Packet(q[X]) + rays.dirY * Packet(q[Y]) + rays.dirZ * Packet(q[Z])) * invDet;
+		distance = r = Packet(e2.dot(q)) * invDet;
+		return (abs(det) >= Packet(PARALLEL_EPSILON)) & (s >= zero) & (s <= one) & (t >= zero) & (s + t <= one) & (distance >= Packet(0.0f));
+	}
+	// Intersection with the plane of the triangle, followed by its parametric coordinates
+	const Vec3f ta = vertex(vertices, faces[face]);
+	const Vec3f u = vertex(vertices, faces[face + 1]) - ta;
+	const Vec3f v = vertex(vertices, faces[face + 2]) - ta;
+	const Vec3f n = u.cross(v);
+	const Vec3f w0 = rays.origin - ta;
+	const Packet b = Packet(n[X]) * rays.dirX + Packet(n[Y]) * rays.dirY + Packet(n[Z]) * rays.dirZ;
+	r = Packet(-n.dot(w0)) / b;
+	const Packet rX = r * rays.dirX;
+	const Packet rY = r * rays.dirY;
+	const Packet rZ = r * rays.dirZ;
+	const Packet wX = Packet(w0[X]) + rX;
+	const Packet wY = Packet(w0[Y]) + rY;
+	const Packet wZ = Packet(w0[Z]) + rZ;
+	const float uu = u.dot(u);
+	const float uv = u.dot(v);
+	const float vv = v.dot(v);
+	const Packet wu = Packet(u[X]) * wX + Packet(u[Y]) * wY + Packet(u[Z]) * wZ;
+	const Packet wv = Packet(v[X]) * wX + Packet(v[Y]) * wY + Packet(v[Z]) * wZ;
+	const Packet d(uv * uv - uu * vv);
+	s = (Packet(uv) * wv - Packet(vv) * wu) / d;
+	t = (Packet(uv) * wu - Packet(uu) * wv) / d;
+	distance = sqrt(rX * rX + rY * rY + rZ * rZ);
+	return (abs(b) >= Packet(PARALLEL_EPSILON)) & (r >= Packet(0.0f)) & (s >= zero) & (s <= one) & (t >= zero) & (s + t <= one);
+}
+/*
+* Slab test of all rays of the packet against one box, whose coordinates are stride floats apart.
+* Also returns the distances at which the rays enter the box. As in the kernel, the sign of the
+* direction selects the nearer plane, so that the inverted boxes of unused children are missed.
+*/
+Packet CPUHost::boxIntersect(const float *min, const float *max, std::size_t stride, const Rays &rays, Packet &entry) const {
+	const Packet zero(0.0f);
+	const Packet t0X = Packet(min[0] - rays.origin[X]) * rays.invX;
+	const Packet t1X = Packet(max[0] - rays.origin[X]) * rays.invX;
+	const Packet t0Y = Packet(min[stride] - rays.origin[Y]) * rays.invY;
+	const Packet t1Y = Packet(max[stride] - rays.origin[Y]) * rays.invY;
+	const Packet t0Z = Packet(min[2 * stride] - rays.origin[Z]) * rays.invZ;
+	const Packet t1Z = Packet(max[2 * stride] - rays.origin[Z]) * rays.invZ;
+	const Packet negativeX = rays.invX < zero;
+	const Packet negativeY = rays.invY < zero;
+	const Packet negativeZ = rays.invZ < zero;
+	const Packet tMin = ::max(::max(select(negativeX, t1X, t0X), select(negativeY, t1Y, t0Y)), select(negativeZ, t1Z, t0Z));
+	const Packet tMax = ::min(::min(select(negativeX, t0X, t1X), select(negativeY, t0Y, t1Y)), select(negativeZ, t0Z, t1Z));
+	entry = tMin;
+	return (tMin <= tMax) & (tMin < rays.maxDistance) & (tMax > zero);
+}
+void CPUHost::leafIntersect(uint32_t offset, uint32_t count, Rays &rays, Packet active, Hits &hits) const {
+	const uint32_t end = (offset + count) * 3;
+	for (uint32_t face = offset * 3; face < end; face += 3) {
+		Packet r, s, t, distance;
+		// The distance is only set once the test has run
+		const Packet hit = triangleIntersect(face, rays, r, s, t, distance) & active;
+		const Packet closer = hit & (distance < hits.distance);
+		const int closerBits = bits(closer);
+		if (closerBits == 0) {
+			continue;
+		}
+		hits.found = hits.found | closer;
+		hits.distance = select(closer, distance, hits.distance);
+		hits.r = select(closer, r, hits.r);
+		hits.s = select(closer, s, hits.s);
+		hits.t = select(closer, t, hits.t);
+		for (auto lane = 0u; lane < Packet::SIZE; ++lane) {
+			if (closerBits >> lane & 1) {
+				hits.faces[lane] = face;
+			}
+		}
+		// Boxes behind the nearest hit cannot hold nearer triangles
+		rays.maxDistance = select(closer, ::min(rays.maxDistance, distance), rays.maxDistance);
+	}
+}
+Packet CPUHost::leafOccluded(uint32_t offset, uint32_t count, const Rays &rays, Packet active) const {
+	Packet occluded = active < active;
+	const uint32_t end = (offset + count) * 3;
+	for (uint32_t face = offset * 3; face < end && bits(occluded) != bits(active); face += 3) {
+		Packet r, s, t, distance;
+		// The distance is only set once the test has run
+		const Packet hit = triangleIntersect(face, rays, r, s, t, distance) & active;
+		occluded = occluded | (hit & (distance <= rays.maxDistance));
+	}
+	return occluded;
+}
+/*
+* Visits the nodes which any ray of the packet hits, nearer children first. Popped nodes are
+* skipped once all rays hit something nearer than the nearest entry into them.
+*/
+void CPUHost::sceneIntersect(Rays &rays, Packet active, Hits &hits, std::vector<StackEntry> &stack) const {
+	stack.clear();
+	const auto pop = [&](uint32_t &node) {
+		const float maxDistance = horizontalMax(rays.maxDistance, active);
+		while (!stack.empty()) {
+			const StackEntry next = stack.back();
+			stack.pop_back();
+			if (next.entry < maxDistance) {
+				node = next.node;
+				return true;
+			}
+		}
+		return false;
+	};
+	Packet entry;
+	uint32_t i = 0;
+	if (bvhWidth == 2) {
+		if (!any(boxIntersect(&aabbs[0], &aabbs[4], 1, rays, entry) & active)) {
+			return;
+		}
+		for (;;) {
+			const uint32_t node = nodes[i * 2];
+			if (node & BVH::LEAF) {
+				leafIntersect(nodes[i * 2 + 1], node & ~BVH::LEAF, rays, active, hits);
+			}
+			else {
+				const uint32_t left = i + 1;
+				const uint32_t right = left + subtreeSize(nodes[left * 2]);
+				Packet entryLeft, entryRight;
+				const Packet hitLeft = boxIntersect(&aabbs[left * 8], &aabbs[left * 8 + 4], 1, rays, entryLeft) & active;
+				const Packet hitRight = boxIntersect(&aabbs[right * 8], &aabbs[right * 8 + 4], 1, rays, entryRight) & active;
+				if (any(hitLeft) && any(hitRight)) {
+					// Follow the child which most of the rays enter first
+					const Packet both = hitLeft & hitRight;
+					const bool leftFirst = 2 * countLanes(both & (entryLeft <= entryRight)) >= countLanes(both);
+					stack.push_back(leftFirst ? StackEntry{ right, horizontalMin(entryRight, hitRight) } : StackEntry{ left, horizontalMin(entryLeft, hitLeft) });
+					i = leftFirst ? left : right;
+					continue;
+				}
+				if (any(hitLeft) || any(hitRight)) {
+					i = any(hitLeft) ? left : right;
+					continue;
+				}
+			}
+			if (!pop(i)) {
+				return;
+			}
+		}
+	}
+	for (;;) {
+		// Children are followed by the number of triangles of each child, 0 for inner children
+		const uint32_t *children = &nodes[i * 2 * bvhWidth];
+		const float *bounds = &aabbs[i * 6 * bvhWidth];
+		const std::size_t first = stack.size();
+		for (auto k = 0u; k < bvhWidth; ++k) {
+			const Packet hit = boxIntersect(bounds + k, bounds + 3 * bvhWidth + k, bvhWidth, rays, entry) & active;
+			if (!any(hit)) {
+				continue;
+			}
+			const uint32_t triangleCount = children[bvhWidth + k];
+			if (triangleCount == 0) {
+				stack.push_back(StackEntry{ children[k], horizontalMin(entry, hit) });
+			}
+			else {
+				leafIntersect(children[k], triangleCount, rays, active, hits);
+			}
+		}
+		// The nearest child is popped first
+		std::sort(stack.begin() + first, stack.end(), [](const StackEntry &a, const StackEntry &b) {
+			return a.entry > b.entry;
+		});
+		if (!pop(i)) {
+			return;
+		}
+	}
+}
+/*
+* Returns the mask of the active rays which hit any triangle. Stops as soon as all of them do.
+*/
+Packet CPUHost::sceneOccluded(const Rays &rays, Packet active, std::vector<StackEntry> &stack) const {
+	stack.clear();
+	Packet occluded = active < active;
+	Packet entry;
+	uint32_t i = 0;
+	if (bvhWidth == 2) {
+		if (!any(boxIntersect(&aabbs[0], &aabbs[4], 1, rays, entry) & active)) {
+			return occluded;
+		}
+		for (;;) {
+			const Packet pending = andNot(active, occluded);
+			const uint32_t node = nodes[i * 2];
+			if (node & BVH::LEAF) {
+				occluded = occluded | leafOccluded(nodes[i * 2 + 1], node & ~BVH::LEAF, rays, pending);
+				if (!any(andNot(active, occluded))) {
+					return occluded;
+				}
+			}
+			else {
+				const uint32_t left = i + 1;
+				const uint32_t right = left + subtreeSize(nodes[left * 2]);
+				const bool hitLeft = any(boxIntersect(&aabbs[left * 8], &aabbs[left * 8 + 4], 1, rays, entry) & pending);
+				const bool hitRight = any(boxIntersect(&aabbs[right * 8], &aabbs[right * 8 + 4], 1, rays, entry) & pending);
+				if (hitLeft && hitRight) {
+					stack.push_back(StackEntry{ right, 0.0f });
+				}
+				if (hitLeft || hitRight) {
+					i = hitLeft ? left : right;
+					continue;
+				}
+			}
+			if (stack.empty()) {
+				return occluded;
+			}
+			i = stack.back().node;
+			stack.pop_back();
+		}
+	}
+	for (;;) {
+		const Packet pending = andNot(active, occluded);
+		const uint32_t *children = &nodes[i * 2 * bvhWidth];
+		const float *bounds = &aabbs[i * 6 * bvhWidth];
+		for (auto k = 0u; k < bvhWidth; ++k) {
+			const Packet hit = boxIntersect(bounds + k, bounds + 3 * bvhWidth + k, bvhWidth, rays, entry) & pending;
+			if (!any(hit)) {
+				continue;
+			}
+			const uint32_t triangleCount = children[bvhWidth + k];
+			if (triangleCount == 0) {
+				stack.push_back(StackEntry{ children[k], 0.0f });
+			}
+			else {
+				occluded = occluded | leafOccluded(children[k], triangleCount, rays, pending);
+				if (!any(andNot(active, occluded))) {
+					return occluded;
+				}
+			}
+		}
+		if (stack.empty()) {
+			return occluded;
+		}
+		i = stack.back().node;
+		stack.pop_back();
+	}
+}
+/*
+* Traces the ambient occlusion rays of a hit in packets of directions, which all start
+* slightly above the hit.
+*/
+float CPUHost::ambientOcclusion(const Vec3f &point, const Vec3f &normal, uint32_t seed, std::vector<StackEntry> &stack) const {
+	Rays rays;
+	rays.origin = point + normal * AO_OFFSET;
+	rays.maxDistance = Packet(rt.options.aoMaxDistance);
+	// Orthonormal basis around the normal, as in the kernel
+	Vec3f h = normal;
+	if (std::fabs(h[X]) <= std::fabs(h[Y]) && std::fabs(h[X]) <= std::fabs(h[Z])) {
+		h[X] = 1.0f;
+	}
+	else if (std::fabs(h[Y]) <= std::fabs(h[X]) && std::fabs(h[Y]) <= std::fabs(h[Z])) {
+		h[Y] = 1.0f;
+	}
+	else {
+		h[Z] = 1.0f;
+	}
+	const Vec3f basisX = h.cross(normal).normalized();
+	const Vec3f basisZ = basisX.cross(normal).normalized();
+	float dirX[Packet::SIZE], dirY[Packet::SIZE], dirZ[Packet::SIZE];
+	unsigned int filled = 0;
+	std::size_t occluded = 0;
+	const auto flush = [&] {
+		if (filled == 0) {
+			return;
+		}
+		for (auto lane = filled; lane < Packet::SIZE; ++lane) {
+			dirX[lane] = dirX[filled - 1];
+			dirY[lane] = dirY[filled - 1];
+			dirZ[lane] = dirZ[filled - 1];
+		}
+		rays.dirX = Packet::load(dirX);
+		rays.dirY = Packet::load(dirY);
+		rays.dirZ = Packet::load(dirZ);
+		rays.invX = Packet(1.0f) / rays.dirX;
+		rays.invY = Packet(1.0f) / rays.dirY;
+		rays.invZ = Packet(1.0f) / rays.dirZ;
+		occluded += countLanes(sceneOccluded(rays, Packet::firstLanes(filled), stack));
+		filled = 0;
+	};
+	const auto trace = [&](const Vec3f &direction) {
+		dirX[filled] = direction[X];
+		dirY[filled] = direction[Y];
+		dirZ[filled] = direction[Z];
+		if (++filled == Packet::SIZE) {
+			flush();
+		}
+	};
+	if (rt.options.aoMethod == RayTracer::AmbientOcclusionMethod::UNIFORM) {
+		for (const auto &direction : aoDirections) {
+			trace(basisX * direction[X] + normal * direction[Y] + basisZ * direction[Z]);
+		}
+		flush();
+		return 1.0f - (float) occluded / (float) aoDirections.size();
+	}
+	// Like the kernel, the first pass traces the normal and one sample more than requested and
+	// divides by the number of samples. Later passes of a progressive render only trace the
+	// requested samples, so that all passes together trace the rays of a single one.
+	const float pi = M_PI;
+	const bool firstPass = pass == 0;
+	const unsigned int n = firstPass ? rt.options.aoNumSamples + 1 : rt.options.aoNumSamples;
+	uint32_t state[4];
+	randomSeed(state, seed);
+	if (firstPass) {
+		trace(normal);
+	}
+	for (auto i = 0u; i < n; ++i) {
+		const float xi1 = randomFloat(state);
+		const float xi2 = randomFloat(state);
+		const float theta = std::acos(std::sqrt(1.0f - xi1));
+		const float phi = 2.0f * xi2;
+		trace((basisX * (std::sin(theta) * std::cos(pi * phi)) + normal * std::cos(theta) + basisZ * (std::sin(theta) * std::sin(pi * phi))).normalized());
+	}
+	flush();
+	return 1.0f - (float) occluded / (float) n;
+}
\ No newline at end of file
@@ -1,3 +1,4 @@
+#include <chrono>
 #include <cstdlib>
 #include <iostream>
 #include "info.h"
@@ -11,10 +12,14 @@ const std::string Info::Color::NORMAL = ::Color::WHITE;
 const std::string Info::Color::HIGHLIGHT = ::Color::YELLOW;
 const std::string Info::Color::SECTION = ::Color::GREEN;
 const std::string Info::Color::WARNING = ::Color::RED;
+std::vector<Info::Phase> Info::phases;
 std::size_t Info::measure(const std::string &jobDescription, const std::function<bool ()> &job, bool synchronous) {
 	std::stringstream ss;
 	std::ostream &os = synchronous ? ss : std::cout;
 	Timer timer;
+	// Phases are also timed with a monotonic clock, finer than the printed milliseconds
+	static const auto epoch = std::chrono::steady_clock::now();
+	const auto start = std::chrono::steady_clock::now();
 	std::stringstream status;
 	status << Color::NORMAL << jobDescription << "…" << ::Color::RESET;
 	os << status.str();
@@ -23,6 +28,8 @@ std::size_t Info::measure(const std::string &jobDescription, const std::function
 	}
 	const bool success = job();
 	std::size_t elapsed = timer.get_elapsed();
+	const auto end = std::chrono::steady_clock::now();
+	phases.push_back({ jobDescription, std::chrono::duration<double, std::milli>(start - epoch).count(), std::chrono::duration<double, std::milli>(end - start).count() });
 	if (!success) {
 		os << Info::Color::WARNING << " failed!" << ::Color::RESET;
 	}
@@ -40,6 +47,9 @@ std::size_t Info::measure(const std::string &jobDescription, const std::function
 	}
 	return elapsed;
 }
+const std::vector<Info::Phase> &Info::getPhases() {
+	return phases;
+}
 std::string Info::formatTime(const std::size_t elapsed) {
 	std::stringstream ss;
 	ss << ::Color::GREEN << elapsed << " ms" << ::Color::RESET;
@@ -4,6 +4,125 @@
 #endif
 #define AO_METHOD_UNIFORM 0
 #define AO_METHOD_RANDOM 1
+#ifdef RUNTIME_PARAMS
+// Parameters which do not change the structure of the kernel are passed as a kernel
+// argument, so changing them does not require a new build
+typedef struct Params {
+	uint width;
+	uint height;
+	uint tile_width;
+	uint tile_height;
+	float focal_length;
+	uint supersamples_per_axis;
+	float ao_max_distance;
+	uint ao_num_samples;
+	int ao_alpha_min;
+	int ao_alpha_max;
+} Params;
+#define PARAMS_ARG , __constant const Params *params
+#define PARAMS , params
+#define WIDTH (params->width)
+#define HEIGHT (params->height)
+#define TILE_WIDTH (params->tile_width)
+#define TILE_HEIGHT (params->tile_height)
+#define FOCAL_LENGTH (params->focal_length)
+#define SUPERSAMPLES_PER_AXIS (params->supersamples_per_axis)
+#define AO_MAX_DISTANCE (params->ao_max_distance)
+#define AO_NUM_SAMPLES (params->ao_num_samples)
+#define AO_ALPHA_MIN (params->ao_alpha_min)
+#define AO_ALPHA_MAX (params->ao_alpha_max)
+#else
+#define PARAMS_ARG
+#define PARAMS
+#endif
+#ifdef TRAVERSAL_STATS
+// Counters of the instrumented build, summed over all rays of a supersample
+typedef struct TraversalStats {
+	uint aabb_tests;
+	uint triangle_tests;
+	uint rays;
+} TraversalStats;
+#define STATS_ARG , TraversalStats *stats
+#define STATS , stats
+// Kernels which trace rays count into private memory, only intersect writes the counters out
+#define STATS_DECLARE TraversalStats stats_storage = { 0, 0, 0 }; TraversalStats *stats = &stats_storage;
+#define STATS_BUFFER_ARG , __global TraversalStats *traversal_stats
+#define COUNT_AABB_TESTS(count) (stats->aabb_tests += (count))
+#define COUNT_TRIANGLE_TESTS(count) (stats->triangle_tests += (count))
+#define COUNT_RAY() (++stats->rays)
+#else
+#define STATS_ARG
+#define STATS
+#define STATS_DECLARE
+#define STATS_BUFFER_ARG
+#define COUNT_AABB_TESTS(count)
+#define COUNT_TRIANGLE_TESTS(count)
+#define COUNT_RAY()
+#endif
+#if BVH_WIDTH == 2
+typedef uint2 bvh_node;
+typedef float4 bvh_bound;
+#else
+// Wide nodes are read as scalars, their child bounds as vectors of BVH_WIDTH floats, or of
+// offsets on a grid over the node, whose origin and spacing come first (six floats)
+typedef uint bvh_node;
+#ifdef COMPACT_LAYOUT
+typedef uchar bvh_bound;
+#if COMPACT_BOX_BITS == 8
+typedef uchar box_offset;
+#else
+typedef ushort box_offset;
+#endif
+#define BVH_BOUNDS_SIZE (6 * 4 + 6 * BVH_WIDTH * COMPACT_BOX_BITS / 8)
+#else
+typedef float bvh_bound;
+#define BVH_BOUNDS_SIZE (6 * BVH_WIDTH)
+#endif
+#if BVH_WIDTH == 4
+typedef float4 floatw;
+typedef int4 intw;
+#define vloadw vload4
+#define convert_floatw convert_float4
+#elif BVH_WIDTH == 8
+typedef float8 floatw;
+typedef int8 intw;
+#define vloadw vload8
+#define convert_floatw convert_float8
+#endif
+#endif
+#ifdef COMPACT_LAYOUT
+inline float4 octahedron_decode(uint bits) {
+	const float2 folded = convert_float2(as_short2(bits)) / 32767.0f;
+	const float z = 1.0f - fabs(folded.x) - fabs(folded.y);
+	// Normals of the lower half were folded over the diagonals
+	const float t = fmax(-z, 0.0f);
+	return normalize((float4) (folded.x >= 0.0f ? folded.x - t : folded.x + t, folded.y >= 0.0f ? folded.y - t : folded.y + t, z, 0.0f));
+}
+#endif
+#if defined(COMPACT_LAYOUT) && defined(INTERLEAVED_VERTICES)
+// Every vertex is a float4 of its position and its encoded normal, the normals are read from the same buffer
+typedef float4 mesh_vertex;
+typedef float4 mesh_normal;
+#define load_vertex(vertices, i) ((float4) ((vertices)[i].xyz, 0.0f))
+#define load_normal(normals, i) octahedron_decode(as_uint((normals)[i].w))
+#elif defined(COMPACT_LAYOUT)
+// Vertices are packed into three floats, normals octahedron-encoded into two 16-bit components
+typedef float mesh_vertex;
+typedef uint mesh_normal;
+#define load_vertex(vertices, i) ((float4) (vload3((i), (vertices)), 0.0f))
+#define load_normal(normals, i) octahedron_decode((normals)[i])
+#elif defined(INTERLEAVED_VERTICES)
+// Every vertex is followed by its normal, the normals are read from the same buffer
+typedef float4 mesh_vertex;
+typedef float4 mesh_normal;
+#define load_vertex(vertices, i) ((vertices)[2 * (i)])
+#define load_normal(normals, i) ((normals)[2 * (i) + 1])
+#else
+typedef float4 mesh_vertex;
+typedef float4 mesh_normal;
+#define load_vertex(vertices, i) ((vertices)[i])
+#define load_normal(normals, i) ((normals)[i])
+#endif
 typedef struct Intersection {
 	uint face_id;
 	float4 barycentric;
@@ -112,17 +231,105 @@ inline bool triangle_intersect(float4 ta, float4 tb, float4 tc, uint face_id, fl
 	}
 	return true;
 }
+// Same test as triangle_intersect, but only tells whether the ray hits the triangle
+// within max_distance (ray directions are normalized)
+inline bool triangle_occludes(float4 ta, float4 tb, float4 tc, float4 ray_pos, float4 ray_dir, float max_distance) {
+	const float EPSILON2 = 0.000001f;
+	const float4 u = tb - ta;
+	const float4 v = tc - ta;
+	const float4 n = cross(u, v);
+	const float4 w0 = ray_pos - ta;
+	const float a = -dot(n, w0);
+	const float b = dot(n, ray_dir);
+	if (fabs(b) < EPSILON2) {
+		return false;
+	}
+	const float r = a / b;
+	if (r < 0.0 || r > max_distance) {
+		return false;
+	}
+	const float4 w = ray_pos + r * ray_dir - ta;
+	const float uu = dot(u, u);
+	const float uv = dot(u, v);
+	const float vv = dot(v, v);
+	const float wu = dot(u, w);
+	const float wv = dot(w, v);
+	const float D = uv * uv - uu * vv;
+	const float s = (uv * wv - vv * wu) / D;
+	if (s < -0.00001f || s > 1.00001) {
+		return false;
+	}
+	const float t = (uv * wu - uu * wv) / D;
+	return t >= -0.00001f && (s + t) <= 1.00001;
+}
+#ifdef PRECOMPUTED_TRIANGLES
+// Möller-Trumbore test on a precomputed triangle (first vertex and both edges)
+// https://www.graphics.cornell.edu/pubs/1997/MT97.pdf
+inline bool triangle_intersect_precomputed(__global const float4 *triangle, uint face_id, float4 ray_pos, float4 ray_dir, Intersection *intersection) {
+	const float EPSILON2 = 0.000001f;
+	const float4 e1 = triangle[1];
+	const float4 e2 = triangle[2];
+	const float4 p = cross(ray_dir, e2);
+	const float det = dot(e1, p);
+	if (fabs(det) < EPSILON2) {
+		return false;
+	}
+	const float inv_det = 1.0f / det;
+	const float4 w = ray_pos - triangle[0];
+	const float s = dot(w, p) * inv_det;
+	if (s < -0.00001f || s > 1.00001f) {
+		return false;
+	}
+	const float4 q = cross(w, e1);
+	const float t = dot(ray_dir, q) * inv_det;
+	if (t < -0.00001f || (s + t) > 1.00001f) {
+		return false;
+	}
+	// Ray directions are normalized, so this is the distance
+	const float distance = dot(e2, q) * inv_det;
+	if (distance < 0.0f) {
+		return false;
+	}
+	if (intersection->distance > distance) {
+		intersection->face_id = face_id;
+		intersection->barycentric = (float4) (1.0f - s - t, s, t, 0);
+		intersection->position = ray_pos + distance * ray_dir;
+		intersection->distance = distance;
+	}
+	return true;
+}
+inline bool triangle_occludes_precomputed(__global const float4 *triangle, float4 ray_pos, float4 ray_dir, float max_distance) {
+	const float EPSILON2 = 0.000001f;
+	const float4 e1 = triangle[1];
+	const float4 e2 = triangle[2];
+	const float4 p = cross(ray_dir, e2);
+	const float det = dot(e1, p);
+	if (fabs(det) < EPSILON2) {
+		return false;
+	}
+	const float inv_det = 1.0f / det;
+	const float4 w = ray_pos - triangle[0];
+	const float s = dot(w, p) * inv_det;
+	if (s < -0.00001f || s > 1.00001f) {
+		return false;
+	}
+	const float4 q = cross(w, e1);
+	const float t = dot(ray_dir, q) * inv_det;
+	const float distance = dot(e2, q) * inv_det;
+	return t >= -0.00001f && (s + t) <= 1.00001f && distance >= 0.0f && distance <= max_distance;
+}
+#endif
 inline float shade(const float4 ray_dir, const float4 normal) {
 	return clamp(-dot(normal, ray_dir), 0.f, 1.f);
 }
-inline float4 get_smooth_normal(const __global uint *faces, const __global float4 *vertices, const __global float4 *normals, Intersection intersection) {
+inline float4 get_smooth_normal(const __global uint *faces, const __global mesh_vertex *vertices, const __global mesh_normal *normals, Intersection intersection) {
 	const uint v0 = faces[intersection.face_id + 0];
 	const uint v1 = faces[intersection.face_id + 1];
 	const uint v2 = faces[intersection.face_id + 2];
 	return normalize(
-		normals[v0] * (float4) (intersection.barycentric.x) +
-		normals[v1] * (float4) (intersection.barycentric.y) +
-		normals[v2] * (float4) (intersection.barycentric.z)
+		load_normal(normals, v0) * (float4) (intersection.barycentric.x) +
+		load_normal(normals, v1) * (float4) (intersection.barycentric.y) +
+		load_normal(normals, v2) * (float4) (intersection.barycentric.z)
 	);
 }
 inline unsigned int random_int(uint4 *v) {
@@ -140,6 +347,15 @@ inline void random_initialize_seed(uint4 *v, uint seed) {
 	(*v).w = (88675123u ^ seed) * 521288629u;
 	random_int(v);
 }
+// Mixes the index of a supersample in the whole image and the pass of a progressive render
+// into the seed of its random samples (the finalizer of SplitMix64), so that neither
+// neighbouring supersamples nor passes draw related samples.
+inline uint random_sample_seed(uint index, uint pass) {
+	ulong z = (((ulong) pass << 32) | index) + 0x9E3779B97F4A7C15ul;
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ul;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBul;
+	return (uint) (z ^ (z >> 31));
+}
 inline void random_initialize(uint4 *v, uint a, uint b, uint c, uint d) {
 	(*v).x = a;
 	(*v).y = b;
@@ -150,7 +366,7 @@ inline void random_initialize(uint4 *v, uint a, uint b, uint c, uint d) {
 inline float random_float(uint4 *v) {
 	return 2.32830643653869629E-10f * random_int(v);
 }
-inline void hemisphere_sampler(HemisphereSampler *hemi, float4 normal, uint index) {
+inline void hemisphere_sampler(HemisphereSampler *hemi, float4 normal, uint seed) {
 	hemi->basis_y = normalize(normal);
 	float4 h = hemi->basis_y;
 	if (fabs(h.x) <= fabs(h.y) && fabs(h.x) <= fabs(h.z)) {
@@ -166,7 +382,7 @@ inline void hemisphere_sampler(HemisphereSampler *hemi, float4 normal, uint inde
 	hemi->basis_x = normalize(hemi->basis_x);
 	hemi->basis_z = cross(hemi->basis_x, hemi->basis_y);
 	hemi->basis_z = normalize(hemi->basis_z);
-	random_initialize_seed(&hemi->direction, 536870923u * index);
+	random_initialize_seed(&hemi->direction, seed);
 }
 inline float4 hemisphere_sampler_sample(HemisphereSampler *hemi) {
 	/* use better random generator */
@@ -181,48 +397,312 @@ inline float4 hemisphere_sampler_sample(HemisphereSampler *hemi) {
 	float4 direction = hemi->basis_x * xs + hemi->basis_y * ys + hemi->basis_z * zs;
 	return normalize(direction);
 }
-inline bool scene_intersect(__global const uint *nodes, __global const float4 *aabbs, const __global uint *faces, const __global float4 *vertices, const __global float4 *normals, float4 ray_pos, float4 ray_dir, Intersection *intersection, float max_distance) {
+// Intersects the ray with count triangles starting at the given offset.
+inline bool leaf_intersect(const __global uint *faces, const __global mesh_vertex *vertices, __global const float4 *triangles, uint offset, uint count, float4 ray_pos, float4 ray_dir, Intersection *intersection STATS_ARG) {
+	bool is_intersecting = false;
+	const uint end = (offset + count) * 3;
+	COUNT_TRIANGLE_TESTS(count);
+	for (uint face_id = offset * 3; face_id < end; face_id += 3) {
+#ifdef PRECOMPUTED_TRIANGLES
+		// Precomputed triangles are stored in the order of the faces
+		is_intersecting |= triangle_intersect_precomputed(triangles + face_id, face_id, ray_pos, ray_dir, intersection);
+#else
+		is_intersecting |= triangle_intersect(
+			load_vertex(vertices, faces[face_id + 0]),
+			load_vertex(vertices, faces[face_id + 1]),
+			load_vertex(vertices, faces[face_id + 2]),
+			face_id,
+			ray_pos,
+			ray_dir,
+			intersection
+		);
+#endif
+	}
+	return is_intersecting;
+}
+// Returns true iff the ray hits any of count triangles starting at the given offset within max_distance.
+inline bool leaf_occluded(const __global uint *faces, const __global mesh_vertex *vertices, __global const float4 *triangles, uint offset, uint count, float4 ray_pos, float4 ray_dir, float max_distance STATS_ARG) {
+	const uint end = (offset + count) * 3;
+	for (uint face_id = offset * 3; face_id < end; face_id += 3) {
+		COUNT_TRIANGLE_TESTS(1);
+#ifdef PRECOMPUTED_TRIANGLES
+		if (triangle_occludes_precomputed(triangles + face_id, ray_pos, ray_dir, max_distance)) {
+			return true;
+		}
+#else
+		if (triangle_occludes(load_vertex(vertices, faces[face_id + 0]), load_vertex(vertices, faces[face_id + 1]), load_vertex(vertices, faces[face_id + 2]), ray_pos, ray_dir, max_distance)) {
+			return true;
+		}
+#endif
+	}
+	return false;
+}
+#if BVH_WIDTH == 2
+// Returns the number of nodes to skip to get past the given node and its children.
+inline uint subtree_size(uint2 node) {
+	return node.x & BVH_LEAF ? 1 : node.x;
+}
+#ifdef TRAVERSAL_STACK
+// Slab test which also returns the distance at which the ray enters the box
+inline bool aabb_intersect_entry(__global const float4 *bb, float4 ray_pos, float4 inv_dir, float max_distance, float *t_entry) {
+	const float4 t0 = (bb[0] - ray_pos) * inv_dir;
+	const float4 t1 = (bb[1] - ray_pos) * inv_dir;
+	const float4 t_near = fmin(t0, t1);
+	const float4 t_far = fmax(t0, t1);
+	const float t_min = fmax(fmax(t_near.x, t_near.y), t_near.z);
+	const float t_max = fmin(fmin(t_far.x, t_far.y), t_far.z);
+	*t_entry = t_min;
+	return t_min <= t_max && t_min < max_distance && t_max > 0;
+}
+// Visits the nearer child first and skips all nodes behind the nearest hit.
+inline bool scene_intersect(__global const bvh_node *nodes, __global const bvh_bound *aabbs, const __global uint *faces, const __global mesh_vertex *vertices, __global const float4 *triangles, const __global mesh_normal *normals, float4 ray_pos, float4 ray_dir, Intersection *intersection, float max_distance STATS_ARG) {
 	bool is_intersecting = false;
-	uint triangle_idex = 0;
-	for (uint i = 0; i < nodes[0];) {
-		uint const node_count = nodes[i];
+	const float4 inv_dir = 1.0f / ray_dir;
+	uint stack[BVH_STACK_SIZE];
+	float stack_entry[BVH_STACK_SIZE];
+	uint stack_size = 0;
+	float t_entry;
+	COUNT_RAY();
+	COUNT_AABB_TESTS(1);
+	if (!aabb_intersect_entry(aabbs, ray_pos, inv_dir, max_distance, &t_entry)) {
+		return false;
+	}
+	uint i = 0;
+	for (;;) {
+		const uint2 node = nodes[i];
+		if (node.x & BVH_LEAF) {
+			if (leaf_intersect(faces, vertices, triangles, node.y, node.x & ~BVH_LEAF, ray_pos, ray_dir, intersection STATS)) {
+				is_intersecting = true;
+				max_distance = fmin(max_distance, intersection->distance);
+			}
+		}
+		else {
+			const uint left = i + 1;
+			const uint right = left + subtree_size(nodes[left]);
+			COUNT_AABB_TESTS(2);
+			float t_left, t_right;
+			const bool hit_left = aabb_intersect_entry(aabbs + (left << 1), ray_pos, inv_dir, max_distance, &t_left);
+			const bool hit_right = aabb_intersect_entry(aabbs + (right << 1), ray_pos, inv_dir, max_distance, &t_right);
+			if (hit_left && hit_right) {
+				// Come back for the farther child later
+				const bool left_first = t_left <= t_right;
+				stack[stack_size] = left_first ? right : left;
+				stack_entry[stack_size++] = left_first ? t_right : t_left;
+				i = left_first ? left : right;
+				continue;
+			}
+			if (hit_left || hit_right) {
+				i = hit_left ? left : right;
+				continue;
+			}
+		}
+		// Pop the next node which the ray enters before the nearest hit
+		do {
+			if (stack_size == 0) {
+				return is_intersecting;
+			}
+			--stack_size;
+		} while (stack_entry[stack_size] >= max_distance);
+		i = stack[stack_size];
+	}
+}
+// Returns true as soon as the ray hits any triangle, the order of the children does not matter.
+inline bool scene_occluded(__global const bvh_node *nodes, __global const bvh_bound *aabbs, const __global uint *faces, const __global mesh_vertex *vertices, __global const float4 *triangles, float4 ray_pos, float4 ray_dir, float max_distance STATS_ARG) {
+	const float4 inv_dir = 1.0f / ray_dir;
+	uint stack[BVH_STACK_SIZE];
+	uint stack_size = 0;
+	float t_entry;
+	COUNT_RAY();
+	COUNT_AABB_TESTS(1);
+	if (!aabb_intersect_entry(aabbs, ray_pos, inv_dir, max_distance, &t_entry)) {
+		return false;
+	}
+	uint i = 0;
+	for (;;) {
+		const uint2 node = nodes[i];
+		if (node.x & BVH_LEAF) {
+			if (leaf_occluded(faces, vertices, triangles, node.y, node.x & ~BVH_LEAF, ray_pos, ray_dir, max_distance STATS)) {
+				return true;
+			}
+		}
+		else {
+			const uint left = i + 1;
+			const uint right = left + subtree_size(nodes[left]);
+			COUNT_AABB_TESTS(2);
+			const bool hit_left = aabb_intersect_entry(aabbs + (left << 1), ray_pos, inv_dir, max_distance, &t_entry);
+			const bool hit_right = aabb_intersect_entry(aabbs + (right << 1), ray_pos, inv_dir, max_distance, &t_entry);
+			if (hit_left && hit_right) {
+				stack[stack_size++] = right;
+			}
+			if (hit_left || hit_right) {
+				i = hit_left ? left : right;
+				continue;
+			}
+		}
+		if (stack_size == 0) {
+			return false;
+		}
+		i = stack[--stack_size];
+	}
+}
+#else
+inline bool scene_intersect(__global const bvh_node *nodes, __global const bvh_bound *aabbs, const __global uint *faces, const __global mesh_vertex *vertices, __global const float4 *triangles, const __global mesh_normal *normals, float4 ray_pos, float4 ray_dir, Intersection *intersection, float max_distance STATS_ARG) {
+	bool is_intersecting = false;
+	const uint node_count = subtree_size(nodes[0]);
+	COUNT_RAY();
+	for (uint i = 0; i < node_count;) {
+		const uint2 node = nodes[i];
+		COUNT_AABB_TESTS(1);
 		if (!aabb_intersect(aabbs + (i << 1), ray_pos, ray_dir, max_distance)) {
 			// Skip this node and all its children
-			triangle_idex += (node_count + 1) >> 1;
-			i += node_count;
+			i += subtree_size(node);
 		}
 		else {
-			if (node_count == 1) {
-				// If node_count is 1, it's a leaf
-				const uint face_id = triangle_idex * 3;
-				is_intersecting |= triangle_intersect(
-					vertices[faces[face_id + 0]],
-					vertices[faces[face_id + 1]],
-					vertices[faces[face_id + 2]],
-					face_id,
-					ray_pos,
-					ray_dir,
-					intersection
-				);
-				++triangle_idex;
+			if (node.x & BVH_LEAF) {
+				// Leaves store their number of triangles and the offset of the first one
+				is_intersecting |= leaf_intersect(faces, vertices, triangles, node.y, node.x & ~BVH_LEAF, ray_pos, ray_dir, intersection STATS);
 			}
 			++i;
 		}
 	}
 	return is_intersecting;
 }
-inline float ambient_occlusion(__global const uint *nodes, __global const float4 *aabbs, const __global uint *faces, const __global float4 *vertices, const __global float4 *normals, float4 point, float4 normal, int index) {
-	const float4 p = point + (normal * (1.0f / 100000.0f));
-	uint hits = 0;
-	float max_distance = AO_MAX_DISTANCE;
-#if AO_METHOD == AO_METHOD_UNIFORM
-	uint n = 0;
-	const uint circle_count = AO_NUM_SAMPLES;
-	const float degrees = M_PI / 180;
-	const float alpha_min = (float) AO_ALPHA_MIN * degrees;
-	const float alpha_max = (float) AO_ALPHA_MAX * degrees; // don't change this
-	const float4 basis_y = normal; // already normalized
-	const float4 h = basis_y;
+inline bool scene_occluded(__global const bvh_node *nodes, __global const bvh_bound *aabbs, const __global uint *faces, const __global mesh_vertex *vertices, __global const float4 *triangles, float4 ray_pos, float4 ray_dir, float max_distance STATS_ARG) {
+	const uint node_count = subtree_size(nodes[0]);
+	COUNT_RAY();
+	for (uint i = 0; i < node_count;) {
+		const uint2 node = nodes[i];
+		COUNT_AABB_TESTS(1);
+		if (!aabb_intersect(aabbs + (i << 1), ray_pos, ray_dir, max_distance)) {
+			i += subtree_size(node);
+		}
+		else {
+			if (node.x & BVH_LEAF && leaf_occluded(faces, vertices, triangles, node.y, node.x & ~BVH_LEAF, ray_pos, ray_dir, max_distance STATS)) {
+				return true;
+			}
+			++i;
+		}
+	}
+	return false;
+}
+#endif
+#else
+// Slab test of a ray against all child bounding boxes of a wide node at once, also returns the entry distances
+inline intw aabb_intersect_wide(__global const bvh_bound *bb, float4 ray_pos, float4 inv_dir, float max_distance, floatw *t_entry) {
+#ifdef COMPACT_LAYOUT
+	// Planes are decoded as origin + offset * spacing, which the host rounded outwards
+	const float4 origin = (float4) (vload3(0, (__global const float *) bb), 0.0f);
+	const float4 spacing = (float4) (vload3(1, (__global const float *) bb), 0.0f);
+	__global const box_offset *offsets = (__global const box_offset *) (bb + 6 * sizeof(float));
+#define PLANES(k, axis) (origin.axis + convert_floatw(vloadw((k), offsets)) * spacing.axis)
+#else
+#define PLANES(k, axis) vloadw((k), bb)
+#endif
+	// The sign of the direction decides which of the planes of an axis is hit first
+	const floatw t_min_x = (PLANES(inv_dir.x < 0 ? 3 : 0, x) - ray_pos.x) * inv_dir.x;
+	const floatw t_max_x = (PLANES(inv_dir.x < 0 ? 0 : 3, x) - ray_pos.x) * inv_dir.x;
+	const floatw t_min_y = (PLANES(inv_dir.y < 0 ? 4 : 1, y) - ray_pos.y) * inv_dir.y;
+	const floatw t_max_y = (PLANES(inv_dir.y < 0 ? 1 : 4, y) - ray_pos.y) * inv_dir.y;
+	const floatw t_min_z = (PLANES(inv_dir.z < 0 ? 5 : 2, z) - ray_pos.z) * inv_dir.z;
+	const floatw t_max_z = (PLANES(inv_dir.z < 0 ? 2 : 5, z) - ray_pos.z) * inv_dir.z;
+#undef PLANES
+	const floatw t_min = fmax(fmax(t_min_x, t_min_y), t_min_z);
+	const floatw t_max = fmin(fmin(t_max_x, t_max_y), t_max_z);
+	*t_entry = t_min;
+	return (t_min <= t_max) & (t_min < max_distance) & (t_max > 0);
+}
+inline bool scene_intersect(__global const bvh_node *nodes, __global const bvh_bound *aabbs, const __global uint *faces, const __global mesh_vertex *vertices, __global const float4 *triangles, const __global mesh_normal *normals, float4 ray_pos, float4 ray_dir, Intersection *intersection, float max_distance STATS_ARG) {
+	bool is_intersecting = false;
+	const float4 inv_dir = 1.0f / ray_dir;
+	uint stack[BVH_STACK_SIZE];
+	float stack_entry[BVH_STACK_SIZE];
+	uint stack_size = 0;
+	uint i = 0;
+	COUNT_RAY();
+	for (;;) {
+		floatw t_entry;
+		COUNT_AABB_TESTS(BVH_WIDTH);
+		const intw hit = aabb_intersect_wide(aabbs + i * BVH_BOUNDS_SIZE, ray_pos, inv_dir, max_distance, &t_entry);
+		// Children are followed by the number of triangles of each child, 0 for inner children
+		__global const uint *children = nodes + i * 2 * BVH_WIDTH;
+#ifdef TRAVERSAL_STACK
+		const uint first = stack_size;
+#endif
+		for (uint k = 0; k < BVH_WIDTH; ++k) {
+			if (!((const int *) &hit)[k]) {
+				continue;
+			}
+			const uint triangle_count = children[BVH_WIDTH + k];
+			if (triangle_count == 0) {
+				stack[stack_size] = children[k];
+				stack_entry[stack_size++] = ((const float *) &t_entry)[k];
+			}
+			else if (leaf_intersect(faces, vertices, triangles, children[k], triangle_count, ray_pos, ray_dir, intersection STATS)) {
+				is_intersecting = true;
+#ifdef TRAVERSAL_STACK
+				max_distance = fmin(max_distance, intersection->distance);
+#endif
+			}
+		}
+#ifdef TRAVERSAL_STACK
+		// Sort the pushed children by their entry distances, so the nearest one is popped first
+		for (uint k = first + 1; k < stack_size; ++k) {
+			const uint child = stack[k];
+			const float entry = stack_entry[k];
+			uint j = k;
+			for (; j > first && stack_entry[j - 1] < entry; --j) {
+				stack[j] = stack[j - 1];
+				stack_entry[j] = stack_entry[j - 1];
+			}
+			stack[j] = child;
+			stack_entry[j] = entry;
+		}
+#endif
+		// Pop the next node which the ray enters before the nearest hit
+		do {
+			if (stack_size == 0) {
+				return is_intersecting;
+			}
+			--stack_size;
+		} while (stack_entry[stack_size] >= max_distance);
+		i = stack[stack_size];
+	}
+}
+inline bool scene_occluded(__global const bvh_node *nodes, __global const bvh_bound *aabbs, const __global uint *faces, const __global mesh_vertex *vertices, __global const float4 *triangles, float4 ray_pos, float4 ray_dir, float max_distance STATS_ARG) {
+	const float4 inv_dir = 1.0f / ray_dir;
+	uint stack[BVH_STACK_SIZE];
+	uint stack_size = 0;
+	uint i = 0;
+	COUNT_RAY();
+	for (;;) {
+		floatw t_entry;
+		COUNT_AABB_TESTS(BVH_WIDTH);
+		const intw hit = aabb_intersect_wide(aabbs + i * BVH_BOUNDS_SIZE, ray_pos, inv_dir, max_distance, &t_entry);
+		__global const uint *children = nodes + i * 2 * BVH_WIDTH;
+		for (uint k = 0; k < BVH_WIDTH; ++k) {
+			if (!((const int *) &hit)[k]) {
+				continue;
+			}
+			const uint triangle_count = children[BVH_WIDTH + k];
+			if (triangle_count == 0) {
+				stack[stack_size++] = children[k];
+			}
+			else if (leaf_occluded(faces, vertices, triangles, children[k], triangle_count, ray_pos, ray_dir, max_distance STATS)) {
+				return true;
+			}
+		}
+		if (stack_size == 0) {
+			return false;
+		}
+		i = stack[--stack_size];
+	}
+}
+#endif
+// Ambient occlusion rays start this far above the surface
+#define AO_OFFSET (1.0f / 100000.0f)
+// Orthonormal basis around the normal, in which the uniform hemisphere is laid out
+inline void ao_basis(float4 normal, float4 *basis_x, float4 *basis_z) {
+	float4 h = normal;
 	if (fabs(h.x) <= fabs(h.y) && fabs(h.x) <= fabs(h.z)) {
 		h.x = 1.0;
 	}
@@ -232,8 +712,26 @@ inline float ambient_occlusion(__global const uint *nodes, __global const float4
 	else if (fabs(h.z) <= fabs(h.x) && fabs(h.z) <= fabs(h.y)) {
 		h.z = 1.0;
 	}
-	const float4 basis_x = normalize(cross(h, basis_y));
-	const float4 basis_z = normalize(cross(basis_x, basis_y));
+	*basis_x = normalize(cross(h, normal));
+	*basis_z = normalize(cross(*basis_x, normal));
+}
+/*
+* Only the first pass of a progressive render traces the normal and the additional random
+* sample, so that all passes together trace the rays of a single pass with all samples.
+*/
+inline float ambient_occlusion(__global const bvh_node *nodes, __global const bvh_bound *aabbs, const __global uint *faces, const __global mesh_vertex *vertices, __global const float4 *triangles, const __global mesh_normal *normals, float4 point, float4 normal, uint seed, bool first_pass PARAMS_ARG STATS_ARG) {
+	const float4 p = point + normal * AO_OFFSET;
+	uint hits = 0;
+	float max_distance = AO_MAX_DISTANCE;
+#if AO_METHOD == AO_METHOD_UNIFORM
+	uint n = 0;
+	const uint circle_count = AO_NUM_SAMPLES;
+	const float degrees = M_PI / 180;
+	const float alpha_min = (float) AO_ALPHA_MIN * degrees;
+	const float alpha_max = (float) AO_ALPHA_MAX * degrees; // don't change this
+	const float4 basis_y = normal; // already normalized
+	float4 basis_x, basis_z;
+	ao_basis(basis_y, &basis_x, &basis_z);
 	for (uint current_circle = 0; current_circle < circle_count; ++current_circle) {
 		const float step_angle_radians = alpha_max / circle_count; // the angle of each step
 		const float angle_radians = (step_angle_radians * current_circle) + alpha_min; // the "horizontal" angle
@@ -246,9 +744,8 @@ inline float ambient_occlusion(__global const uint *nodes, __global const float4
 			const float zs = sin(theta) * sinpi(phi);
 			// is normalized
 			const float4 ray_dir = basis_x * xs + basis_y * ys + basis_z * zs;
-			Intersection intersection;
 			++n;
-			if (scene_intersect(nodes, aabbs, faces, vertices, normals, p, ray_dir, &intersection, max_distance)) {
+			if (scene_occluded(nodes, aabbs, faces, vertices, triangles, p, ray_dir, max_distance STATS)) {
 				++hits;
 			}
 		}
@@ -256,18 +753,18 @@ inline float ambient_occlusion(__global const uint *nodes, __global const float4
 	return 1.0f - ((float) hits / (float) n);
 #elif AO_METHOD == AO_METHOD_RANDOM
 	HemisphereSampler hemi;
-	hemisphere_sampler(&hemi, normal, index);
+	hemisphere_sampler(&hemi, normal, seed);
 	uint n = AO_NUM_SAMPLES;
 	// intersect normal
-	Intersection intersection;
-	++n;
-	if (scene_intersect(nodes, aabbs, faces, vertices, normals, p, normal, &intersection, max_distance)) {
-		++hits;
+	if (first_pass) {
+		++n;
+		if (scene_occluded(nodes, aabbs, faces, vertices, triangles, p, normal, max_distance STATS)) {
+			++hits;
+		}
 	}
 	for (uint i = 0; i < n; ++i) {
 		const float4 ray_dir = hemisphere_sampler_sample(&hemi);
-		Intersection intersection;
-		if (!scene_intersect(nodes, aabbs, faces, vertices, normals, p, ray_dir, &intersection, max_distance)) {
+		if (!scene_occluded(nodes, aabbs, faces, vertices, triangles, p, ray_dir, max_distance STATS)) {
 			continue;
 		}
 		++hits;
@@ -275,24 +772,31 @@ inline float ambient_occlusion(__global const uint *nodes, __global const float4
 	return 1.0f - ((float) hits / (float) n);
 #endif
 }
-__kernel void intersect(__global const uint *faces, __global const uint *nodes, __global const float4 *aabbs, __global const float4 *vertices, __global const float4 *normals, __global float *image) {
-	const uint x = get_global_id(0);
-	const uint y = get_global_id(1);
-	const uint index = y * WIDTH + x;
-	const int2 pos = (int2) (x, y);
-	// calculate the ray
-	const float4 camera_position = (float4) (0.0f, 0.0f, 2.0f, 0.0f);
+#define CAMERA_POSITION ((float4) (0.0f, 0.0f, 2.0f, 0.0f))
+#define PRIMARY_MAX_DISTANCE 100000.0f
+// Direction of the primary ray through the given supersample
+inline float4 camera_ray(uint x, uint y PARAMS_ARG) {
 	const float a = FOCAL_LENGTH * max(WIDTH, HEIGHT);
-	const float4 ray_dir = normalize((float4) (
+	return normalize((float4) (
 		((float) x + 0.5f) / a - WIDTH / (2.0f * a),
 		-(((float) y + 0.5f) / a - HEIGHT / (2.0f * a)),
 		-1.0f,
 		0.0f
 	));
-	const float max_distance = 100000.0f;
+}
+/*
+* Traces the primary ray of the supersample at the given position of the whole image and
+* all of its ambient occlusion rays. The pass is mixed into the seed of the random ambient
+* occlusion samples, so that every pass of a progressive render draws new samples.
+*/
+inline float supersample(__global const uint *faces, __global const bvh_node *nodes, __global const bvh_bound *aabbs, __global const mesh_vertex *vertices, __global const mesh_normal *normals, __global const float4 *triangles, uint x, uint y, uint pass PARAMS_ARG STATS_ARG) {
+	const uint seed = random_sample_seed(y * WIDTH + x, pass);
+	const float4 camera_position = CAMERA_POSITION;
+	const float4 ray_dir = camera_ray(x, y PARAMS);
+	const float max_distance = PRIMARY_MAX_DISTANCE;
 	Intersection intersection;
 	intersection.distance = INFINITY;
-	bool is_intersecting = scene_intersect(nodes, aabbs, faces, vertices, normals, camera_position, ray_dir, &intersection, max_distance);
+	bool is_intersecting = scene_intersect(nodes, aabbs, faces, vertices, triangles, normals, camera_position, ray_dir, &intersection, max_distance STATS);
 	float value = 1.0f;
 	if (!is_intersecting) {
 		value = 0.0f;
@@ -302,9 +806,475 @@ __kernel void intersect(__global const uint *faces, __global const uint *nodes,
 #ifdef SHADING_ENABLE
 		value = shade(ray_dir, normal);
 #endif
-#if defined(AO_ENABLE) && AO_NUM_SAMPLES > 0
-		value *= ambient_occlusion(nodes, aabbs, faces, vertices, normals, intersection.position, normal, index);
+#ifdef AO_ENABLE
+		value *= ambient_occlusion(nodes, aabbs, faces, vertices, triangles, normals, intersection.position, normal, seed, pass == 0 PARAMS STATS);
+#endif
+	}
+	return value;
+}
+__kernel void intersect(__global const uint *faces, __global const bvh_node *nodes, __global const bvh_bound *aabbs, __global const mesh_vertex *vertices, __global const mesh_normal *normals, __global const float4 *triangles, __global float *image, const uint pass PARAMS_ARG STATS_BUFFER_ARG) {
+	const uint x = get_global_id(0);
+	const uint y = get_global_id(1);
+	// Tiles are rendered with a global offset into a buffer of a single tile
+	const uint tile_x = x - get_global_offset(0);
+	const uint tile_y = y - get_global_offset(1);
+	// Work items outside of the image or the tile only fill up the work groups
+	if (x >= WIDTH || y >= HEIGHT || tile_x >= TILE_WIDTH || tile_y >= TILE_HEIGHT) {
+		return;
+	}
+	STATS_DECLARE
+	image[tile_y * TILE_WIDTH + tile_x] = supersample(faces, nodes, aabbs, vertices, normals, triangles, x, y, pass PARAMS STATS);
+#ifdef TRAVERSAL_STATS
+	traversal_stats[tile_y * TILE_WIDTH + tile_x] = stats_storage;
+#endif
+}
+// Adaptive supersampling traces this supersample of every pixel first
+#define ADAPTIVE_BASE (SUPERSAMPLES_PER_AXIS / 2)
+/*
+* First pass of adaptive supersampling: traces one supersample of every output pixel of the
+* whole image and counts the ones which hit the scene.
+*/
+__kernel void adaptive_base(__global const uint *faces, __global const bvh_node *nodes, __global const bvh_bound *aabbs, __global const mesh_vertex *vertices, __global const mesh_normal *normals, __global const float4 *triangles, __global float *image, __global uint *hit_count PARAMS_ARG) {
+	__local uint group_hits;
+	STATS_DECLARE
+	const uint n = SUPERSAMPLES_PER_AXIS;
+	const uint x = get_global_id(0) * n + ADAPTIVE_BASE;
+	const uint y = get_global_id(1) * n + ADAPTIVE_BASE;
+	if (get_local_id(0) == 0 && get_local_id(1) == 0) {
+		group_hits = 0;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	if (x < WIDTH && y < HEIGHT) {
+		const float value = supersample(faces, nodes, aabbs, vertices, normals, triangles, x, y, 0 PARAMS STATS);
+		image[y * TILE_WIDTH + x] = value;
+		if (value > 0.0f) {
+			atomic_inc(&group_hits);
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	if (get_local_id(0) == 0 && get_local_id(1) == 0 && group_hits > 0) {
+		atomic_add(hit_count, group_hits);
+	}
+}
+/*
+* Queues the pixels whose first supersample differs from the ones of their neighbours by more
+* than the contrast, or whose 3×3 neighbourhood varies by more than the variance. The first
+* supersample of every other pixel stands in for all of its supersamples.
+*/
+__kernel void adaptive_classify(__global float *image, const float contrast, const float variance, __global uint *refine, __global uint *refine_count PARAMS_ARG) {
+	__local uint group_count;
+	__local uint group_base;
+	const uint n = SUPERSAMPLES_PER_AXIS;
+	const uint width = WIDTH / n;
+	const uint height = HEIGHT / n;
+	const uint x = get_global_id(0);
+	const uint y = get_global_id(1);
+	if (get_local_id(0) == 0 && get_local_id(1) == 0) {
+		group_count = 0;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	bool queued = false;
+	uint slot = 0;
+	if (x < width && y < height) {
+		const float value = image[(y * n + ADAPTIVE_BASE) * TILE_WIDTH + x * n + ADAPTIVE_BASE];
+		float difference = 0.0f;
+		float sum = 0.0f;
+		float squares = 0.0f;
+		uint count = 0;
+		for (uint ny = max(y, 1u) - 1; ny <= min(y + 1, height - 1); ++ny) {
+			for (uint nx = max(x, 1u) - 1; nx <= min(x + 1, width - 1); ++nx) {
+				const float neighbour = image[(ny * n + ADAPTIVE_BASE) * TILE_WIDTH + nx * n + ADAPTIVE_BASE];
+				difference = max(difference, fabs(neighbour - value));
+				sum += neighbour;
+				squares += neighbour * neighbour;
+				++count;
+			}
+		}
+		const float mean = sum / count;
+		if (difference > contrast || squares / count - mean * mean > variance) {
+			queued = true;
+			slot = atomic_inc(&group_count);
+		}
+		else {
+			// Only the other supersamples are written, as neighbours read the first one
+			for (uint k = 0; k < n * n; ++k) {
+				if (k != ADAPTIVE_BASE * n + ADAPTIVE_BASE) {
+					image[(y * n + k / n) * TILE_WIDTH + x * n + k % n] = value;
+				}
+			}
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	if (get_local_id(0) == 0 && get_local_id(1) == 0 && group_count > 0) {
+		group_base = atomic_add(refine_count, group_count);
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	if (queued) {
+		refine[group_base + slot] = y * width + x;
+	}
+}
+/*
+* Traces the other supersamples of the queued pixels, one per work item, and counts the
+* ones which hit the scene.
+*/
+__kernel void adaptive_refine(__global const uint *faces, __global const bvh_node *nodes, __global const bvh_bound *aabbs, __global const mesh_vertex *vertices, __global const mesh_normal *normals, __global const float4 *triangles, __global float *image, __global const uint *refine, const uint sample_count, __global uint *hit_count PARAMS_ARG) {
+	__local uint group_hits;
+	STATS_DECLARE
+	const uint n = SUPERSAMPLES_PER_AXIS;
+	const uint i = get_global_id(0);
+	if (get_local_id(0) == 0) {
+		group_hits = 0;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	if (i < sample_count) {
+		const uint pixel = refine[i / (n * n - 1)];
+		// Skips the first supersample
+		uint k = i % (n * n - 1);
+		k += k >= ADAPTIVE_BASE * n + ADAPTIVE_BASE;
+		const uint x = pixel % (WIDTH / n) * n + k % n;
+		const uint y = pixel / (WIDTH / n) * n + k / n;
+		const float value = supersample(faces, nodes, aabbs, vertices, normals, triangles, x, y, 0 PARAMS STATS);
+		image[y * TILE_WIDTH + x] = value;
+		if (value > 0.0f) {
+			atomic_inc(&group_hits);
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	if (get_local_id(0) == 0 && group_hits > 0) {
+		atomic_add(hit_count, group_hits);
+	}
+}
+// Primary ray waiting for the closest-hit pass of the wavefront mode
+typedef struct QueuedRay {
+	float4 direction;
+	// Index of the supersample in the tile and seed of its random ambient occlusion samples
+	uint pixel;
+	uint seed;
+} QueuedRay;
+// Hit waiting for its ambient occlusion rays, with its value before ambient occlusion
+typedef struct QueuedHit {
+	float4 position;
+	float4 normal;
+	uint pixel;
+	uint seed;
+	float value;
+} QueuedHit;
+/*
+* First pass of the wavefront mode: queues the primary rays of a tile of the given size,
+* one after another. The pass is mixed into their seeds like in intersect.
+*/
+__kernel void generate(__global QueuedRay *rays, const uint width, const uint height, const uint pass PARAMS_ARG) {
+	const uint x = get_global_id(0);
+	const uint y = get_global_id(1);
+	const uint tile_x = x - get_global_offset(0);
+	const uint tile_y = y - get_global_offset(1);
+	if (x >= WIDTH || y >= HEIGHT || tile_x >= width || tile_y >= height) {
+		return;
+	}
+	__global QueuedRay *ray = rays + tile_y * width + tile_x;
+	ray->direction = camera_ray(x, y PARAMS);
+	ray->pixel = tile_y * TILE_WIDTH + tile_x;
+	ray->seed = random_sample_seed(y * WIDTH + x, pass);
+}
+/*
+* Traces the queued primary rays. Misses are written to the image right away, hits are
+* shaded and, with ambient occlusion, compacted into the hit queue: every work group
+* counts its hits in local memory and reserves its range of the queue with one atomic.
+*/
+__kernel void closest_hit(__global const uint *faces, __global const bvh_node *nodes, __global const bvh_bound *aabbs, __global const mesh_vertex *vertices, __global const mesh_normal *normals, __global const float4 *triangles, __global const QueuedRay *rays, const uint ray_count, __global QueuedHit *hits, __global uint *hit_count, __global float *image PARAMS_ARG) {
+	__local uint group_count;
+	__local uint group_base;
+	const uint i = get_global_id(0);
+	if (get_local_id(0) == 0) {
+		group_count = 0;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	QueuedHit hit;
+	bool queued = false;
+	uint slot = 0;
+	// Work items past the queue must still reach the barriers
+	if (i < ray_count) {
+		const QueuedRay ray = rays[i];
+		STATS_DECLARE
+		Intersection intersection;
+		intersection.distance = INFINITY;
+		if (!scene_intersect(nodes, aabbs, faces, vertices, triangles, normals, CAMERA_POSITION, ray.direction, &intersection, PRIMARY_MAX_DISTANCE STATS)) {
+			image[ray.pixel] = 0.0f;
+		}
+		else {
+			const float4 normal = get_smooth_normal(faces, vertices, normals, intersection);
+			float value = 1.0f;
+#ifdef SHADING_ENABLE
+			value = shade(ray.direction, normal);
+#endif
+#ifdef AO_ENABLE
+			hit.position = intersection.position;
+			hit.normal = normal;
+			hit.pixel = ray.pixel;
+			hit.seed = ray.seed;
+			hit.value = value;
+			queued = true;
+			slot = atomic_inc(&group_count);
+#else
+			image[ray.pixel] = value;
 #endif
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	if (get_local_id(0) == 0 && group_count > 0) {
+		group_base = atomic_add(hit_count, group_count);
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	if (queued) {
+		hits[group_base + slot] = hit;
+	}
+}
+#ifdef AO_ENABLE
+/*
+* Writes the directions of the ambient occlusion rays of count hits, starting with the
+* given one, in the same order as ambient_occlusion traces them in the given pass. The
+* uniform directions are rotated from the table of the host, which also counts them.
+*/
+__kernel void generate_ao(__global const QueuedHit *hits, const uint first, const uint count, __global float4 *ao_rays, const uint rays_per_hit, const uint first_pass, __global const float4 *ao_directions PARAMS_ARG) {
+	const uint i = get_global_id(0);
+	if (i >= count) {
+		return;
+	}
+	const QueuedHit hit = hits[first + i];
+	__global float4 *directions = ao_rays + i * rays_per_hit;
+#if AO_METHOD == AO_METHOD_UNIFORM
+	float4 basis_x, basis_z;
+	ao_basis(hit.normal, &basis_x, &basis_z);
+	for (uint n = 0; n < rays_per_hit; ++n) {
+		const float4 d = ao_directions[n];
+		directions[n] = basis_x * d.x + hit.normal * d.y + basis_z * d.z;
+	}
+#elif AO_METHOD == AO_METHOD_RANDOM
+	HemisphereSampler hemi;
+	hemisphere_sampler(&hemi, hit.normal, hit.seed);
+	if (first_pass) {
+		directions[0] = hit.normal;
+	}
+	for (uint n = first_pass ? 1 : 0; n < rays_per_hit; ++n) {
+		directions[n] = hemisphere_sampler_sample(&hemi);
+	}
+#endif
+}
+inline void occlusion_ray(__global const uint *faces, __global const bvh_node *nodes, __global const bvh_bound *aabbs, __global const mesh_vertex *vertices, __global const float4 *triangles, __global const QueuedHit *hits, uint first, __global const float4 *ao_rays, uint rays_per_hit, __global uchar *occluded, uint ray PARAMS_ARG) {
+	__global const QueuedHit *hit = hits + first + ray / rays_per_hit;
+	const float4 p = hit->position + hit->normal * AO_OFFSET;
+	STATS_DECLARE
+	occluded[ray] = scene_occluded(nodes, aabbs, faces, vertices, triangles, p, ao_rays[ray], AO_MAX_DISTANCE STATS);
+}
+/*
+* Occlusion-only pass over the queued ambient occlusion rays, which belong to the hits
+* starting with the given one.
+*/
+__kernel void occlusion(__global const uint *faces, __global const bvh_node *nodes, __global const bvh_bound *aabbs, __global const mesh_vertex *vertices, __global const float4 *triangles, __global const QueuedHit *hits, const uint first, __global const float4 *ao_rays, const uint ray_count, const uint rays_per_hit, __global uchar *occluded PARAMS_ARG) {
+	const uint i = get_global_id(0);
+	if (i < ray_count) {
+		occlusion_ray(faces, nodes, aabbs, vertices, triangles, hits, first, ao_rays, rays_per_hit, occluded, i PARAMS);
+	}
+}
+// Same pass, but neighbouring work items trace the rays in the given order
+__kernel void occlusion_sorted(__global const uint *faces, __global const bvh_node *nodes, __global const bvh_bound *aabbs, __global const mesh_vertex *vertices, __global const float4 *triangles, __global const QueuedHit *hits, const uint first, __global const float4 *ao_rays, const uint ray_count, const uint rays_per_hit, __global uchar *occluded, __global const uint *order PARAMS_ARG) {
+	const uint i = get_global_id(0);
+	if (i < ray_count) {
+		occlusion_ray(faces, nodes, aabbs, vertices, triangles, hits, first, ao_rays, rays_per_hit, occluded, order[i] PARAMS);
+	}
+}
+// The sort keys of ambient occlusion rays hold the octant of the direction above a Morton
+// code of the origin with AO_SORT_MORTON_BITS bits per axis. They are sorted by digits of
+// SORT_RADIX_BITS bits.
+#define SORT_RADIX (1 << SORT_RADIX_BITS)
+/*
+* Inserts two zero bits in front of each of the lower 10 bits.
+*/
+inline uint expand_bits(uint v) {
+	v = (v * 0x00010001u) & 0xFF0000FFu;
+	v = (v * 0x00000101u) & 0x0F00F00Fu;
+	v = (v * 0x00000011u) & 0xC30C30C3u;
+	v = (v * 0x00000005u) & 0x49249249u;
+	return v;
+}
+/*
+* Computes the sort keys of the queued ambient occlusion rays, so that rays which start
+* close to each other and point into the same octant are traced by neighbouring work items.
+* The values to sort are the indices of the rays.
+*/
+__kernel void ao_sort_keys(__global const QueuedHit *hits, const uint first, __global const float4 *ao_rays, const uint ray_count, const uint rays_per_hit, const float4 scene_min, const float4 scene_size, __global uint *keys, __global uint *values) {
+	const uint i = get_global_id(0);
+	if (i >= ray_count) {
+		return;
+	}
+	const float cells = (1 << AO_SORT_MORTON_BITS) - 1;
+	const float4 cell = clamp((hits[first + i / rays_per_hit].position - scene_min) / scene_size, 0.0f, 1.0f) * cells;
+	const uint morton = (expand_bits((uint) cell.x) << 2) | (expand_bits((uint) cell.y) << 1) | expand_bits((uint) cell.z);
+	const float4 direction = ao_rays[i];
+	const uint octant = (direction.x < 0.0f) << 2 | (direction.y < 0.0f) << 1 | (direction.z < 0.0f);
+	keys[i] = octant << (3 * AO_SORT_MORTON_BITS) | morton;
+	values[i] = i;
+}
+/*
+* Counts the digits at the given shift in every chunk of SORT_CHUNK_SIZE keys. The counts
+* are ordered by digit first and by chunk second, so that scanning them yields the offsets
+* of a stable sort.
+*/
+__kernel void sort_histogram(__global const uint *keys, const uint count, const uint shift, __global uint *histograms, const uint chunk_count) {
+	const uint chunk = get_global_id(0);
+	if (chunk >= chunk_count) {
+		return;
+	}
+	uint counts[SORT_RADIX];
+	for (uint digit = 0; digit < SORT_RADIX; ++digit) {
+		counts[digit] = 0;
+	}
+	const uint end = min(count, (chunk + 1) * SORT_CHUNK_SIZE);
+	for (uint k = chunk * SORT_CHUNK_SIZE; k < end; ++k) {
+		++counts[(keys[k] >> shift) & (SORT_RADIX - 1)];
+	}
+	for (uint digit = 0; digit < SORT_RADIX; ++digit) {
+		histograms[digit * chunk_count + chunk] = counts[digit];
+	}
+}
+/*
+* Replaces the counts by their exclusive prefix sums within a single work group of
+* SORT_SCAN_SIZE work items. Every work item sums a range of the counts, the sums of
+* the ranges are scanned in local memory, and the ranges are scanned again from there.
+*/
+__kernel void sort_scan(__global uint *histograms, const uint length) {
+	__local uint sums[SORT_SCAN_SIZE];
+	const uint id = get_local_id(0);
+	const uint range = (length + SORT_SCAN_SIZE - 1) / SORT_SCAN_SIZE;
+	const uint begin = min(length, id * range);
+	const uint end = min(length, begin + range);
+	uint total = 0;
+	for (uint k = begin; k < end; ++k) {
+		total += histograms[k];
+	}
+	sums[id] = total;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (uint offset = 1; offset < SORT_SCAN_SIZE; offset <<= 1) {
+		const uint value = id >= offset ? sums[id - offset] : 0;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		sums[id] += value;
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	uint running = id > 0 ? sums[id - 1] : 0;
+	for (uint k = begin; k < end; ++k) {
+		const uint value = histograms[k];
+		histograms[k] = running;
+		running += value;
+	}
+}
+/*
+* Moves the keys and values of every chunk to the offsets of their digits, in order.
+*/
+__kernel void sort_scatter(__global const uint *keys, __global const uint *values, const uint count, const uint shift, __global const uint *histograms, const uint chunk_count, __global uint *sorted_keys, __global uint *sorted_values) {
+	const uint chunk = get_global_id(0);
+	if (chunk >= chunk_count) {
+		return;
+	}
+	uint offsets[SORT_RADIX];
+	for (uint digit = 0; digit < SORT_RADIX; ++digit) {
+		offsets[digit] = histograms[digit * chunk_count + chunk];
+	}
+	const uint end = min(count, (chunk + 1) * SORT_CHUNK_SIZE);
+	for (uint k = chunk * SORT_CHUNK_SIZE; k < end; ++k) {
+		const uint key = keys[k];
+		const uint to = offsets[(key >> shift) & (SORT_RADIX - 1)]++;
+		sorted_keys[to] = key;
+		sorted_values[to] = values[k];
+	}
+}
+/*
+* Combines the value of every hit with the results of its ambient occlusion rays.
+*/
+__kernel void accumulate(__global const QueuedHit *hits, const uint first, const uint count, __global const uchar *occluded, const uint rays_per_hit, const uint first_pass, __global float *image PARAMS_ARG) {
+	const uint i = get_global_id(0);
+	if (i >= count) {
+		return;
+	}
+	uint total = 0;
+	for (uint k = i * rays_per_hit; k < (i + 1) * rays_per_hit; ++k) {
+		total += occluded[k];
+	}
+#if AO_METHOD == AO_METHOD_UNIFORM
+	const uint n = rays_per_hit;
+#else
+	// Like ambient_occlusion, the normal is traced by the first pass but not counted
+	const uint n = first_pass ? rays_per_hit - 1 : rays_per_hit;
+#endif
+	const QueuedHit hit = hits[first + i];
+	image[hit.pixel] = hit.value * (1.0f - (float) total / (float) n);
+}
+#endif
+/*
+* Adds the count values of the last rendered tile to their sums and the sums of their
+* squares over all passes of a progressive render, which start over with the first pass,
+* and replaces the values by their means. Every pass is weighted by the number of
+* ambient occlusion rays it counts, of which all passes so far counted total, so the
+* mean divides the occluded rays of all passes by all of their rays at once. Keeps the
+* largest variance of a mean in max_variance. Variances are not negative, so their bits
+* order like unsigned integers.
+*/
+__kernel void progressive_accumulate(__global float *image, __global float *sums, __global float *squares, const uint count, const uint pass, const float weight, const float total, __global uint *max_variance) {
+	__local uint group_max;
+	const uint i = get_global_id(0);
+	if (get_local_id(0) == 0) {
+		group_max = 0;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	if (i < count) {
+		const float value = image[i];
+		const float sum = pass == 0 ? weight * value : sums[i] + weight * value;
+		const float square = pass == 0 ? weight * value * value : squares[i] + weight * value * value;
+		sums[i] = sum;
+		squares[i] = square;
+		const float n = pass + 1;
+		const float mean = sum / total;
+		image[i] = mean;
+		// Weighted sample variance of the passes, divided by their number
+		const float variance = pass == 0 ? 0.0f : max(0.0f, (square / total - mean * mean) / (n - 1.0f));
+		atomic_max(&group_max, as_uint(variance));
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	if (get_local_id(0) == 0) {
+		atomic_max(max_variance, group_max);
+	}
+}
+/*
+* Averages the n×n supersamples of every output pixel of the last rendered tile
+* and stores the pixels as bytes. Counts the supersamples which hit the scene.
+*/
+__kernel void resolve(__global const float *image, __global uchar *pixels, __global uint *hits, const uint width, const uint height PARAMS_ARG) {
+	__local uint group_hits;
+	const uint x = get_global_id(0);
+	const uint y = get_global_id(1);
+	const uint n = SUPERSAMPLES_PER_AXIS;
+	if (get_local_id(0) == 0 && get_local_id(1) == 0) {
+		group_hits = 0;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	// Work items outside of the tile must still reach the barriers
+	if (x < width && y < height) {
+		float total = 0.0f;
+		uint count = 0;
+		for (uint ss_y = 0; ss_y < n; ++ss_y) {
+			for (uint ss_x = 0; ss_x < n; ++ss_x) {
+				const float value = image[(y * n + ss_y) * TILE_WIDTH + (x * n + ss_x)];
+				total += value;
+				count += value > 0.0f;
+			}
+		}
+		// Random ambient occlusion counts the normal but does not divide by it, so it can be slightly negative
+		pixels[y * (TILE_WIDTH / n) + x] = (uchar) (clamp(total / (n * n), 0.0f, 1.0f) * 255);
+		if (count > 0) {
+			atomic_add(&group_hits, count);
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	if (get_local_id(0) == 0 && get_local_id(1) == 0 && group_hits > 0) {
+		atomic_add(hits, group_hits);
 	}
-	image[index] = value;
 }
\ No newline at end of file
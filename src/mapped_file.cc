@@ -0,0 +1,33 @@
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "mapped_file.h"
+MappedFile::MappedFile(const std::string &filename) : mapping(nullptr), length(0) {
+	const int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0) {
+		throw std::runtime_error("Cannot read file");
+	}
+	struct stat info;
+	if (fstat(fd, &info) != 0) {
+		close(fd);
+		throw std::runtime_error("Cannot read file");
+	}
+	length = info.st_size;
+	if (length > 0) {
+		void *data = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			close(fd);
+			throw std::runtime_error("Cannot map file");
+		}
+		mapping = static_cast<const char *>(data);
+	}
+	// The mapping stays valid after closing the file
+	close(fd);
+}
+MappedFile::~MappedFile() {
+	if (mapping != nullptr) {
+		munmap(const_cast<char *>(mapping), length);
+	}
+}
\ No newline at end of file
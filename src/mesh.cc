@@ -1,69 +1,241 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <limits>
 #include <stdexcept>
+#if __cplusplus >= 201703L && defined(__has_include)
+#if __has_include(<charconv>)
+#include <charconv>
+#endif
+#endif
+#include "mapped_file.h"
+#include "thread_pool.h"
 #include "vec3.h"
 #include "mesh.h"
-void load_off_mesh(const std::string &filename, Mesh *mesh) {
+// Files are split into about this many chunks per thread, but never into chunks smaller than the given size.
+static const std::size_t LOAD_CHUNKS_PER_THREAD = 8;
+static const std::size_t LOAD_MIN_CHUNK_BYTES = 1 << 16;
+inline bool is_blank(char c) {
+	return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+/*
+* Skips spaces within the current line.
+*/
+inline const char *skip_blanks(const char *p, const char *end) {
+	while (p < end && is_blank(*p)) {
+		++p;
+	}
+	return p;
+}
+/*
+* Skips spaces and line breaks.
+*/
+inline const char *skip_space(const char *p, const char *end) {
+	while (p < end && (is_blank(*p) || *p == '\n')) {
+		++p;
+	}
+	return p;
+}
+/*
+* Parses an unsigned integer at p and advances p behind it.
+* Values which do not fit into 32 bits are clamped.
+*/
+inline bool parse_uint(const char *&p, const char *end, unsigned int &value) {
+	const char *q = p;
+	uint64_t result = 0;
+	for (; q < end && *q >= '0' && *q <= '9'; ++q) {
+		result = std::min<uint64_t>(result * 10 + (*q - '0'), std::numeric_limits<unsigned int>::max());
+	}
+	if (q == p) {
+		return false;
+	}
+	value = result;
+	p = q;
+	return true;
+}
+/*
+* Parses a float at p and advances p behind it.
+*/
+inline bool parse_float(const char *&p, const char *end, float &value) {
+	if (p < end && *p == '+') {
+		++p;
+	}
+#if defined(__cpp_lib_to_chars)
+	const std::from_chars_result result = std::from_chars(p, end, value);
+	if (result.ec != std::errc()) {
+		return false;
+	}
+	p = result.ptr;
+	return true;
+#else
+	// strtof needs a terminated string, which the mapped file does not provide
+	char token[64];
+	std::size_t length = 0;
+	while (p + length < end && length + 1 < sizeof(token) && !is_blank(p[length]) && p[length] != '\n') {
+		token[length] = p[length];
+		++length;
+	}
+	token[length] = '\0';
+	char *tokenEnd;
+	value = std::strtof(token, &tokenEnd);
+	if (tokenEnd == token) {
+		return false;
+	}
+	p += tokenEnd - token;
+	return true;
+#endif
+}
+/*
+* Calls job(begin, end) for every line in [begin, end) which is neither empty nor a comment.
+*/
+template <typename Job>
+inline void for_each_line(const char *begin, const char *end, Job job) {
+	while (begin < end) {
+		const char *lineEnd = static_cast<const char *>(std::memchr(begin, '\n', end - begin));
+		if (lineEnd == nullptr) {
+			lineEnd = end;
+		}
+		const char *p = skip_blanks(begin, lineEnd);
+		if (p < lineEnd && *p != '#') {
+			job(p, lineEnd);
+		}
+		begin = lineEnd + 1;
+	}
+}
+/*
+* The file is mapped into memory and split into chunks at line boundaries. Every chunk
+* first counts its lines, so that the index of its first vertex or face is known,
+* and is then parsed in parallel straight into the mesh. Every vertex and every face
+* must be given on a line of its own.
+*/
+std::size_t load_off_mesh(const std::string &filename, Mesh *mesh) {
 	if (filename.empty()) {
 		throw std::invalid_argument("No filename given");
 	}
-	/* Open file. */
-	std::fstream input(filename.c_str());
-	if (input.fail()) {
-		throw std::runtime_error("Cannot read file");
-	}
-	/* Start parsing. */
-	std::string buffer;
+	/* Map file. */
+	const MappedFile file(filename);
+	const char *p = file.data();
+	const char *end = file.data() + file.size();
 	/* Read "OFF" file signature. */
-	input >> buffer;
-	if (buffer != "OFF") {
-		input.close();
+	p = skip_space(p, end);
+	if (end - p < 3 || std::strncmp(p, "OFF", 3) != 0 || (end - p > 3 && !is_blank(p[3]) && p[3] != '\n')) {
 		throw std::runtime_error("File not recognized as OFF model");
 	}
-	/* Clear the model data and init some values. */
-	auto num_vertices = 0u;
-	auto num_faces = 0u;
-	auto num_edges = 0u;
+	p += 3;
 	/* Read vertex, face and edge information. */
-	input >> num_vertices >> num_faces >> num_edges;
-	mesh->vertices.reserve(num_vertices);
-	mesh->faces.reserve(num_faces * 3 + 3);
-	/* Read vertices. */
-	for (auto i = 0u; i < num_vertices; ++i) {
-		float x, y, z;
-		input >> x >> y >> z;
-		mesh->vertices.push_back(Vec3f(x, y, z));
-	}
-	/* Read faces. */
-	for (auto i = 0u; i < num_faces; ++i) {
-		std::size_t n_vertices;
-		input >> n_vertices;
-		if (n_vertices == 3) {
-			/* Polygon is a triangle. */
-			unsigned int vidx[3];
-			bool indices_good = true;
-			for (int j = 0; j < 3; ++j) {
-				input >> vidx[j];
-				if (vidx[j] >= num_vertices) {
-					std::cout << "OFF Loader: Warning: Face " << i
-					          << " has invalid vertex " << vidx[j]
-					          << ", skipping face." << std::endl;
-					indices_good = false;
+	unsigned int header[3];
+	for (auto &value : header) {
+		p = skip_space(p, end);
+		if (!parse_uint(p, end, value)) {
+			throw std::runtime_error("Invalid OFF header");
+		}
+	}
+	const unsigned int num_vertices = header[0];
+	const unsigned int num_faces = header[1];
+	/* The body starts on the line after the header. */
+	const char *body = static_cast<const char *>(std::memchr(p, '\n', end - p));
+	body = body == nullptr ? end : body + 1;
+	/* Split the body into chunks at line boundaries. */
+	ThreadPool pool;
+	const std::size_t chunks = std::max<std::size_t>(1, std::min<std::size_t>(pool.size() * LOAD_CHUNKS_PER_THREAD, (end - body) / LOAD_MIN_CHUNK_BYTES));
+	std::vector<const char *> bounds(chunks + 1, end);
+	bounds[0] = body;
+	for (auto i = 1u; i < chunks; ++i) {
+		const char *bound = std::max(bounds[i - 1], body + (end - body) / chunks * i);
+		bound = static_cast<const char *>(std::memchr(bound, '\n', end - bound));
+		bounds[i] = bound == nullptr ? end : bound + 1;
+	}
+	/* Count lines. */
+	std::vector<std::size_t> first(chunks + 1, 0);
+	pool.parallelFor(chunks, 1, [&](std::size_t begin, std::size_t) {
+		for_each_line(bounds[begin], bounds[begin + 1], [&](const char *, const char *) {
+			++first[begin + 1];
+		});
+	});
+	for (auto i = 0u; i < chunks; ++i) {
+		first[i + 1] += first[i];
+	}
+	if (first[chunks] < (std::size_t) num_vertices + num_faces) {
+		throw std::runtime_error("Unexpected end of file");
+	}
+	/* Read vertices and faces. */
+	mesh->vertices.clear();
+	mesh->vertices.resize(num_vertices);
+	mesh->faces.clear();
+	mesh->faces.resize(num_faces * 3);
+	// Errors and skipped faces are reported after parsing, in the order of the file
+	std::vector<std::string> errors(chunks);
+	std::vector<std::vector<std::pair<unsigned int, unsigned int>>> invalid(chunks);
+	pool.parallelFor(chunks, 1, [&](std::size_t chunk, std::size_t) {
+		std::size_t line = first[chunk];
+		for_each_line(bounds[chunk], bounds[chunk + 1], [&](const char *token, const char *lineEnd) {
+			if (!errors[chunk].empty() || line >= (std::size_t) num_vertices + num_faces) {
+				return;
+			}
+			if (line < num_vertices) {
+				float xyz[3];
+				for (auto &value : xyz) {
+					token = skip_blanks(token, lineEnd);
+					if (!parse_float(token, lineEnd, value)) {
+						errors[chunk] = "Invalid vertex";
+						return;
+					}
 				}
+				mesh->vertices[line] = Vec3f(xyz[0], xyz[1], xyz[2]);
 			}
-			if (indices_good) {
+			else {
+				const std::size_t face = line - num_vertices;
+				unsigned int n_vertices;
+				if (!parse_uint(token, lineEnd, n_vertices) || n_vertices != 3) {
+					errors[chunk] = "Invalid face with != 3 vertices";
+					return;
+				}
+				/* Polygon is a triangle. */
 				for (int j = 0; j < 3; ++j) {
-					mesh->faces.push_back(vidx[j]);
+					unsigned int &vidx = mesh->faces[face * 3 + j];
+					token = skip_blanks(token, lineEnd);
+					if (!parse_uint(token, lineEnd, vidx)) {
+						errors[chunk] = "Invalid face";
+						return;
+					}
+					if (vidx >= num_vertices) {
+						invalid[chunk].emplace_back(face, vidx);
+					}
 				}
 			}
+			++line;
+		});
+	});
+	for (const auto &error : errors) {
+		if (!error.empty()) {
+			throw std::runtime_error(error);
 		}
-		else {
-			throw std::runtime_error("Invalid face with != 3 vertices");
+	}
+	/* Skip faces with invalid vertices. */
+	std::vector<bool> skip;
+	for (const auto &faces : invalid) {
+		for (const auto &face : faces) {
+			std::cout << "OFF Loader: Warning: Face " << face.first
+			          << " has invalid vertex " << face.second
+			          << ", skipping face." << std::endl;
+			skip.resize(num_faces, false);
+			skip[face.first] = true;
 		}
 	}
-	/* Close file stream. */
-	input.close();
+	if (!skip.empty()) {
+		auto kept = 0u;
+		for (auto i = 0u; i < num_faces; ++i) {
+			if (!skip[i]) {
+				std::copy_n(mesh->faces.begin() + i * 3, 3, mesh->faces.begin() + kept * 3);
+				++kept;
+			}
+		}
+		mesh->faces.resize(kept * 3);
+	}
+	return file.size();
 }
 void save_off_mesh(const Mesh &mesh, const std::string &filename) {
 	if (filename.empty()) {
@@ -0,0 +1,166 @@
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <unordered_map>
+#include <utility>
+#include "vec3.h"
+#include "mesh.h"
+#include "mesh_generator.h"
+static const float PI = 3.14159265358979f;
+// Dimensions of the nave, whose floor lies below the camera and whose entrance is behind it
+static const float NAVE_ENTRANCE = 2.5f, NAVE_HALF_WIDTH = 1.f, NAVE_FLOOR = -.6f, NAVE_WALL_HEIGHT = 1.2f;
+static const float BAY_LENGTH = .6f, COLUMN_OFFSET = .55f, COLUMN_RADIUS = .08f, ARCH_SPRING = .3f, ARCH_THICKNESS = .08f;
+// Surfaces of the nave are split into cells of about this edge length
+static const float NAVE_CELL_SIZE = .05f;
+// Cells around the circumference of columns and arches
+static const unsigned int ROUND_CELLS = 24;
+/*
+* Returns a uniform random float in [0, 1) which does not depend on the standard library implementation.
+*/
+inline float random_float(std::mt19937 &engine) {
+	return (engine() >> 8) * (1.f / (1u << 24));
+}
+/*
+* Adds a grid of cells triangulating the given function from [0, 1]² to points.
+* The faces point along dP/ds × dP/dt.
+*/
+template <typename Surface> void add_surface(Mesh *mesh, unsigned int columns, unsigned int rows, const Surface &surface) {
+	uint32_t base = mesh->vertices.size();
+	for (auto j = 0u; j <= rows; ++j) {
+		for (auto i = 0u; i <= columns; ++i) {
+			mesh->vertices.push_back(surface(float(i) / columns, float(j) / rows));
+		}
+	}
+	for (auto j = 0u; j < rows; ++j) {
+		for (auto i = 0u; i < columns; ++i) {
+			uint32_t v00 = base + j * (columns + 1) + i;
+			uint32_t v10 = v00 + 1, v01 = v00 + columns + 1, v11 = v01 + 1;
+			mesh->faces.insert(mesh->faces.end(), { v00, v10, v11, v00, v11, v01 });
+		}
+	}
+}
+/*
+* Returns the number of cells of about NAVE_CELL_SIZE which cover the given length.
+*/
+inline unsigned int cells(float length) {
+	return std::max(1u, (unsigned int) std::lround(length / NAVE_CELL_SIZE));
+}
+void generate_sphere_mesh(unsigned int subdivisions, Mesh *mesh) {
+	mesh->vertices.clear();
+	mesh->faces.clear();
+	mesh->vnormals.clear();
+	const float t = (1 + std::sqrt(5.f)) / 2;
+	for (const auto &v : {
+		Vec3f(-1, t, 0), Vec3f(1, t, 0), Vec3f(-1, -t, 0), Vec3f(1, -t, 0),
+		Vec3f(0, -1, t), Vec3f(0, 1, t), Vec3f(0, -1, -t), Vec3f(0, 1, -t),
+		Vec3f(t, 0, -1), Vec3f(t, 0, 1), Vec3f(-t, 0, -1), Vec3f(-t, 0, 1)
+	}) {
+		mesh->vertices.push_back(v.normalized() * .5f);
+	}
+	mesh->faces = {
+		0, 11, 5, 0, 5, 1, 0, 1, 7, 0, 7, 10, 0, 10, 11,
+		1, 5, 9, 5, 11, 4, 11, 10, 2, 10, 7, 6, 7, 1, 8,
+		3, 9, 4, 3, 4, 2, 3, 2, 6, 3, 6, 8, 3, 8, 9,
+		4, 9, 5, 2, 4, 11, 6, 2, 10, 8, 6, 7, 9, 8, 1
+	};
+	for (auto s = 0u; s < subdivisions; ++s) {
+		/* Each edge is split once, at a vertex shared by both of its faces. */
+		std::unordered_map<uint64_t, uint32_t> midpoints;
+		auto midpoint = [&](uint32_t a, uint32_t b) {
+			uint64_t key = (uint64_t) std::min(a, b) << 32 | std::max(a, b);
+			auto inserted = midpoints.emplace(key, (uint32_t) mesh->vertices.size());
+			if (inserted.second) {
+				mesh->vertices.push_back(((mesh->vertices[a] + mesh->vertices[b]) * .5f).normalized() * .5f);
+			}
+			return inserted.first->second;
+		};
+		std::vector<uint32_t> faces;
+		faces.reserve(mesh->faces.size() * 4);
+		for (std::size_t i = 0; i < mesh->faces.size(); i += 3) {
+			uint32_t a = mesh->faces[i], b = mesh->faces[i + 1], c = mesh->faces[i + 2];
+			uint32_t ab = midpoint(a, b), bc = midpoint(b, c), ca = midpoint(c, a);
+			faces.insert(faces.end(), { a, ab, ca, b, bc, ab, c, ca, bc, ab, bc, ca });
+		}
+		mesh->faces.swap(faces);
+	}
+}
+void generate_triangle_soup(std::size_t triangles, float depth, uint32_t seed, Mesh *mesh) {
+	mesh->vertices.clear();
+	mesh->faces.clear();
+	mesh->vnormals.clear();
+	mesh->vertices.reserve(triangles * 3);
+	mesh->faces.reserve(triangles * 3);
+	/* Triangles between random points of a box cover about 11 / 144 of its cross section on average. */
+	const float extent = std::sqrt(144 / 11.f * depth / std::max<std::size_t>(triangles, 1));
+	const Vec3f camera(0, 0, 2);
+	std::mt19937 engine(seed);
+	for (std::size_t i = 0; i < triangles; ++i) {
+		Vec3f center(random_float(engine) - .5f, random_float(engine) - .5f, random_float(engine) - .5f);
+		Vec3f corners[3];
+		for (auto &corner : corners) {
+			corner = center + Vec3f(random_float(engine) - .5f, random_float(engine) - .5f, random_float(engine) - .5f) * extent;
+		}
+		/* Flips back faces towards the camera. */
+		if ((corners[1] - corners[0]).cross(corners[2] - corners[0]).dot(camera - corners[0]) < 0) {
+			std::swap(corners[1], corners[2]);
+		}
+		for (const auto &corner : corners) {
+			mesh->faces.push_back(mesh->vertices.size());
+			mesh->vertices.push_back(corner);
+		}
+	}
+}
+void generate_interior_mesh(unsigned int bays, Mesh *mesh) {
+	mesh->vertices.clear();
+	mesh->faces.clear();
+	mesh->vnormals.clear();
+	const float length = BAY_LENGTH * (bays + 1);
+	const float far = NAVE_ENTRANCE - length, ceiling = NAVE_FLOOR + NAVE_WALL_HEIGHT;
+	const float width = 2 * NAVE_HALF_WIDTH, vault = NAVE_HALF_WIDTH;
+	/* Floor, facing up. */
+	add_surface(mesh, cells(width), cells(length), [&](float s, float t) {
+		return Vec3f(-NAVE_HALF_WIDTH + width * s, NAVE_FLOOR, NAVE_ENTRANCE - length * t);
+	});
+	/* Side walls, facing into the nave. */
+	add_surface(mesh, cells(NAVE_WALL_HEIGHT), cells(length), [&](float s, float t) {
+		return Vec3f(-NAVE_HALF_WIDTH, NAVE_FLOOR + NAVE_WALL_HEIGHT * s, far + length * t);
+	});
+	add_surface(mesh, cells(length), cells(NAVE_WALL_HEIGHT), [&](float s, float t) {
+		return Vec3f(NAVE_HALF_WIDTH, NAVE_FLOOR + NAVE_WALL_HEIGHT * t, far + length * s);
+	});
+	/* Barrel vault on top of the walls, facing down. */
+	add_surface(mesh, cells(PI * vault), cells(length), [&](float s, float t) {
+		return Vec3f(vault * std::cos(PI * s), ceiling + vault * std::sin(PI * s), NAVE_ENTRANCE - length * t);
+	});
+	/* End wall, facing the camera. */
+	add_surface(mesh, cells(width), cells(NAVE_WALL_HEIGHT + vault), [&](float s, float t) {
+		return Vec3f(-NAVE_HALF_WIDTH + width * s, NAVE_FLOOR + (NAVE_WALL_HEIGHT + vault) * t, far);
+	});
+	/* Arcades of columns on either side, connected by round arches. */
+	const float column_height = ARCH_SPRING - NAVE_FLOOR, arch_radius = BAY_LENGTH / 2;
+	for (float x : { -COLUMN_OFFSET, COLUMN_OFFSET }) {
+		for (auto i = 0u; i < bays; ++i) {
+			const float z = NAVE_ENTRANCE - BAY_LENGTH * (i + 1);
+			add_surface(mesh, cells(column_height), ROUND_CELLS, [&](float s, float t) {
+				return Vec3f(x + COLUMN_RADIUS * std::cos(2 * PI * t), NAVE_FLOOR + column_height * s, z + COLUMN_RADIUS * std::sin(2 * PI * t));
+			});
+			if (i + 1 == bays) {
+				continue;
+			}
+			/* Intrados facing the center of the arch, and both faces of the arch. */
+			const float center = z - arch_radius;
+			auto arch = [&](float across, float radius, float angle) {
+				return Vec3f(across, ARCH_SPRING + radius * std::sin(PI * angle), center + radius * std::cos(PI * angle));
+			};
+			add_surface(mesh, ROUND_CELLS, 2, [&](float s, float t) {
+				return arch(x - COLUMN_RADIUS + 2 * COLUMN_RADIUS * t, arch_radius, s);
+			});
+			add_surface(mesh, ROUND_CELLS, 2, [&](float s, float t) {
+				return arch(x + COLUMN_RADIUS, arch_radius + ARCH_THICKNESS * t, s);
+			});
+			add_surface(mesh, 2, ROUND_CELLS, [&](float s, float t) {
+				return arch(x - COLUMN_RADIUS, arch_radius + ARCH_THICKNESS * s, t);
+			});
+		}
+	}
+}
\ No newline at end of file
@@ -1,77 +1,311 @@
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <limits>
 #include <stdexcept>
 #include <sstream>
 #include <cstddef>
+#include <cstring>
+#include <unistd.h>
 #include "color.h"
+#include "compact_layout.h"
 #include "compiler_options.h"
+#include "hash.h"
 #include "info.h"
 #include "opencl_host.h"
 
+// Stack size of the traversal in kernels with runtime parameters, rounded up to powers of two.
+static const std::size_t RUNTIME_MIN_STACK_SIZE = 32;
+// Work group size of the one-dimensional wavefront kernels.
+static const std::size_t WAVEFRONT_GROUP_SIZE = 64;
+// Ambient occlusion rays queued at once in the wavefront mode, bounds the size of the queue.
+static const std::size_t WAVEFRONT_AO_BATCH_RAYS = 1 << 21;
+static const char *const STAGE_NAMES[] = { "Ray generation", "Closest hit", "AO ray generation", "AO ray sorting", "Occlusion", "Accumulation" };
+// Sort keys of ambient occlusion rays: the octant of the direction above a Morton code of the
+// origin. They are sorted in passes of SORT_RADIX_BITS bits, by chunks of SORT_CHUNK_SIZE keys
+// per work item and with a single work group of SORT_SCAN_SIZE work items for the offsets.
+static const unsigned int AO_SORT_MORTON_BITS = 7;
+static const unsigned int AO_SORT_KEY_BITS = 3 * AO_SORT_MORTON_BITS + 3;
+static const unsigned int SORT_RADIX_BITS = 4;
+static const std::size_t SORT_CHUNK_SIZE = 256;
+static const std::size_t SORT_SCAN_SIZE = 256;
+// Identifies a cached program binary, followed by the length of the cache key, the key and the binary.
+static const char BINARY_MAGIC[8] = { 'R', 'T', 'C', 'L', 'B', 'I', 'N', '\0' };
+
 struct Resource {
 	const char *data;
 	const std::size_t size;
 };
 extern "C" Resource INTERSECT_KERNEL(void);
 
-OpenCLHost::OpenCLHost(const RayTracer &rt) : rt(rt) {
+OpenCLHost::OpenCLHost(const RayTracer &rt, const Scene &scene, const std::vector<cl::Device> &devices, const std::string &cacheDir) : rt(rt), cacheDir(cacheDir), bvhWidth(scene.bvhWidth), bvhStackSize(scene.bvhStackSize), aoBatchSize(0), pass(0), devices(devices.size()) {
+	if (devices.empty())
+		throw std::runtime_error("No device found");
+	// Buffers are shared through a single context, which cannot span platforms
+	for (const auto &device : devices) {
+		if (device.getInfo<CL_DEVICE_PLATFORM>() != devices[0].getInfo<CL_DEVICE_PLATFORM>())
+			throw std::runtime_error("All devices must belong to the same platform");
+	}
+	for (auto i = 0u; i < devices.size(); ++i) {
+		this->devices[i].device = devices[i];
+		std::cout << Color::WHITE << "Using Device \"" << devices[i].getInfo<CL_DEVICE_NAME>() << "\"." << Color::RESET << std::endl;
+	}
+	std::cout << std::endl;
+	context = cl::Context(devices);
+	std::cout << Color::BLUE << "<- " << Color::GREEN << "OpenCL log section" << Color::BLUE << " ->" << std::endl;
+	program = compile(getBuildOptions(rt.options.enableShading, rt.options.enableAO, rt.options.aoMethod));
+	for (auto &device : this->devices) {
+		// The passes of the wavefront mode and the commands of the timing report are timed with profiling events
+		device.queue = cl::CommandQueue(context, device.device, rt.options.wavefront || rt.options.profileCommands ? CL_QUEUE_PROFILING_ENABLE : 0);
+		std::fill(device.stageTimes, device.stageTimes + STAGE_COUNT, 0);
+		std::fill(device.stageItems, device.stageItems + STAGE_COUNT, 0);
+	}
+}
+/*
+* Selects the devices given by a comma-separated list of platform:device indices,
+* device types (gpu, cpu, accelerator) and "all". Without a selection, the first GPU is
+* used, or the last device found if there is no GPU.
+*/
+std::vector<cl::Device> OpenCLHost::getDevices(const std::string &selection, std::size_t subDevices) {
 	std::vector<cl::Platform> platforms;
 	cl::Platform::get(&platforms);
-	cl::Device device;
-	bool device_available = false;
+	std::vector<std::vector<cl::Device>> platformDevices(platforms.size());
 	for (auto i = 0u; i < platforms.size(); ++i) {
-		std::vector<cl::Device> devices;
-		platforms[i].getDevices(CL_DEVICE_TYPE_ALL, &devices);
-		for (auto j = 0u; j < devices.size(); ++j) {
-			device = devices[j];
-			device_available = true;
-			if (device.getInfo<CL_DEVICE_AVAILABLE>() && device.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_GPU)
-				goto DEVICE_FOUND;
+		platforms[i].getDevices(CL_DEVICE_TYPE_ALL, &platformDevices[i]);
+	}
+	std::vector<cl::Device> selected;
+	const auto select = [&](const cl::Device &device) {
+		if (std::find_if(selected.begin(), selected.end(), [&](const cl::Device &other) { return other() == device(); }) == selected.end()) {
+			selected.push_back(device);
+		}
+	};
+	if (selection.empty()) {
+		for (const auto &devices : platformDevices) {
+			for (const auto &device : devices) {
+				selected = { device };
+				if (device.getInfo<CL_DEVICE_AVAILABLE>() && device.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_GPU)
+					goto DEVICE_FOUND;
+			}
 		}
 	}
-	if (!device_available)
-		throw std::runtime_error("No device found");
 DEVICE_FOUND:
-	std::string deviceName = device.getInfo<CL_DEVICE_NAME>();
-	std::cout << Color::WHITE << "Using Device \"" << deviceName << "\"." << Color::RESET << std::endl << std::endl;
-	context = cl::Context(std::vector<cl::Device>{ device });
-	cl::Program::Sources sources;
-	std::cout << Color::BLUE << "<- " << Color::GREEN << "OpenCL log section" << Color::BLUE << " ->" << std::endl;
-
-	// kernel parameters
+	std::stringstream items(selection);
+	std::string item;
+	while (std::getline(items, item, ',')) {
+		const std::size_t colon = item.find(':');
+		if (colon != std::string::npos) {
+			const std::size_t platform = std::stoul(item.substr(0, colon));
+			const std::size_t device = std::stoul(item.substr(colon + 1));
+			if (platform >= platformDevices.size() || device >= platformDevices[platform].size())
+				throw std::runtime_error("No device " + item);
+			select(platformDevices[platform][device]);
+			continue;
+		}
+		cl_device_type type;
+		if (item == "gpu")
+			type = CL_DEVICE_TYPE_GPU;
+		else if (item == "cpu")
+			type = CL_DEVICE_TYPE_CPU;
+		else if (item == "accelerator")
+			type = CL_DEVICE_TYPE_ACCELERATOR;
+		else if (item == "all")
+			type = CL_DEVICE_TYPE_ALL;
+		else
+			throw std::runtime_error("Invalid device " + item);
+		const std::size_t count = selected.size();
+		for (const auto &devices : platformDevices) {
+			for (const auto &device : devices) {
+				if (device.getInfo<CL_DEVICE_AVAILABLE>() && (device.getInfo<CL_DEVICE_TYPE>() & type) != 0) {
+					select(device);
+				}
+			}
+		}
+		if (selected.size() == count)
+			throw std::runtime_error("No device of type " + item);
+	}
+	if (subDevices < 2) {
+		return selected;
+	}
+	// Split every device into sub-devices with equal numbers of compute units
+	std::vector<cl::Device> partitioned;
+	for (auto &device : selected) {
+		const cl_uint units = std::max(1u, device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() / (cl_uint) subDevices);
+		const cl_device_partition_property properties[] = { CL_DEVICE_PARTITION_EQUALLY, (cl_device_partition_property) units, 0 };
+		std::vector<cl::Device> parts;
+		check(device.createSubDevices(properties, &parts));
+		parts.resize(std::min(parts.size(), subDevices));
+		partitioned.insert(partitioned.end(), parts.begin(), parts.end());
+	}
+	return partitioned;
+}
+/*
+* Compiles the kernel for every combination of shading and ambient occlusion method into the
+* cache, so that later runs which only change these switches or runtime parameters do not stall.
+*/
+void OpenCLHost::precompile() {
+	using Method = RayTracer::AmbientOcclusionMethod;
+	const std::pair<bool, Method> aoVariants[] = { { false, Method::UNIFORM }, { true, Method::UNIFORM }, { true, Method::RANDOM } };
+	for (const bool shading : { false, true }) {
+		for (const auto &ao : aoVariants) {
+			compile(getBuildOptions(shading, ao.first, ao.second));
+		}
+	}
+}
+std::string OpenCLHost::getBuildOptions(bool shading, bool ao, RayTracer::AmbientOcclusionMethod aoMethod) const {
+	CompilerOptions co;
+	std::size_t stackSize = std::max<std::size_t>(1, bvhStackSize);
+	if (rt.options.runtimeParams) {
+		co.add("RUNTIME_PARAMS", true);
+		// Round the stack up, so that most meshes share the same binaries
+		stackSize = RUNTIME_MIN_STACK_SIZE;
+		while (stackSize < bvhStackSize) {
+			stackSize *= 2;
+		}
+	}
+	else {
+		co.add("WIDTH", rt.totalWidth);
+		co.add("HEIGHT", rt.totalHeight);
+		co.add("TILE_WIDTH", rt.tileWidth);
+		co.add("TILE_HEIGHT", rt.tileHeight);
+		co.add("FOCAL_LENGTH", rt.options.focalLength);
+		co.add("SUPERSAMPLES_PER_AXIS", rt.totalWidth / rt.options.width);
+		co.add("AO_MAX_DISTANCE", rt.options.aoMaxDistance);
+		co.add("AO_NUM_SAMPLES", rt.options.aoNumSamples);
+		co.add("AO_ALPHA_MIN", rt.options.aoAlphaMin);
+		co.add("AO_ALPHA_MAX", rt.options.aoAlphaMax);
+	}
+	co.add("SHADING_ENABLE", shading);
+	co.add("AO_ENABLE", ao);
+	// The method does not matter without ambient occlusion, leaving it out saves binaries
+	if (ao) {
+		co.add("AO_METHOD", (std::size_t) aoMethod);
+		co.add("AO_SORT_MORTON_BITS", AO_SORT_MORTON_BITS);
+		co.add("SORT_RADIX_BITS", SORT_RADIX_BITS);
+		co.add("SORT_CHUNK_SIZE", SORT_CHUNK_SIZE);
+		co.add("SORT_SCAN_SIZE", SORT_SCAN_SIZE);
+	}
+	co.add("BVH_LEAF", BVH::LEAF);
+	co.add("BVH_WIDTH", bvhWidth);
+	co.add("BVH_STACK_SIZE", stackSize);
+	co.add("TRAVERSAL_STACK", rt.options.stackTraversal);
+	co.add("PRECOMPUTED_TRIANGLES", rt.options.precomputeTriangles);
+	co.add("TRAVERSAL_STATS", rt.options.traversalStats);
+	co.add("COMPACT_LAYOUT", rt.options.compactBits > 0);
+	co.add("INTERLEAVED_VERTICES", rt.options.interleaveVertices);
+	if (rt.options.compactBits > 0) {
+		co.add("COMPACT_BOX_BITS", rt.options.compactBits);
+	}
+	return co.str();
+}
+cl::Program OpenCLHost::compile(const std::string &options) {
 	Resource kernel = INTERSECT_KERNEL();
+	cl::Program::Sources sources;
 	sources.push_back(std::pair<const char *, std::size_t>(kernel.data, kernel.size));
-	CompilerOptions co;
-	co.add("WIDTH", rt.totalWidth);
-	co.add("HEIGHT", rt.totalHeight);
-	co.add("FOCAL_LENGTH", rt.options.focalLength);
-	co.add("NSUPERSAMPLES", rt.options.nSuperSamples);
-	co.add("SHADING_ENABLE", rt.options.enableShading);
-	co.add("AO_ENABLE", rt.options.enableAO);
-	co.add("AO_MAX_DISTANCE", rt.options.aoMaxDistance);
-	co.add("AO_NUM_SAMPLES", rt.options.aoNumSamples);
-	co.add("AO_METHOD", (std::size_t) rt.options.aoMethod);
-	co.add("AO_ALPHA_MIN", rt.options.aoAlphaMin);
-	co.add("AO_ALPHA_MAX", rt.options.aoAlphaMax);
-	std::string options(co.str());
+	// Binaries depend on the device, its driver, the kernel source and the build options
+	std::string cacheFile;
+	std::string cacheKey;
+	const cl::Device &device = devices[0].device;
+	// Only programs for a single device are cached
+	if (!cacheDir.empty() && devices.size() == 1) {
+		cacheKey = device.getInfo<CL_DEVICE_NAME>() + "\n" + device.getInfo<CL_DRIVER_VERSION>() + "\n" + hashToString(hashBytes(kernel.data, kernel.size)) + "\n" + options;
+		cacheFile = cacheDir + "/" + hashToString(hashBytes(cacheKey)) + ".clbin";
+	}
+	cl::Program program;
 	Info::measure("Compiling kernel", [&] {
 		std::cout << "Build options: " << options << std::endl;
+		if (!cacheFile.empty()) {
+			const bool cached = loadBinary(cacheFile, cacheKey, options, program);
+			std::cout << "Kernel cache: " << (cached ? "hit" : "miss") << " (" << cacheFile << ")" << std::endl;
+			if (cached) {
+				return true;
+			}
+		}
 		program = cl::Program(context, sources);
 		cl_int status;
-		status = program.build(std::vector<cl::Device>{ device }, options.c_str());
+		status = program.build(context.getInfo<CL_CONTEXT_DEVICES>(), options.c_str());
 		if (status != CL_SUCCESS) {
-			std::cerr
-				<< std::endl
-				<< "Build log:"
-				<< std::endl << std::endl
-				<< Color::RED
-				<< program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device)
-				<< Color::RESET
-				<< std::endl;
+			for (const auto &failed : devices) {
+				std::cerr
+					<< std::endl
+					<< "Build log:"
+					<< std::endl << std::endl
+					<< Color::RED
+					<< program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(failed.device)
+					<< Color::RESET
+					<< std::endl;
+			}
 			return false;
 		}
+		if (!cacheFile.empty()) {
+			saveBinary(program, cacheFile, cacheKey);
+		}
 		return true;
 	}, true);
-
-	queue = cl::CommandQueue(context, device);
+	return program;
+}
+/*
+* Creates the program from a cached binary. Fails if the file is missing, was written for
+* another key (in case two keys share a hash) or is rejected by the driver.
+*/
+bool OpenCLHost::loadBinary(const std::string &filename, const std::string &key, const std::string &options, cl::Program &program) {
+	std::ifstream in(filename, std::ios::binary);
+	if (!in.good()) {
+		return false;
+	}
+	const std::vector<char> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+	uint64_t keySize;
+	if (data.size() < sizeof(BINARY_MAGIC) + sizeof(keySize) || std::memcmp(data.data(), BINARY_MAGIC, sizeof(BINARY_MAGIC)) != 0) {
+		return false;
+	}
+	std::memcpy(&keySize, data.data() + sizeof(BINARY_MAGIC), sizeof(keySize));
+	const std::size_t offset = sizeof(BINARY_MAGIC) + sizeof(keySize) + keySize;
+	if (keySize != key.size() || data.size() <= offset || key.compare(0, key.size(), data.data() + offset - keySize, keySize) != 0) {
+		return false;
+	}
+	const std::vector<cl::Device> devices{ this->devices[0].device };
+	const cl::Program::Binaries binaries{ std::make_pair(static_cast<const void *>(data.data() + offset), data.size() - offset) };
+	std::vector<cl_int> binaryStatus;
+	cl_int err;
+	program = cl::Program(context, devices, binaries, &binaryStatus, &err);
+	if (err != CL_SUCCESS || binaryStatus.empty() || binaryStatus[0] != CL_SUCCESS) {
+		return false;
+	}
+	// Programs created from binaries still need to be built
+	return program.build(devices, options.c_str()) == CL_SUCCESS;
+}
+/*
+* Writes the binary of the program for its only device. Failures are only reported,
+* as the program can always be built from source again.
+*/
+void OpenCLHost::saveBinary(const cl::Program &program, const std::string &filename, const std::string &key) {
+	const std::vector<std::size_t> sizes = program.getInfo<CL_PROGRAM_BINARY_SIZES>();
+	if (sizes.size() != 1 || sizes[0] == 0) {
+		std::cout << Info::Color::WARNING << "Kernel binary not available for caching." << Color::RESET << std::endl;
+		return;
+	}
+	std::vector<char> binary(sizes[0]);
+	char *binaryData = binary.data();
+	if (clGetProgramInfo(program(), CL_PROGRAM_BINARIES, sizeof(binaryData), &binaryData, nullptr) != CL_SUCCESS) {
+		std::cout << Info::Color::WARNING << "Kernel binary not available for caching." << Color::RESET << std::endl;
+		return;
+	}
+	// Write to a temporary file first, so that other processes never read a partial binary
+	const std::string tmp = filename + "." + std::to_string(getpid()) + ".tmp";
+	std::error_code error;
+	std::filesystem::create_directories(std::filesystem::path(filename).parent_path(), error);
+	std::ofstream out(tmp, std::ios::binary);
+	const uint64_t keySize = key.size();
+	out.write(BINARY_MAGIC, sizeof(BINARY_MAGIC));
+	out.write(reinterpret_cast<const char *>(&keySize), sizeof(keySize));
+	out.write(key.data(), key.size());
+	out.write(binary.data(), binary.size());
+	out.close();
+	if (out.fail() || std::rename(tmp.c_str(), filename.c_str()) != 0) {
+		std::remove(tmp.c_str());
+		std::cout << Info::Color::WARNING << "Cannot write kernel cache." << Color::RESET << std::endl;
+	}
 }
 void OpenCLHost::printInfo() {
 	std::vector<cl::Platform> allPlatforms;
@@ -117,37 +351,548 @@ void OpenCLHost::printInfo() {
 	std::cout << std::endl;
 	std::cout << info.str();
 }
-void OpenCLHost::upload(const std::vector<uint32_t> &faces, const std::vector<uint32_t> &nodes, const std::vector<Vec3f> &aabbs, const std::vector<Vec3f> &vertices, const std::vector<Vec3f> &vnormals) {
+/*
+* The compact layout is encoded here, so that the scene and its cache keep the layout which the
+* CPU backend reads. Only the child boxes of wide BVHs are quantized, as binary nodes store one
+* box each, which a grid per node would not make smaller. Interleaved vertices share one buffer
+* with their normals, which is bound to both kernel arguments.
+*/
+void OpenCLHost::upload(const Scene &scene) {
+	const unsigned int bits = rt.options.compactBits;
+	const std::size_t wideNodes = bvhWidth > 2 ? scene.nodes.size / (2 * bvhWidth * sizeof(uint32_t)) : 0;
+	const std::size_t vertexCount = scene.vertices.size / sizeof(Vec3f);
+	const std::size_t normalCount = scene.vnormals.size / sizeof(Vec3f);
+	const std::size_t sharedSize = scene.faces.size + scene.nodes.size + scene.triangles.size;
+	const std::size_t standardSize = sharedSize + scene.aabbs.size + scene.vertices.size + scene.vnormals.size;
+	const std::size_t compactSize = sharedSize + (bvhWidth > 2 ? wideNodes * compactBoundsSize(bvhWidth, bits > 0 ? bits : 8) : scene.aabbs.size) + vertexCount * 3 * sizeof(float) + normalCount * sizeof(uint32_t);
+	// Arrays in the layout of the device buffers
+	Scene::Array deviceAABBs = scene.aabbs, deviceVertices = scene.vertices, deviceNormals = scene.vnormals;
+	std::vector<unsigned char> compactAABBs;
+	std::vector<float> compactVertices;
+	std::vector<uint32_t> compactNormals;
+	if (bits > 0 && bvhWidth > 2) {
+		compactAABBs = quantizeWideAABBs(static_cast<const float *>(scene.aabbs.data), wideNodes, bvhWidth, bits);
+		deviceAABBs = Scene::Array{ compactAABBs.data(), compactAABBs.size() };
+	}
+	if (rt.options.interleaveVertices) {
+		compactVertices = interleaveVertices(static_cast<const Vec3f *>(scene.vertices.data), static_cast<const Vec3f *>(scene.vnormals.data), vertexCount, bits > 0);
+		deviceVertices = Scene::Array{ compactVertices.data(), compactVertices.size() * sizeof(float) };
+		deviceNormals = Scene::Array{ nullptr, 0 };
+	}
+	else if (bits > 0) {
+		compactVertices = packVertices(static_cast<const Vec3f *>(scene.vertices.data), vertexCount);
+		compactNormals = encodeNormals(static_cast<const Vec3f *>(scene.vnormals.data), normalCount);
+		deviceVertices = Scene::Array{ compactVertices.data(), compactVertices.size() * sizeof(float) };
+		deviceNormals = Scene::Array{ compactNormals.data(), compactNormals.size() * sizeof(uint32_t) };
+	}
 	auto mem = 0u;
-	facesBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, mem += faces.size() * sizeof(uint32_t));
-	nodesBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, mem +=nodes.size() * sizeof(uint32_t));
-	aabbsBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, mem +=aabbs.size() * sizeof(Vec3f));
-	verticesBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, mem +=vertices.size() * sizeof(Vec3f));
-	vnormalsBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, mem +=vnormals.size() * sizeof(Vec3f));
-	imageBuffer = cl::Buffer(context, CL_MEM_WRITE_ONLY, mem +=rt.totalWidth * rt.totalHeight * sizeof(float));
+	facesBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, mem += scene.faces.size);
+	nodesBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, mem +=scene.nodes.size);
+	aabbsBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, mem +=deviceAABBs.size);
+	verticesBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, mem +=deviceVertices.size);
+	vnormalsBuffer = rt.options.interleaveVertices ? verticesBuffer : cl::Buffer(context, CL_MEM_READ_ONLY, mem +=deviceNormals.size);
+	// Buffers must not be empty, even if the kernel does not use the triangles
+	trianglesBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, mem +=std::max<std::size_t>(sizeof(Vec3f), scene.triangles.size));
+	// The host counts the uniform directions of the wavefront mode, so it also generates them
+	std::vector<cl_float4> aoDirections;
+	for (const auto &direction : rt.getAODirections()) {
+		aoDirections.push_back({ { direction[0], direction[1], direction[2], 0.0f } });
+	}
+	aoDirectionsBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, mem +=std::max<std::size_t>(1, aoDirections.size()) * sizeof(cl_float4));
+	paramsBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, mem +=sizeof(Params));
+	const std::size_t n = rt.totalWidth / rt.options.width;
+	for (auto &device : devices) {
+		// Holds one tile, which is the whole image unless tiled rendering is enabled
+		device.imageBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, mem +=rt.tileWidth * rt.tileHeight * sizeof(float));
+		// The resolved tile only needs one byte per output pixel
+		device.pixelsBuffer = cl::Buffer(context, CL_MEM_WRITE_ONLY, mem +=(rt.tileWidth / n) * (rt.tileHeight / n));
+		device.hitsBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, mem +=sizeof(cl_uint));
+		if (rt.options.traversalStats) {
+			device.traversalStatsBuffer = cl::Buffer(context, CL_MEM_WRITE_ONLY, mem +=rt.tileWidth * rt.tileHeight * sizeof(TraversalStats));
+		}
+		if (rt.options.adaptive) {
+			device.refineQueueBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, mem +=rt.options.width * rt.options.height * sizeof(cl_uint));
+			device.refineCountBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, mem +=sizeof(cl_uint));
+			device.adaptiveHitsBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, mem +=sizeof(cl_uint));
+		}
+		if (rt.options.progressive) {
+			device.sumsBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, mem +=rt.tileWidth * rt.tileHeight * sizeof(float));
+			device.squaresBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, mem +=rt.tileWidth * rt.tileHeight * sizeof(float));
+			device.varianceBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, mem +=sizeof(cl_uint));
+		}
+	}
+	const std::size_t tileRays = rt.tileWidth * rt.tileHeight;
+	const std::size_t raysPerHit = std::max(1u, rt.getAORayCount());
+	aoBatchSize = std::min(tileRays, std::max<std::size_t>(1, WAVEFRONT_AO_BATCH_RAYS / raysPerHit));
+	if (rt.options.wavefront) {
+		for (auto &device : devices) {
+			device.rayQueueBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, mem +=tileRays * sizeof(QueuedRay));
+			device.hitQueueBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, mem +=tileRays * sizeof(QueuedHit));
+			device.hitCountBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, mem +=sizeof(cl_uint));
+			if (rt.options.enableAO) {
+				device.aoRayQueueBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, mem +=aoBatchSize * raysPerHit * sizeof(cl_float4));
+				device.occludedBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, mem +=aoBatchSize * raysPerHit);
+			}
+			if (rt.options.enableAO && rt.options.sortAORays) {
+				for (auto i = 0u; i < 2; ++i) {
+					device.sortKeysBuffers[i] = cl::Buffer(context, CL_MEM_READ_WRITE, mem +=aoBatchSize * raysPerHit * sizeof(cl_uint));
+					device.sortValuesBuffers[i] = cl::Buffer(context, CL_MEM_READ_WRITE, mem +=aoBatchSize * raysPerHit * sizeof(cl_uint));
+				}
+				const std::size_t chunks = (aoBatchSize * raysPerHit + SORT_CHUNK_SIZE - 1) / SORT_CHUNK_SIZE;
+				device.sortHistogramBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, mem +=(chunks << SORT_RADIX_BITS) * sizeof(cl_uint));
+			}
+		}
+	}
+	// Sort keys quantize the origins of ambient occlusion rays within the bounds of the scene
+	AABB bounds;
+	const Vec3f *vertices = static_cast<const Vec3f *>(scene.vertices.data);
+	for (std::size_t i = 0; i < scene.vertices.size / sizeof(Vec3f); ++i) {
+		bounds.merge(vertices[i]);
+	}
+	for (auto axis = 0u; axis < 3; ++axis) {
+		sceneMin.s[axis] = bounds.min[axis];
+		sceneSize.s[axis] = std::max(bounds.max[axis] - bounds.min[axis], std::numeric_limits<float>::min());
+	}
+	sceneMin.s[3] = 0.0f;
+	sceneSize.s[3] = 1.0f;
 	std::cout << "Requested " << mem / 1024 << " kB of memory." << std::endl;
-	// Write data to GPU
-	check(queue.enqueueWriteBuffer(facesBuffer, CL_TRUE, 0, faces.size() * sizeof(uint32_t), faces.data()));
-	check(queue.enqueueWriteBuffer(nodesBuffer, CL_TRUE, 0, nodes.size() * sizeof(uint32_t), nodes.data()));
-	check(queue.enqueueWriteBuffer(aabbsBuffer, CL_TRUE, 0, aabbs.size() * sizeof(Vec3f), aabbs.data()));
-	check(queue.enqueueWriteBuffer(verticesBuffer, CL_TRUE, 0, vertices.size() * sizeof(Vec3f), vertices.data()));
-	check(queue.enqueueWriteBuffer(vnormalsBuffer, CL_TRUE, 0, vnormals.size() * sizeof(Vec3f), vnormals.data()));
+	std::cout << "Scene takes " << standardSize / 1024 << " kB in the standard layout and " << compactSize / 1024 << " kB in the compact layout" << (bits > 0 ? " (used)." : ".") << std::endl;
+	// Write data to GPU, straight from the mapped cache file if the scene was loaded from one.
+	// The buffers belong to the context, so all devices share them.
+	const cl::CommandQueue &queue = devices[0].queue;
+	check(queue.enqueueWriteBuffer(facesBuffer, CL_TRUE, 0, scene.faces.size, scene.faces.data, nullptr, profile("faces", CommandTiming::Type::UPLOAD, devices[0], scene.faces.size)));
+	check(queue.enqueueWriteBuffer(nodesBuffer, CL_TRUE, 0, scene.nodes.size, scene.nodes.data, nullptr, profile("nodes", CommandTiming::Type::UPLOAD, devices[0], scene.nodes.size)));
+	check(queue.enqueueWriteBuffer(aabbsBuffer, CL_TRUE, 0, deviceAABBs.size, deviceAABBs.data, nullptr, profile("aabbs", CommandTiming::Type::UPLOAD, devices[0], deviceAABBs.size)));
+	check(queue.enqueueWriteBuffer(verticesBuffer, CL_TRUE, 0, deviceVertices.size, deviceVertices.data, nullptr, profile("vertices", CommandTiming::Type::UPLOAD, devices[0], deviceVertices.size)));
+	if (!rt.options.interleaveVertices) {
+		check(queue.enqueueWriteBuffer(vnormalsBuffer, CL_TRUE, 0, deviceNormals.size, deviceNormals.data, nullptr, profile("vnormals", CommandTiming::Type::UPLOAD, devices[0], deviceNormals.size)));
+	}
+	if (scene.triangles.size > 0) {
+		check(queue.enqueueWriteBuffer(trianglesBuffer, CL_TRUE, 0, scene.triangles.size, scene.triangles.data, nullptr, profile("triangles", CommandTiming::Type::UPLOAD, devices[0], scene.triangles.size)));
+	}
+	if (!aoDirections.empty()) {
+		const std::size_t size = aoDirections.size() * sizeof(cl_float4);
+		check(queue.enqueueWriteBuffer(aoDirectionsBuffer, CL_TRUE, 0, size, aoDirections.data(), nullptr, profile("ao_directions", CommandTiming::Type::UPLOAD, devices[0], size)));
+	}
+	const Params params = {
+		rt.totalWidth,
+		rt.totalHeight,
+		rt.tileWidth,
+		rt.tileHeight,
+		rt.options.focalLength,
+		(cl_uint) n,
+		rt.options.aoMaxDistance,
+		rt.options.aoNumSamples,
+		rt.options.aoAlphaMin,
+		rt.options.aoAlphaMax
+	};
+	check(queue.enqueueWriteBuffer(paramsBuffer, CL_TRUE, 0, sizeof(Params), &params, nullptr, profile("params", CommandTiming::Type::UPLOAD, devices[0], sizeof(Params))));
+	const cl_uint hits = 0;
+	for (auto &device : devices) {
+		check(queue.enqueueWriteBuffer(device.hitsBuffer, CL_TRUE, 0, sizeof(cl_uint), &hits, nullptr, profile("hits", CommandTiming::Type::UPLOAD, devices[0], sizeof(cl_uint))));
+	}
 	check(queue.finish());
+	// Every device gets its own kernels, as setting arguments is not thread-safe
+	for (auto &device : devices) {
+		device.kernel = cl::Kernel(program, "intersect");
+		device.kernel.setArg(0, facesBuffer);
+		device.kernel.setArg(1, nodesBuffer);
+		device.kernel.setArg(2, aabbsBuffer);
+		device.kernel.setArg(3, verticesBuffer);
+		device.kernel.setArg(4, vnormalsBuffer);
+		device.kernel.setArg(5, trianglesBuffer);
+		device.kernel.setArg(6, device.imageBuffer);
+		device.resolveKernel = cl::Kernel(program, "resolve");
+		device.resolveKernel.setArg(0, device.imageBuffer);
+		device.resolveKernel.setArg(1, device.pixelsBuffer);
+		device.resolveKernel.setArg(2, device.hitsBuffer);
+		if (rt.options.runtimeParams) {
+			device.kernel.setArg(8, paramsBuffer);
+			device.resolveKernel.setArg(5, paramsBuffer);
+		}
+		// The counters follow the parameters, which are only passed at runtime
+		if (rt.options.traversalStats) {
+			device.kernel.setArg(rt.options.runtimeParams ? 9 : 8, device.traversalStatsBuffer);
+		}
+		if (rt.options.adaptive) {
+			device.adaptiveBaseKernel = cl::Kernel(program, "adaptive_base");
+			device.adaptiveClassifyKernel = cl::Kernel(program, "adaptive_classify");
+			device.adaptiveRefineKernel = cl::Kernel(program, "adaptive_refine");
+			for (auto kernel : { &device.adaptiveBaseKernel, &device.adaptiveRefineKernel }) {
+				kernel->setArg(0, facesBuffer);
+				kernel->setArg(1, nodesBuffer);
+				kernel->setArg(2, aabbsBuffer);
+				kernel->setArg(3, verticesBuffer);
+				kernel->setArg(4, vnormalsBuffer);
+				kernel->setArg(5, trianglesBuffer);
+				kernel->setArg(6, device.imageBuffer);
+			}
+			device.adaptiveBaseKernel.setArg(7, device.adaptiveHitsBuffer);
+			device.adaptiveClassifyKernel.setArg(0, device.imageBuffer);
+			device.adaptiveClassifyKernel.setArg(1, rt.options.adaptiveContrast);
+			device.adaptiveClassifyKernel.setArg(2, rt.options.adaptiveVariance);
+			device.adaptiveClassifyKernel.setArg(3, device.refineQueueBuffer);
+			device.adaptiveClassifyKernel.setArg(4, device.refineCountBuffer);
+			device.adaptiveRefineKernel.setArg(7, device.refineQueueBuffer);
+			device.adaptiveRefineKernel.setArg(9, device.adaptiveHitsBuffer);
+			if (rt.options.runtimeParams) {
+				device.adaptiveBaseKernel.setArg(8, paramsBuffer);
+				device.adaptiveClassifyKernel.setArg(5, paramsBuffer);
+				device.adaptiveRefineKernel.setArg(10, paramsBuffer);
+			}
+		}
+		if (rt.options.progressive) {
+			device.progressiveKernel = cl::Kernel(program, "progressive_accumulate");
+			device.progressiveKernel.setArg(0, device.imageBuffer);
+			device.progressiveKernel.setArg(1, device.sumsBuffer);
+			device.progressiveKernel.setArg(2, device.squaresBuffer);
+			device.progressiveKernel.setArg(3, (cl_uint) (rt.tileWidth * rt.tileHeight));
+			device.progressiveKernel.setArg(7, device.varianceBuffer);
+		}
+		if (!rt.options.wavefront) {
+			continue;
+		}
+		// Arguments which change with every tile or batch are set when rendering
+		device.generateKernel = cl::Kernel(program, "generate");
+		device.generateKernel.setArg(0, device.rayQueueBuffer);
+		device.closestHitKernel = cl::Kernel(program, "closest_hit");
+		device.closestHitKernel.setArg(0, facesBuffer);
+		device.closestHitKernel.setArg(1, nodesBuffer);
+		device.closestHitKernel.setArg(2, aabbsBuffer);
+		device.closestHitKernel.setArg(3, verticesBuffer);
+		device.closestHitKernel.setArg(4, vnormalsBuffer);
+		device.closestHitKernel.setArg(5, trianglesBuffer);
+		device.closestHitKernel.setArg(6, device.rayQueueBuffer);
+		device.closestHitKernel.setArg(8, device.hitQueueBuffer);
+		device.closestHitKernel.setArg(9, device.hitCountBuffer);
+		device.closestHitKernel.setArg(10, device.imageBuffer);
+		if (rt.options.runtimeParams) {
+			device.generateKernel.setArg(4, paramsBuffer);
+			device.closestHitKernel.setArg(11, paramsBuffer);
+		}
+		if (!rt.options.enableAO) {
+			continue;
+		}
+		// The number of rays per hit depends on the pass and is set before every render
+		device.generateAOKernel = cl::Kernel(program, "generate_ao");
+		device.generateAOKernel.setArg(0, device.hitQueueBuffer);
+		device.generateAOKernel.setArg(3, device.aoRayQueueBuffer);
+		device.generateAOKernel.setArg(6, aoDirectionsBuffer);
+		device.occlusionKernel = cl::Kernel(program, "occlusion");
+		device.occlusionKernel.setArg(0, facesBuffer);
+		device.occlusionKernel.setArg(1, nodesBuffer);
+		device.occlusionKernel.setArg(2, aabbsBuffer);
+		device.occlusionKernel.setArg(3, verticesBuffer);
+		device.occlusionKernel.setArg(4, trianglesBuffer);
+		device.occlusionKernel.setArg(5, device.hitQueueBuffer);
+		device.occlusionKernel.setArg(7, device.aoRayQueueBuffer);
+		device.occlusionKernel.setArg(10, device.occludedBuffer);
+		device.accumulateKernel = cl::Kernel(program, "accumulate");
+		device.accumulateKernel.setArg(0, device.hitQueueBuffer);
+		device.accumulateKernel.setArg(3, device.occludedBuffer);
+		device.accumulateKernel.setArg(6, device.imageBuffer);
+		if (rt.options.runtimeParams) {
+			device.generateAOKernel.setArg(7, paramsBuffer);
+			device.occlusionKernel.setArg(11, paramsBuffer);
+			device.accumulateKernel.setArg(7, paramsBuffer);
+		}
+		if (!rt.options.sortAORays) {
+			continue;
+		}
+		device.aoSortKeysKernel = cl::Kernel(program, "ao_sort_keys");
+		device.aoSortKeysKernel.setArg(0, device.hitQueueBuffer);
+		device.aoSortKeysKernel.setArg(2, device.aoRayQueueBuffer);
+		device.aoSortKeysKernel.setArg(5, sceneMin);
+		device.aoSortKeysKernel.setArg(6, sceneSize);
+		device.aoSortKeysKernel.setArg(7, device.sortKeysBuffers[0]);
+		device.aoSortKeysKernel.setArg(8, device.sortValuesBuffers[0]);
+		device.sortHistogramKernel = cl::Kernel(program, "sort_histogram");
+		device.sortHistogramKernel.setArg(3, device.sortHistogramBuffer);
+		device.sortScanKernel = cl::Kernel(program, "sort_scan");
+		device.sortScanKernel.setArg(0, device.sortHistogramBuffer);
+		device.sortScatterKernel = cl::Kernel(program, "sort_scatter");
+		device.sortScatterKernel.setArg(4, device.sortHistogramBuffer);
+		device.occlusionSortedKernel = cl::Kernel(program, "occlusion_sorted");
+		device.occlusionSortedKernel.setArg(0, facesBuffer);
+		device.occlusionSortedKernel.setArg(1, nodesBuffer);
+		device.occlusionSortedKernel.setArg(2, aabbsBuffer);
+		device.occlusionSortedKernel.setArg(3, verticesBuffer);
+		device.occlusionSortedKernel.setArg(4, trianglesBuffer);
+		device.occlusionSortedKernel.setArg(5, device.hitQueueBuffer);
+		device.occlusionSortedKernel.setArg(7, device.aoRayQueueBuffer);
+		device.occlusionSortedKernel.setArg(10, device.occludedBuffer);
+		if (rt.options.runtimeParams) {
+			device.occlusionSortedKernel.setArg(12, paramsBuffer);
+		}
+	}
+}
+cl::Event *OpenCLHost::profile(const std::string &name, CommandTiming::Type type, const Device &d, std::size_t bytes) {
+	if (!rt.options.profileCommands) {
+		return nullptr;
+	}
+	std::lock_guard<std::mutex> lock(profileMutex);
+	profiledCommands.push_back({ name, type, (std::size_t) (&d - devices.data()), bytes, cl::Event() });
+	return &profiledCommands.back().event;
 }
 bool OpenCLHost::operator()() {
-	cl::Kernel kernel(program, "intersect");
-	kernel.setArg(0, facesBuffer);
-	kernel.setArg(1, nodesBuffer);
-	kernel.setArg(2, aabbsBuffer);
-	kernel.setArg(3, verticesBuffer);
-	kernel.setArg(4, vnormalsBuffer);
-	kernel.setArg(5, imageBuffer);
-	queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(rt.totalWidth, rt.totalHeight), cl::NDRange(16, 16));
+	return render(0, 0, rt.totalWidth, rt.totalHeight);
+}
+bool OpenCLHost::render(unsigned int x, unsigned int y, unsigned int width, unsigned int height, std::size_t device) {
+	Device &d = devices[device];
+	if (rt.options.wavefront) {
+		return renderWavefront(x, y, width, height, d);
+	}
+	d.kernel.setArg(7, pass);
+	// The work size is rounded up to whole work groups, the kernel skips the extra work items
+	const cl::NDRange global((width + 15) / 16 * 16, (height + 15) / 16 * 16);
+	d.queue.enqueueNDRangeKernel(d.kernel, cl::NDRange(x, y), global, cl::NDRange(16, 16), nullptr, profile("intersect", CommandTiming::Type::KERNEL, d));
 	cl_int err;
-	check(err = queue.finish());
+	check(err = d.queue.finish());
 	return err == CL_SUCCESS;
 }
-void OpenCLHost::download(float *image) {
-	queue.enqueueReadBuffer(imageBuffer, CL_TRUE, 0, rt.totalWidth * rt.totalHeight * sizeof(float), image);
-	check(queue.finish());
+/*
+* Renders a tile in separate passes: the primary rays are queued, traced, and the hits are
+* compacted into a second queue, so that pixels which miss the scene drop out before any
+* ambient occlusion ray is generated. Only the size of the hit queue is read back, to size
+* the launches of the ambient occlusion passes, which run in batches of hits.
+*/
+bool OpenCLHost::renderWavefront(unsigned int x, unsigned int y, unsigned int width, unsigned int height, Device &d) {
+	std::vector<std::pair<Stage, cl::Event>> events;
+	const auto enqueue = [&](Stage stage, const cl::Kernel &kernel, const cl::NDRange &offset, const cl::NDRange &global, const cl::NDRange &local, std::size_t items) {
+		cl::Event event;
+		check(d.queue.enqueueNDRangeKernel(kernel, offset, global, local, nullptr, &event));
+		events.emplace_back(stage, event);
+		if (cl::Event *profiled = profile(kernel.getInfo<CL_KERNEL_FUNCTION_NAME>(), CommandTiming::Type::KERNEL, d)) {
+			*profiled = event;
+		}
+		d.stageItems[stage] += items;
+	};
+	const auto groups = [](std::size_t items) {
+		return cl::NDRange(std::max<std::size_t>(1, (items + WAVEFRONT_GROUP_SIZE - 1) / WAVEFRONT_GROUP_SIZE) * WAVEFRONT_GROUP_SIZE);
+	};
+	const cl_uint rays = width * height;
+	const cl_uint zero = 0;
+	check(d.queue.enqueueWriteBuffer(d.hitCountBuffer, CL_FALSE, 0, sizeof(cl_uint), &zero, nullptr, profile("hit_count", CommandTiming::Type::UPLOAD, d, sizeof(cl_uint))));
+	d.generateKernel.setArg(1, (cl_uint) width);
+	d.generateKernel.setArg(2, (cl_uint) height);
+	d.generateKernel.setArg(3, pass);
+	enqueue(GENERATE, d.generateKernel, cl::NDRange(x, y), cl::NDRange((width + 15) / 16 * 16, (height + 15) / 16 * 16), cl::NDRange(16, 16), rays);
+	d.closestHitKernel.setArg(7, rays);
+	enqueue(CLOSEST_HIT, d.closestHitKernel, cl::NullRange, groups(rays), cl::NDRange(WAVEFRONT_GROUP_SIZE), rays);
+	if (rt.options.enableAO) {
+		cl_uint hits;
+		check(d.queue.enqueueReadBuffer(d.hitCountBuffer, CL_TRUE, 0, sizeof(cl_uint), &hits, nullptr, profile("hit_count", CommandTiming::Type::DOWNLOAD, d, sizeof(cl_uint))));
+		// Only the first pass of a progressive render traces the normal
+		const cl_uint firstPass = pass == 0;
+		const cl_uint raysPerHit = rt.getAORayCount(firstPass);
+		d.generateAOKernel.setArg(4, raysPerHit);
+		d.generateAOKernel.setArg(5, firstPass);
+		d.occlusionKernel.setArg(9, raysPerHit);
+		if (rt.options.sortAORays) {
+			d.aoSortKeysKernel.setArg(4, raysPerHit);
+			d.occlusionSortedKernel.setArg(9, raysPerHit);
+		}
+		d.accumulateKernel.setArg(4, raysPerHit);
+		d.accumulateKernel.setArg(5, firstPass);
+		for (cl_uint first = 0; first < hits; first += aoBatchSize) {
+			const cl_uint count = std::min<cl_uint>(aoBatchSize, hits - first);
+			d.generateAOKernel.setArg(1, first);
+			d.generateAOKernel.setArg(2, count);
+			enqueue(GENERATE_AO, d.generateAOKernel, cl::NullRange, groups(count), cl::NDRange(WAVEFRONT_GROUP_SIZE), count);
+			const cl_uint aoRays = count * raysPerHit;
+			if (rt.options.sortAORays) {
+				// Least significant digits first, ping-ponging between both pairs of buffers
+				const cl_uint chunks = (aoRays + SORT_CHUNK_SIZE - 1) / SORT_CHUNK_SIZE;
+				d.aoSortKeysKernel.setArg(1, first);
+				d.aoSortKeysKernel.setArg(3, aoRays);
+				enqueue(SORT_AO, d.aoSortKeysKernel, cl::NullRange, groups(aoRays), cl::NDRange(WAVEFRONT_GROUP_SIZE), aoRays);
+				d.sortScanKernel.setArg(1, chunks << SORT_RADIX_BITS);
+				auto pass = 0u;
+				for (cl_uint shift = 0; shift < AO_SORT_KEY_BITS; shift += SORT_RADIX_BITS, ++pass) {
+					const auto &keys = d.sortKeysBuffers[pass % 2];
+					const auto &values = d.sortValuesBuffers[pass % 2];
+					d.sortHistogramKernel.setArg(0, keys);
+					d.sortHistogramKernel.setArg(1, aoRays);
+					d.sortHistogramKernel.setArg(2, shift);
+					d.sortHistogramKernel.setArg(4, chunks);
+					enqueue(SORT_AO, d.sortHistogramKernel, cl::NullRange, groups(chunks), cl::NDRange(WAVEFRONT_GROUP_SIZE), 0);
+					enqueue(SORT_AO, d.sortScanKernel, cl::NullRange, cl::NDRange(SORT_SCAN_SIZE), cl::NDRange(SORT_SCAN_SIZE), 0);
+					d.sortScatterKernel.setArg(0, keys);
+					d.sortScatterKernel.setArg(1, values);
+					d.sortScatterKernel.setArg(2, aoRays);
+					d.sortScatterKernel.setArg(3, shift);
+					d.sortScatterKernel.setArg(5, chunks);
+					d.sortScatterKernel.setArg(6, d.sortKeysBuffers[(pass + 1) % 2]);
+					d.sortScatterKernel.setArg(7, d.sortValuesBuffers[(pass + 1) % 2]);
+					enqueue(SORT_AO, d.sortScatterKernel, cl::NullRange, groups(chunks), cl::NDRange(WAVEFRONT_GROUP_SIZE), 0);
+				}
+				d.occlusionSortedKernel.setArg(6, first);
+				d.occlusionSortedKernel.setArg(8, aoRays);
+				d.occlusionSortedKernel.setArg(11, d.sortValuesBuffers[pass % 2]);
+				enqueue(OCCLUSION, d.occlusionSortedKernel, cl::NullRange, groups(aoRays), cl::NDRange(WAVEFRONT_GROUP_SIZE), aoRays);
+			}
+			else {
+				d.occlusionKernel.setArg(6, first);
+				d.occlusionKernel.setArg(8, aoRays);
+				enqueue(OCCLUSION, d.occlusionKernel, cl::NullRange, groups(aoRays), cl::NDRange(WAVEFRONT_GROUP_SIZE), aoRays);
+			}
+			d.accumulateKernel.setArg(1, first);
+			d.accumulateKernel.setArg(2, count);
+			enqueue(ACCUMULATE, d.accumulateKernel, cl::NullRange, groups(count), cl::NDRange(WAVEFRONT_GROUP_SIZE), count);
+		}
+	}
+	cl_int err;
+	check(err = d.queue.finish());
+	for (const auto &event : events) {
+		d.stageTimes[event.first] += event.second.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event.second.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+	}
+	return err == CL_SUCCESS;
+}
+void OpenCLHost::printStageTimes() const {
+	for (auto stage = 0u; stage < STAGE_COUNT; ++stage) {
+		cl_ulong time = 0;
+		std::size_t items = 0;
+		for (const auto &device : devices) {
+			time += device.stageTimes[stage];
+			items += device.stageItems[stage];
+		}
+		if (items == 0) {
+			continue;
+		}
+		std::cout
+			<< Color::BLUE << "- " << Info::Color::NORMAL << STAGE_NAMES[stage] << ": " << Info::Color::HIGHLIGHT
+			<< time / 1000000.0 << " ms, " << items << " work items"
+			<< Color::RESET << std::endl;
+	}
+}
+void OpenCLHost::download(float *image, std::size_t device) {
+	Device &d = devices[device];
+	d.queue.enqueueReadBuffer(d.imageBuffer, CL_TRUE, 0, rt.tileWidth * rt.tileHeight * sizeof(float), image, nullptr, profile("image", CommandTiming::Type::DOWNLOAD, d, rt.tileWidth * rt.tileHeight * sizeof(float)));
+	check(d.queue.finish());
+}
+bool OpenCLHost::resolve(unsigned int width, unsigned int height, std::size_t device) {
+	Device &d = devices[device];
+	d.resolveKernel.setArg(3, (cl_uint) width);
+	d.resolveKernel.setArg(4, (cl_uint) height);
+	const cl::NDRange global((width + 15) / 16 * 16, (height + 15) / 16 * 16);
+	d.queue.enqueueNDRangeKernel(d.resolveKernel, cl::NullRange, global, cl::NDRange(16, 16), nullptr, profile("resolve", CommandTiming::Type::KERNEL, d));
+	cl_int err;
+	check(err = d.queue.finish());
+	return err == CL_SUCCESS;
+}
+void OpenCLHost::download(unsigned char *image, unsigned int x, unsigned int y, unsigned int width, unsigned int height, std::size_t device) {
+	const std::size_t n = rt.totalWidth / rt.options.width;
+	cl::size_t<3> bufferOrigin, hostOrigin, region;
+	bufferOrigin[0] = bufferOrigin[1] = bufferOrigin[2] = 0;
+	hostOrigin[0] = x;
+	hostOrigin[1] = y;
+	hostOrigin[2] = 0;
+	region[0] = width;
+	region[1] = height;
+	region[2] = 1;
+	// Copies the rows of the tile straight into the rows of the image
+	check(devices[device].queue.enqueueReadBufferRect(devices[device].pixelsBuffer, CL_TRUE, bufferOrigin, hostOrigin, region, rt.tileWidth / n, 0, rt.options.width, 0, image, nullptr, profile("pixels", CommandTiming::Type::DOWNLOAD, devices[device], width * height)));
+}
+/*
+* Only the number of pixels to refine is read back, to size the launch of the refinement.
+*/
+bool OpenCLHost::renderAdaptive(std::size_t &refined, std::size_t &hits, std::size_t device) {
+	Device &d = devices[device];
+	const cl_uint zero = 0;
+	check(d.queue.enqueueWriteBuffer(d.refineCountBuffer, CL_FALSE, 0, sizeof(cl_uint), &zero, nullptr, profile("refine_count", CommandTiming::Type::UPLOAD, d, sizeof(cl_uint))));
+	check(d.queue.enqueueWriteBuffer(d.adaptiveHitsBuffer, CL_FALSE, 0, sizeof(cl_uint), &zero, nullptr, profile("adaptive_hits", CommandTiming::Type::UPLOAD, d, sizeof(cl_uint))));
+	const cl::NDRange pixels((rt.options.width + 15) / 16 * 16, (rt.options.height + 15) / 16 * 16);
+	d.queue.enqueueNDRangeKernel(d.adaptiveBaseKernel, cl::NullRange, pixels, cl::NDRange(16, 16), nullptr, profile("adaptive_base", CommandTiming::Type::KERNEL, d));
+	d.queue.enqueueNDRangeKernel(d.adaptiveClassifyKernel, cl::NullRange, pixels, cl::NDRange(16, 16), nullptr, profile("adaptive_classify", CommandTiming::Type::KERNEL, d));
+	cl_uint count;
+	check(d.queue.enqueueReadBuffer(d.refineCountBuffer, CL_TRUE, 0, sizeof(cl_uint), &count, nullptr, profile("refine_count", CommandTiming::Type::DOWNLOAD, d, sizeof(cl_uint))));
+	const cl_uint n = rt.totalWidth / rt.options.width;
+	const cl_uint samples = count * (n * n - 1);
+	if (samples > 0) {
+		d.adaptiveRefineKernel.setArg(8, samples);
+		d.queue.enqueueNDRangeKernel(d.adaptiveRefineKernel, cl::NullRange, cl::NDRange((samples + 63) / 64 * 64), cl::NDRange(64), nullptr, profile("adaptive_refine", CommandTiming::Type::KERNEL, d));
+	}
+	cl_uint traced;
+	cl_int err;
+	check(err = d.queue.enqueueReadBuffer(d.adaptiveHitsBuffer, CL_TRUE, 0, sizeof(cl_uint), &traced, nullptr, profile("adaptive_hits", CommandTiming::Type::DOWNLOAD, d, sizeof(cl_uint))));
+	// Pixels of a single supersample have nothing to refine
+	refined = samples > 0 ? count : 0;
+	hits = traced;
+	return err == CL_SUCCESS;
+}
+void OpenCLHost::setPass(uint32_t pass) {
+	this->pass = pass;
+}
+/*
+* Only the largest variance leaves the device, reduced with atomics by the kernel.
+*/
+bool OpenCLHost::accumulate(unsigned int pass, float &variance, std::size_t device) {
+	Device &d = devices[device];
+	const cl_uint zero = 0;
+	check(d.queue.enqueueWriteBuffer(d.varianceBuffer, CL_FALSE, 0, sizeof(cl_uint), &zero, nullptr, profile("variance", CommandTiming::Type::UPLOAD, d, sizeof(cl_uint))));
+	d.progressiveKernel.setArg(4, (cl_uint) pass);
+	d.progressiveKernel.setArg(5, (cl_float) (rt.getCountedAORays(pass + 1) - rt.getCountedAORays(pass)));
+	d.progressiveKernel.setArg(6, (cl_float) rt.getCountedAORays(pass + 1));
+	const std::size_t count = rt.tileWidth * rt.tileHeight;
+	d.queue.enqueueNDRangeKernel(d.progressiveKernel, cl::NullRange, cl::NDRange((count + 255) / 256 * 256), cl::NDRange(256), nullptr, profile("progressive_accumulate", CommandTiming::Type::KERNEL, d));
+	cl_uint bits;
+	cl_int err;
+	check(err = d.queue.enqueueReadBuffer(d.varianceBuffer, CL_TRUE, 0, sizeof(cl_uint), &bits, nullptr, profile("variance", CommandTiming::Type::DOWNLOAD, d, sizeof(cl_uint))));
+	std::memcpy(&variance, &bits, sizeof(variance));
+	return err == CL_SUCCESS;
+}
+bool OpenCLHost::downloadTraversalStats(TraversalStats *stats, std::size_t device) {
+	if (!rt.options.traversalStats) {
+		return false;
+	}
+	const std::size_t size = rt.tileWidth * rt.tileHeight * sizeof(TraversalStats);
+	cl_int err;
+	check(err = devices[device].queue.enqueueReadBuffer(devices[device].traversalStatsBuffer, CL_TRUE, 0, size, stats, nullptr, profile("traversal_stats", CommandTiming::Type::DOWNLOAD, devices[device], size)));
+	return err == CL_SUCCESS;
+}
+/*
+* Times are made relative to the earliest queued command of every device, as the clocks of devices differ.
+*/
+std::vector<CommandTiming> OpenCLHost::getCommandTimings() {
+	std::vector<CommandTiming> timings;
+	std::vector<cl_ulong> first(devices.size(), std::numeric_limits<cl_ulong>::max());
+	for (auto &device : devices) {
+		check(device.queue.finish());
+	}
+	std::lock_guard<std::mutex> lock(profileMutex);
+	for (const auto &command : profiledCommands) {
+		timings.push_back({
+			command.name,
+			command.type,
+			command.device,
+			command.bytes,
+			command.event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>(),
+			command.event.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>(),
+			command.event.getProfilingInfo<CL_PROFILING_COMMAND_START>(),
+			command.event.getProfilingInfo<CL_PROFILING_COMMAND_END>()
+		});
+		first[command.device] = std::min<cl_ulong>(first[command.device], timings.back().queued);
+	}
+	for (auto &timing : timings) {
+		timing.queued -= first[timing.device];
+		timing.submitted -= first[timing.device];
+		timing.started -= first[timing.device];
+		timing.ended -= first[timing.device];
+	}
+	return timings;
+}
+std::size_t OpenCLHost::getHits() {
+	std::size_t total = 0;
+	for (auto &device : devices) {
+		cl_uint hits;
+		check(device.queue.enqueueReadBuffer(device.hitsBuffer, CL_TRUE, 0, sizeof(cl_uint), &hits, nullptr, profile("hits", CommandTiming::Type::DOWNLOAD, device, sizeof(cl_uint))));
+		total += hits;
+	}
+	return total;
+}
+std::size_t OpenCLHost::getDeviceCount() const {
+	return devices.size();
+}
+std::string OpenCLHost::getDeviceName(std::size_t device) const {
+	return devices[device].device.getInfo<CL_DEVICE_NAME>();
 }
\ No newline at end of file
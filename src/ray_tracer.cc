@@ -1,16 +1,58 @@
 #include <cmath>
 #include "ray_tracer.h"
 void RayTracer::resize(float *tmp, unsigned char *image) {
+	resize(tmp, totalWidth, image, 0, 0, options.width, options.height);
+}
+void RayTracer::resize(const float *tile, unsigned int pitch, unsigned char *image, unsigned int x, unsigned int y, unsigned int width, unsigned int height) const {
 	unsigned int n(std::sqrt(options.nSuperSamples));
-	for (auto y = 0u; y < options.height; ++y) {
-		for (auto x = 0u; x < options.width; ++x) {
+	for (auto tileY = 0u; tileY < height; ++tileY) {
+		for (auto tileX = 0u; tileX < width; ++tileX) {
 			float total = 0;
 			for (auto ssY = 0u; ssY < n; ++ssY) {
 				for (auto ssX = 0u; ssX < n; ++ssX) {
-					total += (float) tmp[((y * n + ssY) * totalWidth + (x * n + ssX))];
+					total += (float) tile[((tileY * n + ssY) * pitch + (tileX * n + ssX))];
 				}
 			}
-			image[y * options.width + x] = (total / (n * n)) * 255;
+			// Random ambient occlusion can be slightly negative
+			image[(y + tileY) * options.width + (x + tileX)] = std::min(std::max(total / (n * n), 0.0f), 1.0f) * 255;
 		}
 	}
+}
+unsigned int RayTracer::getAORayCount(bool firstPass) const {
+	if (!options.enableAO) {
+		return 0;
+	}
+	if (options.aoMethod == AmbientOcclusionMethod::RANDOM) {
+		// The normal itself and one more than the number of samples
+		return firstPass ? options.aoNumSamples + 2 : options.aoNumSamples;
+	}
+	return getAODirections().size();
+}
+unsigned int RayTracer::getCountedAORays(unsigned int passes) const {
+	// The normal of the first pass is traced but not counted
+	return passes == 0 ? 0 : passes * options.aoNumSamples + 1;
+}
+std::vector<Vec3f> RayTracer::getAODirections() const {
+	std::vector<Vec3f> directions;
+	if (!options.enableAO || options.aoMethod != AmbientOcclusionMethod::UNIFORM) {
+		return directions;
+	}
+	const float pi = M_PI;
+	const float degrees = pi / 180;
+	const unsigned int circleCount = options.aoNumSamples;
+	const float alphaMin = options.aoAlphaMin * degrees;
+	const float alphaMax = options.aoAlphaMax * degrees;
+	for (auto circle = 0u; circle < circleCount; ++circle) {
+		const float stepAngle = alphaMax / circleCount;
+		const float angle = stepAngle * circle + alphaMin;
+		const unsigned int rayCount = (2.0f * pi * std::cos(angle)) / stepAngle;
+		const float theta = pi / 2 - angle;
+		// The kernel traces the first direction of every circle twice (at 0 and 2 pi)
+		for (auto ray = 0u; ray <= rayCount; ++ray) {
+			// The kernel passes phi to cospi and sinpi, which multiply it by pi once more
+			const float phi = (2.0f * pi * ray) / rayCount;
+			directions.emplace_back(std::sin(theta) * std::cos(pi * phi), std::cos(theta), std::sin(theta) * std::sin(pi * phi));
+		}
+	}
+	return directions;
 }
\ No newline at end of file
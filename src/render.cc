@@ -1,20 +1,168 @@
+#include <algorithm>
+#include <cmath>
 #include <cstdlib>
+#include <filesystem>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <sstream>
 #include <string>
 #include <vector>
 #include "args.h"
 #include "bvh.h"
 #include "color.h"
+#include "cpu_host.h"
+#include "hash.h"
 #include "info.h"
 #include "mesh.h"
+#ifdef OPENCL_ENABLE
 #include "opencl_host.h"
+#endif
 #include "ray_tracer.h"
+#include "scene.h"
+#include "split_renderer.h"
 #include "timer.h"
 #define _USE_MATH_DEFINES
 
+/*
+* Returns the directory for cached scenes, following the XDG base directory specification.
+*/
+inline std::string defaultCacheDir() {
+	const char *xdg = std::getenv("XDG_CACHE_HOME");
+	if (xdg != nullptr && *xdg != '\0') {
+		return std::string(xdg) + "/opencl_raytracer";
+	}
+	const char *home = std::getenv("HOME");
+	if (home != nullptr && *home != '\0') {
+		return std::string(home) + "/.cache/opencl_raytracer";
+	}
+	return "";
+}
+
+/*
+* Writes the image as a binary PGM file.
+*/
+inline bool writeImage(const std::string &filename, unsigned int width, unsigned int height, const std::vector<std::uint8_t> &image) {
+	std::ofstream out(filename);
+	if (!out.good()) {
+		return false;
+	}
+	out << "P5 " << width << " " << height << " 255\n";
+	std::copy(image.begin(), image.end(), std::ostream_iterator<std::uint8_t>(out));
+	out.close();
+	return !out.fail();
+}
+
+/*
+* Collects the given counter of all supersamples into bins of powers of two, and lists the
+* share of every bin with a bar scaled to the largest one.
+*/
+inline Info traversalHistogram(const std::string &title, const std::vector<TraversalStats> &stats, uint32_t TraversalStats::*counter) {
+	// Bin b holds the counts with b significant bits, so bin 0 only holds 0
+	std::vector<std::size_t> bins(1, 0);
+	for (const auto &s : stats) {
+		std::size_t bin = 0;
+		while (bin < 32 && (uint64_t) (s.*counter) >> bin) {
+			++bin;
+		}
+		bins.resize(std::max(bins.size(), bin + 1), 0);
+		++bins[bin];
+	}
+	const std::size_t largest = std::max<std::size_t>(1, *std::max_element(bins.begin(), bins.end()));
+	Info info;
+	info.setTitle(title);
+	for (std::size_t bin = 0; bin < bins.size(); ++bin) {
+		const uint64_t first = bin == 0 ? 0 : uint64_t(1) << (bin - 1);
+		const uint64_t last = bin == 0 ? 0 : (uint64_t(1) << bin) - 1;
+		std::stringstream share;
+		share << std::fixed << std::setprecision(1) << std::setw(5) << (100.0 * bins[bin] / std::max<std::size_t>(1, stats.size())) << " % " << std::string(40 * bins[bin] / largest, '#');
+		info.add(first == last ? std::to_string(first) : std::to_string(first) + "-" + std::to_string(last), share.str());
+	}
+	return info;
+}
+
+/*
+* Prints the totals of the counters of all supersamples, their means per ray and their histograms.
+*/
+inline void printTraversalStats(const std::vector<TraversalStats> &stats) {
+	uint64_t aabbTests = 0, triangleTests = 0, rays = 0;
+	for (const auto &s : stats) {
+		aabbTests += s.aabbTests;
+		triangleTests += s.triangleTests;
+		rays += s.rays;
+	}
+	const double perRay = 1.0 / std::max<uint64_t>(1, rays);
+	Info info;
+	info.setTitle("Traversal statistics");
+	info.add("Rays", rays);
+	info.add("AABB tests", aabbTests);
+	info.add("AABB tests per ray", aabbTests * perRay);
+	info.add("Triangle tests", triangleTests);
+	info.add("Triangle tests per ray", triangleTests * perRay);
+	Info aabbHistogram = traversalHistogram("AABB tests per supersample", stats, &TraversalStats::aabbTests);
+	Info triangleHistogram = traversalHistogram("Triangle tests per supersample", stats, &TraversalStats::triangleTests);
+	Info rayHistogram = traversalHistogram("Rays per supersample", stats, &TraversalStats::rays);
+	info.add(aabbHistogram);
+	info.add(triangleHistogram);
+	info.add(rayHistogram);
+	std::cout << info.str();
+}
+
+/*
+* Writes the given counter of every output pixel, summed over its supersamples, as a binary PPM
+* file. The false colors run from dark blue for no tests over cyan and yellow to red for the 99th
+* percentile and above, so that a few outliers do not darken the whole image.
+*/
+inline bool writeHeatmap(const std::string &filename, const RayTracer &rt, const std::vector<TraversalStats> &stats, uint32_t TraversalStats::*counter) {
+	const unsigned int width = rt.options.width, height = rt.options.height;
+	const unsigned int n = rt.totalWidth / width;
+	std::vector<uint64_t> sums(width * height, 0);
+	for (auto y = 0u; y < rt.totalHeight; ++y) {
+		for (auto x = 0u; x < rt.totalWidth; ++x) {
+			sums[y / n * width + x / n] += stats[y * rt.tileWidth + x].*counter;
+		}
+	}
+	std::vector<uint64_t> sorted(sums);
+	std::nth_element(sorted.begin(), sorted.begin() + sorted.size() * 99 / 100, sorted.end());
+	const double scale = 1.0 / std::max<uint64_t>(1, sorted[sorted.size() * 99 / 100]);
+	static const float RAMP[][3] = { { 0, 0, 128 }, { 0, 0, 255 }, { 0, 255, 255 }, { 255, 255, 0 }, { 255, 0, 0 } };
+	const std::size_t stops = sizeof(RAMP) / sizeof(RAMP[0]);
+	std::ofstream out(filename, std::ios::binary);
+	if (!out.good()) {
+		return false;
+	}
+	out << "P6 " << width << " " << height << " 255\n";
+	for (uint64_t sum : sums) {
+		const double t = std::min(1.0, sum * scale) * (stops - 1);
+		const std::size_t stop = std::min<std::size_t>(t, stops - 2);
+		const double f = t - stop;
+		for (auto channel = 0u; channel < 3; ++channel) {
+			out.put((char) (uint8_t) std::lround(RAMP[stop][channel] * (1 - f) + RAMP[stop + 1][channel] * f));
+		}
+	}
+	out.close();
+	return !out.fail();
+}
+
+/*
+* Returns the name of the heatmap next to the output image.
+*/
+inline std::string heatmapFilename(const std::string &out) {
+	std::filesystem::path path(out);
+	return path.replace_filename(path.stem().string() + "_heatmap.ppm").string();
+}
+
 struct Options : RayTracer::Options {
-	Options(int argc, const char **argv) : RayTracer::Options{ 600, 600, 1.f, 4, true, true, .2f, 3, RayTracer::AmbientOcclusionMethod::UNIFORM, 4, 90, BVH::Method::CUT_LONGEST_AXIS }
+	enum class Backend { OPENCL, CPU };
+#ifdef OPENCL_ENABLE
+	static const Backend DEFAULT_BACKEND = Backend::OPENCL;
+#else
+	static const Backend DEFAULT_BACKEND = Backend::CPU;
+#endif
+	Options(int argc, const char **argv) : RayTracer::Options{ 600, 600, 1.f, 4, true, true, .2f, 3, RayTracer::AmbientOcclusionMethod::UNIFORM, 4, 90, BVH::Method::CUT_LONGEST_AXIS, 0, 4, 2, true, false, 0, false, false, false, false, false, false, .1f, std::numeric_limits<float>::infinity(), false, false, 0, false, false }, cacheDir(defaultCacheDir()), precompile(false), subDevices(0), frames(1), passes(1), passSamples(0), progressInterval(0), timeBudget(0), varianceTarget(0.0f), heatmap(nullptr), backend(DEFAULT_BACKEND)
 	{
 		args::parser args(argc, argv, "An OpenCL raytracer that renders triangle meshes in OFF format.");
 		const int ARG_IN = args.add_nonopt("INPUT_MESH");
@@ -27,7 +175,36 @@ struct Options : RayTracer::Options {
 		const int ARG_M = args.add_opt('m', "ambient-occlusion-method", "Specifies the method of ambient occlusion [uniform|random].");
 		const int ARG_F = args.add_opt('f', "focal-length", "Specifies the focal length that the camera should use.");
 		const int ARG_S = args.add_opt('s', "supersamples", "Specifies the number of supersamples to use.");
-		const int ARG_R = args.add_opt('r', "bvh-strategy", "Specifies the strategy of BVH construction (longest|sah).");
+		const int ARG_R = args.add_opt('r', "bvh-strategy", "Specifies the strategy of BVH construction (longest|sah|binned|lbvh|hlbvh).");
+		const int ARG_J = args.add_opt('j', "bvh-threads", "Specifies the number of threads used for BVH construction. If the value `0` is specified, all hardware threads will be used.");
+		const int ARG_L = args.add_opt('l', "leaf-size", "Specifies the maximum number of triangles per BVH leaf.");
+		const int ARG_B = args.add_opt('b', "bvh-width", "Specifies the number of children per BVH node [2|4|8]. Wider nodes test all of their children at once.");
+		const int ARG_T = args.add_opt('t', "traversal", "Specifies how the BVH is traversed [stack|stackless]. The stack traversal visits nearer nodes first and skips nodes behind the nearest hit.");
+		const int ARG_P = args.add_opt('p', "precompute-triangles", "Stores the first vertex and both edges of every triangle in leaf order. Uses more memory for faster intersections.");
+		const int ARG_TILE = args.add_opt("tile-size", "Renders the image in square tiles of the given size (in output pixels) to bound the device memory and the duration of each kernel launch. If the value `0` is specified, the whole image is rendered at once.");
+		const int ARG_HOST_RESIZE = args.add_opt("host-resize", "Downloads the supersampled image and averages the supersamples on the host instead of the device.");
+		const int ARG_CACHE_DIR = args.add_opt("cache-dir", "Specifies the directory in which the mesh, sorted along its BVH, and the compiled kernel are cached for later runs with the same settings. Defaults to `$XDG_CACHE_HOME/opencl_raytracer`.");
+		const int ARG_NO_CACHE = args.add_opt("no-cache", "Neither reads nor writes cached scenes and kernels.");
+		const int ARG_RUNTIME_PARAMS = args.add_opt("runtime-params", "Passes the image size, the camera and the ambient occlusion parameters to the kernel at runtime, so that changing them does not require compiling the kernel again. Compiling them into the kernel can be faster.");
+		const int ARG_PRECOMPILE = args.add_opt("precompile", "Compiles the kernel with runtime parameters for all combinations of shading and ambient occlusion methods into the cache before rendering.");
+		const int ARG_DEVICE = args.add_opt("device", "Specifies the devices to render on as a comma-separated list of `platform:device` indices (see the device section) or device types [gpu|cpu|accelerator|all]. Frames are split among multiple devices, which must belong to the same platform.");
+		const int ARG_SUB_DEVICES = args.add_opt("sub-devices", "Splits every selected device into the given number of sub-devices and renders on all of them.");
+		const int ARG_FRAMES = args.add_opt("frames", "Specifies the number of frames to render. Multiple devices rebalance their shares of the image after every frame.");
+		const int ARG_WAVEFRONT = args.add_opt("wavefront", "Renders in separate passes for primary rays, closest hits, ambient occlusion rays, occlusion and accumulation, connected by ray queues on the device, instead of a single kernel. Pixels which miss the scene drop out after the first pass. Prints the time of every pass. Only affects the OpenCL backend.");
+		const int ARG_SORT_AO_RAYS = args.add_opt("sort-ao-rays", "Sorts every batch of ambient occlusion rays by the Morton code of their origin and the octant of their direction on the device before tracing them, so that neighbouring work items traverse similar parts of the BVH. Implies `--wavefront`.");
+		const int ARG_PROGRESSIVE = args.add_opt("progressive", "Renders the image in passes which draw the given number of random ambient occlusion samples each, until all samples given by `-a` are drawn. Every pass is averaged with the previous ones on the device. Implies the random ambient occlusion method and renders the whole image at once.");
+		const int ARG_PROGRESS_INTERVAL = args.add_opt("progress-interval", "Writes the output image after every given number of passes of a progressive render.");
+		const int ARG_TIME_BUDGET = args.add_opt("time-budget", "Stops a progressive render after the pass which exceeds the given time (in ms).");
+		const int ARG_VARIANCE_TARGET = args.add_opt("variance-target", "Stops a progressive render as soon as the variance of the mean of every supersample is at most the given value.");
+		const int ARG_ADAPTIVE = args.add_opt("adaptive", "Traces one supersample of every pixel first, and all supersamples only of the pixels whose first supersample differs from the ones of their neighbours by more than the given contrast (between 0 and 1). Renders the whole image at once. Has no effect without supersampling.");
+		const int ARG_ADAPTIVE_VARIANCE = args.add_opt("adaptive-variance", "Also refines the pixels whose 3×3 neighbourhood of first supersamples varies by more than the given variance, which catches noisy ambient occlusion below the contrast. Implies `--adaptive` with its default contrast of 0.1.");
+		const int ARG_TRAVERSAL_STATS = args.add_opt("traversal-stats", "Builds the kernel which counts the bounding box tests, triangle tests and rays of every supersample, and prints their totals and histograms. Renders the whole image at once with the single kernel. Only the OpenCL backend counts them.");
+		const int ARG_HEATMAP = args.add_opt("heatmap", "Writes the bounding box tests, triangle tests or rays of every pixel [aabb|triangles|rays] as a false-color PPM image next to the output image. Implies `--traversal-stats`.");
+		const int ARG_COMPACT = args.add_opt("compact", "Uploads the scene in a compact layout, which the kernel decodes on the fly: child boxes of wide BVHs are quantized to the given number of bits [8|16] relative to their node, normals are octahedron-encoded in 32 bits and vertices packed into three floats. Only affects the OpenCL backend.");
+		const int ARG_REORDER_VERTICES = args.add_opt("reorder-vertices", "Renumbers the vertices in the order in which the faces, sorted along the BVH leaves, first use them, so that neighbouring leaves read neighbouring vertices.");
+		const int ARG_INTERLEAVE_VERTICES = args.add_opt("interleave-vertices", "Uploads every vertex next to its normal in a single buffer, so that a hit reads both from the same cache line. Only affects the OpenCL backend.");
+		const int ARG_STATS_JSON = args.add_opt("stats-json", "Writes a JSON timing report to the given file: the host phases (reading the mesh, computing normals, building the BVH, compiling the kernel, …) and every upload, kernel launch and download, timed by the device when it was queued, submitted, started and ended.");
+		const int ARG_BACKEND = args.add_opt("backend", "Specifies the backend to render with [opencl|cpu]. The CPU backend traces packets of rays with SSE or AVX on all hardware threads and does not need an OpenCL runtime.");
 		for (int arg = args.next(); arg != args::parser::end; arg = args.next()) {
 			if (arg == ARG_IN) in = args.val<std::string>();
 			else if (arg == ARG_OUT) out = args.val<std::string>();
@@ -38,102 +215,550 @@ struct Options : RayTracer::Options {
 			else if (arg == ARG_M) aoMethod = args.map(std::string("uniform"), RayTracer::AmbientOcclusionMethod::UNIFORM, std::string("random"), RayTracer::AmbientOcclusionMethod::RANDOM);
 			else if (arg == ARG_F) focalLength = args.val<float>();
 			else if (arg == ARG_S) nSuperSamples = args.val<std::size_t>();
-			else if (arg == ARG_R) bvhMethod = args.map(std::string("longest"), BVH::Method::CUT_LONGEST_AXIS, std::string("sah"), BVH::Method::SURFACE_AREA_HEURISTIC);
+			else if (arg == ARG_R) bvhMethod = args.map(std::string("longest"), BVH::Method::CUT_LONGEST_AXIS, std::string("sah"), BVH::Method::SURFACE_AREA_HEURISTIC, std::string("binned"), BVH::Method::BINNED_SURFACE_AREA_HEURISTIC, std::string("lbvh"), BVH::Method::LINEAR, std::string("hlbvh"), BVH::Method::HIERARCHICAL_LINEAR);
+			else if (arg == ARG_J) bvhThreads = args.val<std::size_t>();
+			else if (arg == ARG_L) bvhLeafSize = args.val<std::size_t>();
+			else if (arg == ARG_P) precomputeTriangles = true;
+			else if (arg == ARG_TILE) tileSize = args.val<std::size_t>();
+			else if (arg == ARG_HOST_RESIZE) hostResize = true;
+			else if (arg == ARG_CACHE_DIR) cacheDir = args.val<std::string>();
+			else if (arg == ARG_NO_CACHE) cacheDir.clear();
+			else if (arg == ARG_RUNTIME_PARAMS) runtimeParams = true;
+			else if (arg == ARG_PRECOMPILE) runtimeParams = precompile = true;
+			else if (arg == ARG_DEVICE) device = args.val<std::string>();
+			else if (arg == ARG_SUB_DEVICES) subDevices = args.val<std::size_t>();
+			else if (arg == ARG_FRAMES) frames = std::max<std::size_t>(1, args.val<std::size_t>());
+			else if (arg == ARG_WAVEFRONT) wavefront = true;
+			else if (arg == ARG_SORT_AO_RAYS) wavefront = sortAORays = true;
+			else if (arg == ARG_PROGRESSIVE) passSamples = args.val<std::size_t>();
+			else if (arg == ARG_PROGRESS_INTERVAL) progressInterval = args.val<std::size_t>();
+			else if (arg == ARG_TIME_BUDGET) timeBudget = args.val<std::size_t>();
+			else if (arg == ARG_VARIANCE_TARGET) varianceTarget = args.val<float>();
+			else if (arg == ARG_ADAPTIVE) {
+				adaptive = true;
+				adaptiveContrast = args.val<float>();
+			}
+			else if (arg == ARG_ADAPTIVE_VARIANCE) {
+				adaptive = true;
+				adaptiveVariance = args.val<float>();
+			}
+			else if (arg == ARG_TRAVERSAL_STATS) traversalStats = true;
+			else if (arg == ARG_HEATMAP) {
+				traversalStats = true;
+				heatmap = args.map(std::string("aabb"), &TraversalStats::aabbTests, std::string("triangles"), &TraversalStats::triangleTests, std::string("rays"), &TraversalStats::rays);
+			}
+			else if (arg == ARG_COMPACT) compactBits = args.map(std::string("8"), 8u, std::string("16"), 16u);
+			else if (arg == ARG_REORDER_VERTICES) reorderVertices = true;
+			else if (arg == ARG_INTERLEAVE_VERTICES) interleaveVertices = true;
+			else if (arg == ARG_STATS_JSON) {
+				statsJson = args.val<std::string>();
+				profileCommands = true;
+			}
+			else if (arg == ARG_BACKEND) backend = args.map(std::string("opencl"), Backend::OPENCL, std::string("cpu"), Backend::CPU);
+			else if (arg == ARG_T) stackTraversal = args.map(std::string("stack"), true, std::string("stackless"), false);
+			else if (arg == ARG_B) bvhWidth = args.map(std::string("2"), 2u, std::string("4"), 4u, std::string("8"), 8u);
 			enableAO = aoNumSamples != 0;
 		}
+		// Only the single kernel counts, and its counters are read back for the whole image at once
+		if (traversalStats) {
+			tileSize = 0;
+			wavefront = sortAORays = adaptive = false;
+			passSamples = 0;
+		}
+		// Without supersampling, every pixel is traced in full anyway
+		if (adaptive && (unsigned int) std::sqrt(nSuperSamples) <= 1) {
+			adaptive = false;
+		}
+		// Every pass draws a share of the samples, which needs random samples and one buffer for the whole image
+		if (passSamples > 0 && enableAO) {
+			progressive = true;
+			passes = (aoNumSamples + passSamples - 1) / passSamples;
+			aoNumSamples = passSamples;
+			aoMethod = RayTracer::AmbientOcclusionMethod::RANDOM;
+			tileSize = 0;
+			adaptive = false;
+		}
+		else if (adaptive) {
+			tileSize = 0;
+		}
 	}
 
 	std::string in, out;
+	// Empty if scenes are not cached
+	std::string cacheDir;
+	bool precompile;
+	// Empty for the default device
+	std::string device;
+	std::size_t subDevices;
+	std::size_t frames;
+	// Maximum number of passes of a progressive render and their ambient occlusion samples
+	std::size_t passes;
+	std::size_t passSamples;
+	// 0 disables writing intermediate images, the time budget and the variance target
+	std::size_t progressInterval;
+	std::size_t timeBudget;
+	float varianceTarget;
+	// Counter written as a heatmap, null if none
+	uint32_t TraversalStats::*heatmap;
+	// Empty if no timing report is written
+	std::string statsJson;
+	Backend backend;
 };
 
+/*
+* Escapes a string for JSON output.
+*/
+inline std::string jsonString(const std::string &text) {
+	std::ostringstream quoted;
+	quoted << '"';
+	for (char c : text) {
+		if (c == '"' || c == '\\') {
+			quoted << '\\' << c;
+		}
+		else if ((unsigned char) c < 0x20) {
+			quoted << "\\u" << std::hex << std::setw(4) << std::setfill('0') << (int) c << std::dec;
+		}
+		else {
+			quoted << c;
+		}
+	}
+	quoted << '"';
+	return quoted.str();
+}
+
+/*
+* Writes the settings, the work and the timing of the render as JSON: the host phases timed by
+* Info::measure and every command of the devices, followed by their totals per command, which
+* split the device time into waiting in the queue and running.
+*/
+inline bool writeTimingReport(const std::string &filename, const Options &options, const RayTracer &rt, RenderBackend &host, std::size_t triangles, std::size_t rays, std::size_t hits, std::size_t renderTime, std::size_t totalTime) {
+	static const char *const BVH_METHODS[] = { "longest", "sah", "binned", "lbvh", "hlbvh" };
+	static const char *const COMMAND_TYPES[] = { "upload", "kernel", "download" };
+	const std::vector<CommandTiming> commands = host.getCommandTimings();
+	std::ofstream out(filename);
+	if (!out.good()) {
+		return false;
+	}
+	out.precision(15);
+	out << "{\n"
+		<< "\t\"mesh\": " << jsonString(options.in) << ",\n"
+		<< "\t\"backend\": \"" << (options.backend == Options::Backend::CPU ? "cpu" : "opencl") << "\",\n"
+		<< "\t\"devices\": [";
+	for (std::size_t device = 0; device < host.getDeviceCount(); ++device) {
+		out << (device == 0 ? " " : ", ") << jsonString(host.getDeviceName(device));
+	}
+	out << " ],\n"
+		<< "\t\"settings\": { \"width\": " << options.width << ", \"height\": " << options.height << ", \"supersamples\": " << options.nSuperSamples
+		<< ", \"ao_rays_per_hit\": " << rt.getAORayCount() << ", \"bvh_method\": \"" << BVH_METHODS[(int) options.bvhMethod] << "\", \"leaf_size\": " << options.bvhLeafSize
+		<< ", \"bvh_width\": " << options.bvhWidth << ", \"tile_size\": " << options.tileSize << ", \"frames\": " << options.frames << " },\n"
+		<< "\t\"triangles\": " << triangles << ",\n"
+		<< "\t\"rays\": " << rays << ",\n"
+		<< "\t\"hits\": " << hits << ",\n"
+		<< "\t\"render_ms\": " << renderTime << ",\n"
+		<< "\t\"total_ms\": " << totalTime << ",\n"
+		<< "\t\"phases\": [\n";
+	const std::vector<Info::Phase> &phases = Info::getPhases();
+	for (std::size_t i = 0; i < phases.size(); ++i) {
+		out << "\t\t{ \"name\": " << jsonString(phases[i].name) << ", \"start_ms\": " << phases[i].start << ", \"ms\": " << phases[i].time << " }" << (i + 1 < phases.size() ? ",\n" : "\n");
+	}
+	out << "\t],\n"
+		<< "\t\"commands\": [\n";
+	// Totals in the order the commands first ran, as there are only a few different ones
+	struct Total {
+		CommandTiming::Type type;
+		std::string name;
+		std::size_t count;
+		std::size_t bytes;
+		uint64_t waiting;
+		uint64_t running;
+	};
+	std::vector<Total> totals;
+	for (std::size_t i = 0; i < commands.size(); ++i) {
+		const CommandTiming &c = commands[i];
+		out << "\t\t{ \"device\": " << c.device << ", \"type\": \"" << COMMAND_TYPES[(int) c.type] << "\", \"name\": " << jsonString(c.name) << ", \"bytes\": " << c.bytes
+			<< ", \"queued_ns\": " << c.queued << ", \"submitted_ns\": " << c.submitted << ", \"started_ns\": " << c.started << ", \"ended_ns\": " << c.ended << " }"
+			<< (i + 1 < commands.size() ? ",\n" : "\n");
+		auto total = std::find_if(totals.begin(), totals.end(), [&](const Total &t) {
+			return t.type == c.type && t.name == c.name;
+		});
+		if (total == totals.end()) {
+			total = totals.insert(totals.end(), Total{ c.type, c.name, 0, 0, 0, 0 });
+		}
+		++total->count;
+		total->bytes += c.bytes;
+		total->waiting += c.started - c.queued;
+		total->running += c.ended - c.started;
+	}
+	out << "\t],\n"
+		<< "\t\"command_totals\": [\n";
+	for (std::size_t i = 0; i < totals.size(); ++i) {
+		const Total &t = totals[i];
+		out << "\t\t{ \"type\": \"" << COMMAND_TYPES[(int) t.type] << "\", \"name\": " << jsonString(t.name) << ", \"count\": " << t.count << ", \"bytes\": " << t.bytes
+			<< ", \"waiting_ms\": " << t.waiting / 1e6 << ", \"running_ms\": " << t.running / 1e6 << " }" << (i + 1 < totals.size() ? ",\n" : "\n");
+	}
+	out << "\t]\n"
+		<< "}\n";
+	out.close();
+	return !out.fail();
+}
+
 int main(int argc, const char **argv) {
 	Options options(argc, argv);
-	// Read input mesh.
-	std::cout << Color::BLUE << "<- " << Info::Color::SECTION << "BVH section" << Color::BLUE << " ->" << std::endl;
-	std::cout << Info::Color::NORMAL << "Reading input mesh…" << std::endl;
-	Mesh mesh;
-	load_off_mesh(options.in, &mesh);
-	compute_vertex_normals(&mesh);
-	std::cout
-		<< Color::BLUE << "- " << Info::Color::NORMAL << "Vertices: " << Info::Color::HIGHLIGHT << mesh.vertices.size()
-		<< std::endl
-		<< Color::BLUE << "- " << Info::Color::NORMAL << "Triangles: " << Info::Color::HIGHLIGHT << (mesh.faces.size() / 3)
-		<< Color::RESET << std::endl;
 	RayTracer rt(options);
+	std::cout << Color::BLUE << "<- " << Info::Color::SECTION << "BVH section" << Color::BLUE << " ->" << std::endl;
+	// Look for a cached scene with the same mesh and BVH settings.
+	Scene scene;
+	Scene::Key key{ 0, (uint32_t) options.bvhMethod, options.bvhLeafSize, options.bvhWidth, options.precomputeTriangles, options.reorderVertices };
+	std::string cacheFile;
+	bool cached = false;
+	std::size_t cacheTime = 0;
+	if (!options.cacheDir.empty()) {
+		cacheTime += Info::measure("Hashing input mesh", [&] {
+			key.meshHash = Scene::hashFile(options.in);
+			return true;
+		});
+		std::stringstream name;
+		name << options.cacheDir << "/" << hashToString(key.meshHash) << "-m" << key.bvhMethod << "-l" << key.bvhLeafSize << "-w" << key.bvhWidth << (key.precomputeTriangles ? "-p" : "") << (key.reorderVertices ? "-r" : "") << ".scene";
+		cacheFile = name.str();
+		if (std::ifstream(cacheFile).good()) {
+			cacheTime += Info::measure("Loading cached scene", [&] {
+				cached = scene.load(cacheFile, key);
+				return true;
+			});
+		}
+		std::cout << Color::BLUE << "- " << Info::Color::NORMAL << "Scene cache: " << Info::Color::HIGHLIGHT << (cached ? "hit" : "miss") << " (" << cacheFile << ")" << Color::RESET << std::endl;
+	}
+	if (cached) {
+		std::cout
+			<< Color::BLUE << "- " << Info::Color::NORMAL << "Vertices: " << Info::Color::HIGHLIGHT << (scene.vertices.size / sizeof(Vec3f))
+			<< std::endl
+			<< Color::BLUE << "- " << Info::Color::NORMAL << "Triangles: " << Info::Color::HIGHLIGHT << (scene.faces.size / (3 * sizeof(uint32_t)))
+			<< std::endl
+			<< Color::BLUE << "- " << Info::Color::NORMAL << "Startup time saved: " << Info::Color::HIGHLIGHT << ((long long) scene.getBuildTime() - (long long) cacheTime) << " ms"
+			<< Color::RESET << std::endl;
+	}
+	else {
+		Timer buildTimer;
+		// Read input mesh.
+		Mesh mesh;
+		std::size_t meshBytes = 0;
+		const std::size_t readTime = Info::measure("Reading input mesh", [&] {
+			meshBytes = load_off_mesh(options.in, &mesh);
+			return true;
+		});
+		Info::measure("Computing normals", [&] {
+			compute_vertex_normals(&mesh);
+			return true;
+		});
+		std::cout
+			<< Color::BLUE << "- " << Info::Color::NORMAL << "Vertices: " << Info::Color::HIGHLIGHT << mesh.vertices.size()
+			<< std::endl
+			<< Color::BLUE << "- " << Info::Color::NORMAL << "Triangles: " << Info::Color::HIGHLIGHT << (mesh.faces.size() / 3)
+			<< std::endl
+			<< Color::BLUE << "- " << Info::Color::NORMAL << "Throughput: " << Info::Color::HIGHLIGHT << (meshBytes / 1000.0 / std::max<std::size_t>(1, readTime)) << " MB/s"
+			<< Color::RESET << std::endl;
+		// Build BVH.
+		BVH bvh(options.bvhMethod, options.bvhThreads, options.bvhLeafSize);
+		Info::measure("Building BVH", [&] {
+			bvh.buildBVH(mesh);
+			return true;
+		});
+		std::cout
+			<< Color::BLUE << "- " << Info::Color::NORMAL << "Nodes: " << Info::Color::HIGHLIGHT << (bvh.nodes.size() / 2)
+			<< std::endl
+			<< Color::BLUE << "- " << Info::Color::NORMAL << "SAH cost: " << Info::Color::HIGHLIGHT << bvh.getSAHCost()
+			<< std::endl
+			<< Color::BLUE << "- " << Info::Color::NORMAL << "Traversal stack size: " << Info::Color::HIGHLIGHT << bvh.getStackSize()
+			<< Color::RESET << std::endl;
+		if (options.bvhWidth > 2) {
+			Info::measure("Collapsing BVH", [&] {
+				bvh.collapse(options.bvhWidth);
+				return true;
+			});
+			std::cout
+				<< Color::BLUE << "- " << Info::Color::NORMAL << "Nodes with " << options.bvhWidth << " children: " << Info::Color::HIGHLIGHT << (bvh.nodes.size() / (2 * options.bvhWidth))
+				<< std::endl
+				<< Color::BLUE << "- " << Info::Color::NORMAL << "Traversal stack size: " << Info::Color::HIGHLIGHT << bvh.getStackSize()
+				<< Color::RESET << std::endl;
+		}
+		// Sort the faces along the BVH and precompute the triangles
+		scene.build(mesh, bvh, options.precomputeTriangles, options.reorderVertices);
+		const std::size_t buildTime = buildTimer.get_elapsed();
+		if (!cacheFile.empty()) {
+			Info::measure("Writing scene cache", [&] {
+				try {
+					std::filesystem::create_directories(options.cacheDir);
+					scene.save(cacheFile, key, buildTime);
+				}
+				catch (const std::exception &e) {
+					std::cout << Info::Color::WARNING << " " << e.what() << Color::RESET;
+				}
+				return true;
+			});
+		}
+	}
 	if (options.enableAO && options.aoMethod == RayTracer::AmbientOcclusionMethod::UNIFORM) {
-		auto rays = 0u;
-		const float degrees = M_PI / 180;
-		for (auto currentCircle = 0u; currentCircle < options.aoNumSamples; ++currentCircle) {
-			// the angle of each step
-			const float stepAngleRad = (options.aoAlphaMax * degrees) / options.aoNumSamples;
-			// the "horizontal" angle
-			const float angleRad = (stepAngleRad * currentCircle) + (options.aoAlphaMin * degrees);
-			rays += static_cast<decltype(rays)>(2.0f * M_PI * cos(angleRad) / stepAngleRad);
-		}
-		std::cout << Info::Color::WARNING << "IMPORTANT INFO: You've enabled 'Uniform AO hemispheres'. You have entered a circle count of " << options.aoNumSamples << ". This will result in " << rays << " rays. Note that the Uniform AO Hemisphere will generate much better pictures without noise with less rays and time than you would need using randomized hemispheres." << Color::RESET << std::endl;
-	}
-	// Build BVH.
-	BVH bvh(options.bvhMethod);
-	Info::measure("Building BVH", [&] {
-		bvh.buildBVH(mesh);
-		return true;
-	});
+		std::cout << Info::Color::WARNING << "IMPORTANT INFO: You've enabled 'Uniform AO hemispheres'. You have entered a circle count of " << options.aoNumSamples << ". This will result in " << rt.getAORayCount() << " rays. Note that the Uniform AO Hemisphere will generate much better pictures without noise with less rays and time than you would need using randomized hemispheres." << Color::RESET << std::endl;
+	}
 	std::cout << std::endl << Color::BLUE << "<- " << Info::Color::SECTION << "Device section" << Color::BLUE << " ->" << std::endl;
-	OpenCLHost::printInfo();
 	auto total_time = 0u;
-	OpenCLHost host(rt);
+	std::unique_ptr<RenderBackend> host;
+#ifdef OPENCL_ENABLE
+	OpenCLHost *opencl = nullptr;
+#endif
+	if (options.backend == Options::Backend::CPU) {
+		host.reset(new CPUHost(rt));
+		std::cout << Color::WHITE << "Using Device \"" << host->getDeviceName(0) << "\"." << Color::RESET << std::endl << std::endl;
+	}
+	else {
+#ifdef OPENCL_ENABLE
+		OpenCLHost::printInfo();
+		opencl = new OpenCLHost(rt, scene, OpenCLHost::getDevices(options.device, options.subDevices), options.cacheDir);
+		host.reset(opencl);
+		if (options.precompile) {
+			if (options.cacheDir.empty()) {
+				std::cout << Info::Color::WARNING << "Precompiling without a cache has no effect." << Color::RESET << std::endl;
+			}
+			else {
+				Info::measure("Precompiling kernels", [&] {
+					opencl->precompile();
+					return true;
+				}, true);
+			}
+		}
+#else
+		std::cerr << Info::Color::WARNING << "This build does not support OpenCL, use the CPU backend." << Color::RESET << std::endl;
+		std::exit(EXIT_FAILURE);
+#endif
+	}
+	const std::size_t triangles = scene.faces.size / (3 * sizeof(uint32_t));
 	// Build the kernel
-	total_time += Info::measure("Loading OpenCL kernel", [&] {
-		// Sort faces along triangle order
-		std::vector<uint32_t> sorted_faces;
-		sorted_faces.reserve(mesh.faces.size());
-		for (std::size_t i = 0; i < bvh.triangles.size(); ++i) {
-			const uint32_t faceID = bvh.triangles[i] * 3;
-			sorted_faces.push_back(mesh.faces[faceID]);
-			sorted_faces.push_back(mesh.faces[faceID + 1]);
-			sorted_faces.push_back(mesh.faces[faceID + 2]);
-		}
-		mesh.faces.clear();
-		bvh.triangles.clear();
-		host.upload(sorted_faces, bvh.nodes, bvh.aabbs, mesh.vertices, mesh.vnormals);
-		sorted_faces.clear();
-		bvh.nodes.clear();
-		bvh.aabbs.clear();
-		mesh.vertices.clear();
-		mesh.vnormals.clear();
+	total_time += Info::measure(options.backend == Options::Backend::CPU ? "Uploading scene" : "Loading OpenCL kernel", [&] {
+		std::cout
+			<< Color::BLUE << "- " << Info::Color::NORMAL << "Triangle memory: " << Info::Color::HIGHLIGHT
+			<< (scene.faces.size + scene.vertices.size + scene.triangles.size) / 1024 << " kB"
+			<< Color::RESET << std::endl;
+		host->upload(scene);
+		scene.clear();
 		return true;
 	}, true);
 	std::cout << std::endl;
 	std::cout << Color::BLUE << "<- " << Info::Color::SECTION << "Rendering section" << Color::BLUE << " ->" << std::endl;
 	// Execute
-	total_time += Info::measure("Rendering image", [&] {
-		return host();
-	});
-	std::vector<float> tmp(rt.totalWidth * rt.totalHeight);
-	std::cout << std::endl;
-	Info::measure("Loading memory", [&] {
-		host.download(tmp.data());
-		return true;
-	});
-	// Resize
 	std::vector<std::uint8_t> image(options.width * options.height);
-	total_time += Info::measure("Resizing image on host", [&] {
-		rt.resize(tmp.data(), image.data());
-		return true;
-	});
+	std::size_t render_time = 0;
+	std::size_t hits = 0;
+	// Every pixel traces a primary ray, the ones which hit the scene also trace AO rays
+	const auto countHits = [](const std::vector<float> &tmp, unsigned int pitch, unsigned int width, unsigned int height) {
+		std::size_t count = 0;
+		for (auto y = 0u; y < height; ++y) {
+			count += std::count_if(tmp.begin() + y * pitch, tmp.begin() + y * pitch + width, [](float value) {
+				return value > 0;
+			});
+		}
+		return count;
+	};
+	const std::size_t devices = host->getDeviceCount();
+	if (devices > 1 && options.hostResize) {
+		std::cout << Info::Color::WARNING << "Resizing on the host is not supported with multiple devices." << Color::RESET << std::endl;
+	}
+	if (devices > 1 && (options.progressive || options.adaptive)) {
+		std::cout << Info::Color::WARNING << "Progressive and adaptive rendering only use the first device." << Color::RESET << std::endl;
+	}
+	// Progressive and adaptive renders count the hits on the device
+	const bool hostResize = options.hostResize && devices == 1 && !options.progressive && !options.adaptive;
+	SplitRenderer split(rt, *host);
+	// Every pass traces the primary rays of all supersamples once, adaptive renders count their own
+	std::size_t passes = 0;
+	std::size_t adaptiveRays = 0;
+	std::size_t adaptiveHits = 0;
+	// Counters of the last frame, if the backend counts them
+	std::vector<TraversalStats> traversalStats;
+	bool traversalCounted = false;
+	for (auto frame = 0u; frame < options.frames; ++frame) {
+		if (options.frames > 1) {
+			std::cout << Color::BLUE << "- " << Info::Color::NORMAL << "Frame: " << Info::Color::HIGHLIGHT << (frame + 1) << Color::RESET << std::endl;
+		}
+		std::size_t framePasses = 1;
+		if (options.progressive) {
+			// Every pass draws new samples and is averaged with the previous ones on the device.
+			// The render stops early once the time budget is spent or all means are accurate enough.
+			float variance = 0.0f;
+			const Timer timer;
+			const std::size_t frame_time = Info::measure("Rendering image progressively (incl. resizing on device)", [&] {
+				for (framePasses = 0; framePasses < options.passes;) {
+					host->setPass(framePasses);
+					if (!(*host)() || !host->accumulate(framePasses, variance) || !host->resolve(options.width, options.height)) {
+						return false;
+					}
+					++framePasses;
+					const bool overBudget = options.timeBudget > 0 && timer.get_elapsed() >= options.timeBudget;
+					const bool converged = options.varianceTarget > 0.0f && framePasses > 1 && variance <= options.varianceTarget;
+					if (framePasses == options.passes || overBudget || converged) {
+						break;
+					}
+					if (options.progressInterval > 0 && framePasses % options.progressInterval == 0) {
+						host->download(image.data(), 0, 0, options.width, options.height);
+						if (!writeImage(options.out, options.width, options.height, image)) {
+							std::cout << Info::Color::WARNING << " Cannot write intermediate image" << Color::RESET;
+						}
+					}
+				}
+				host->download(image.data(), 0, 0, options.width, options.height);
+				return true;
+			});
+			render_time += frame_time;
+			total_time += frame_time;
+			std::cout
+				<< Color::BLUE << "- " << Info::Color::NORMAL << "Passes: " << Info::Color::HIGHLIGHT << framePasses << " of " << options.passes
+				<< std::endl
+				<< Color::BLUE << "- " << Info::Color::NORMAL << "Largest variance: " << Info::Color::HIGHLIGHT << variance
+				<< Color::RESET << std::endl;
+		}
+		else if (options.adaptive) {
+			std::size_t refined = 0;
+			std::size_t traced = 0;
+			const std::size_t frame_time = Info::measure("Rendering image adaptively (incl. resizing on device)", [&] {
+				return host->renderAdaptive(refined, traced) && host->resolve(options.width, options.height);
+			});
+			render_time += frame_time;
+			total_time += frame_time;
+			std::cout << std::endl;
+			Info::measure("Loading memory", [&] {
+				host->download(image.data(), 0, 0, options.width, options.height);
+				return true;
+			});
+			const std::size_t pixels = options.width * options.height;
+			const std::size_t supersamples = rt.totalWidth / options.width * rt.totalHeight / options.height;
+			framePasses = 0;
+			adaptiveRays += pixels + refined * (supersamples - 1);
+			adaptiveHits += traced;
+			std::cout << Color::BLUE << "- " << Info::Color::NORMAL << "Refined pixels: " << Info::Color::HIGHLIGHT << refined << " (" << (100.0 * refined / pixels) << " %)" << Color::RESET << std::endl;
+		}
+		else if (devices > 1) {
+			const std::size_t frame_time = Info::measure("Rendering frame on " + std::to_string(devices) + " devices (incl. loading memory and resizing on device)", [&] {
+				return split(image.data());
+			});
+			render_time += frame_time;
+			total_time += frame_time;
+			split.printStats();
+		}
+		else if (options.tileSize == 0) {
+			const std::size_t frame_time = Info::measure("Rendering image", [&] {
+				return (*host)();
+			});
+			render_time += frame_time;
+			total_time += frame_time;
+			if (options.traversalStats) {
+				traversalStats.resize(rt.tileWidth * rt.tileHeight);
+				traversalCounted = host->downloadTraversalStats(traversalStats.data());
+			}
+			if (hostResize) {
+				std::vector<float> tmp(rt.totalWidth * rt.totalHeight);
+				std::cout << std::endl;
+				Info::measure("Loading memory", [&] {
+					host->download(tmp.data());
+					return true;
+				});
+				hits += countHits(tmp, rt.totalWidth, rt.totalWidth, rt.totalHeight);
+				// Resize
+				total_time += Info::measure("Resizing image on host", [&] {
+					rt.resize(tmp.data(), image.data());
+					return true;
+				});
+			}
+			else {
+				// Only the averaged bytes leave the device
+				total_time += Info::measure("Resizing image on device", [&] {
+					return host->resolve(options.width, options.height);
+				});
+				std::cout << std::endl;
+				Info::measure("Loading memory", [&] {
+					host->download(image.data(), 0, 0, options.width, options.height);
+					return true;
+				});
+			}
+		}
+		else {
+			// Only one tile of floats is kept, each tile is resized right after rendering it
+			const unsigned int n = std::sqrt(options.nSuperSamples);
+			std::vector<float> tmp(hostResize ? rt.tileWidth * rt.tileHeight : 0);
+			std::size_t tiles = 0;
+			const std::string where = hostResize ? "host" : "device";
+			const std::size_t frame_time = Info::measure("Rendering image in tiles (incl. loading memory and resizing on " + where + ")", [&] {
+				for (auto y = 0u; y < rt.totalHeight; y += rt.tileHeight) {
+					for (auto x = 0u; x < rt.totalWidth; x += rt.tileWidth) {
+						const unsigned int width = std::min(rt.tileWidth, rt.totalWidth - x);
+						const unsigned int height = std::min(rt.tileHeight, rt.totalHeight - y);
+						if (!host->render(x, y, width, height)) {
+							return false;
+						}
+						if (hostResize) {
+							host->download(tmp.data());
+							hits += countHits(tmp, rt.tileWidth, width, height);
+							rt.resize(tmp.data(), rt.tileWidth, image.data(), x / n, y / n, width / n, height / n);
+						}
+						else {
+							if (!host->resolve(width / n, height / n)) {
+								return false;
+							}
+							host->download(image.data(), x / n, y / n, width / n, height / n);
+						}
+						++tiles;
+					}
+				}
+				return true;
+			});
+			render_time += frame_time;
+			total_time += frame_time;
+			std::cout << Color::BLUE << "- " << Info::Color::NORMAL << "Tiles: " << Info::Color::HIGHLIGHT << tiles << Color::RESET << std::endl;
+		}
+		passes += framePasses;
+	}
+#ifdef OPENCL_ENABLE
+	if (opencl && options.wavefront) {
+		opencl->printStageTimes();
+	}
+#endif
+	// The device counts the hits of all frames, resolving adaptive renders counts supersamples which were not traced
+	if (options.adaptive) {
+		hits = adaptiveHits;
+	}
+	else if (!hostResize) {
+		hits = host->getHits();
+	}
+	// Every pass hits the same supersamples, but only the first pass of a frame traces the normal
+	const std::size_t firstPassHits = options.progressive ? hits / std::max<std::size_t>(1, passes) * options.frames : hits;
+	const std::size_t rays = passes * rt.totalWidth * rt.totalHeight + adaptiveRays + firstPassHits * rt.getAORayCount() + (hits - firstPassHits) * rt.getAORayCount(false);
+	std::cout
+		<< Color::BLUE << "- " << Info::Color::NORMAL << "Rays: " << Info::Color::HIGHLIGHT << rays
+		<< std::endl
+		<< Color::BLUE << "- " << Info::Color::NORMAL << "Rays per second: " << Info::Color::HIGHLIGHT << (rays * 1000.0 / std::max<std::size_t>(1, render_time))
+		<< Color::RESET << std::endl;
+	if (options.traversalStats && !traversalCounted) {
+		std::cout << Info::Color::WARNING << "Traversal statistics are only counted by the OpenCL backend on a single device." << Color::RESET << std::endl;
+	}
+	else if (options.traversalStats) {
+		std::cout << std::endl;
+		printTraversalStats(traversalStats);
+	}
 	std::cout
 		<< Info::Color::NORMAL
 		<< "Total time (without loading memory and building the BVH): "
 		<< Info::formatTime(total_time)
 		<< std::endl;
 	// Write output image.
-	std::ofstream out(options.out);
-	if (!out.good()) {
+	if (!writeImage(options.out, options.width, options.height, image)) {
 		std::cerr << Info::Color::WARNING << "Error opening output file!" << Color::RESET << std::endl;
 		std::exit(EXIT_FAILURE);
 	}
-	out << "P5 " << options.width << " " << options.height << " 255\n";
-	std::copy(image.begin(), image.end(), std::ostream_iterator<decltype(image)::value_type>(out));
-	out.close();
+	if (options.heatmap && traversalCounted && !writeHeatmap(heatmapFilename(options.out), rt, traversalStats, options.heatmap)) {
+		std::cerr << Info::Color::WARNING << "Error opening heatmap file!" << Color::RESET << std::endl;
+		std::exit(EXIT_FAILURE);
+	}
+	if (!options.statsJson.empty() && !writeTimingReport(options.statsJson, options, rt, *host, triangles, rays, hits, render_time, total_time)) {
+		std::cerr << Info::Color::WARNING << "Error opening timing report file!" << Color::RESET << std::endl;
+		std::exit(EXIT_FAILURE);
+	}
 	return 0;
 }
\ No newline at end of file
@@ -0,0 +1,409 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "args.h"
+#include "bvh.h"
+#include "color.h"
+#include "cpu_host.h"
+#include "info.h"
+#include "mesh.h"
+#include "mesh_generator.h"
+#ifdef OPENCL_ENABLE
+#include "opencl_host.h"
+#endif
+#include "ray_tracer.h"
+#include "scene.h"
+// Seed of the triangle soups, so that every run benchmarks the same scene
+static const uint32_t SOUP_SEED = 1;
+// Number of triangles a ray crosses in a triangle soup without a given depth
+static const float SOUP_DEPTH = 4.f;
+/*
+* Splits a comma-separated list, dropping empty entries.
+*/
+inline std::vector<std::string> splitList(const std::string &list) {
+	std::vector<std::string> items;
+	std::istringstream in(list);
+	for (std::string item; std::getline(in, item, ',');) {
+		if (!item.empty()) {
+			items.push_back(item);
+		}
+	}
+	return items;
+}
+/*
+* Parses a comma-separated list of unsigned integers. Exits on invalid entries.
+*/
+inline std::vector<unsigned int> parseList(const std::string &list, const std::string &name) {
+	std::vector<unsigned int> values;
+	for (const auto &item : splitList(list)) {
+		char *end = nullptr;
+		const unsigned long value = std::strtoul(item.c_str(), &end, 10);
+		if (*end != '\0' || value > std::numeric_limits<unsigned int>::max()) {
+			std::cerr << Info::Color::WARNING << "Invalid " << name << ": " << item << Color::RESET << std::endl;
+			std::exit(EXIT_FAILURE);
+		}
+		values.push_back(value);
+	}
+	if (values.empty()) {
+		std::cerr << Info::Color::WARNING << "No " << name << " given." << Color::RESET << std::endl;
+		std::exit(EXIT_FAILURE);
+	}
+	return values;
+}
+/*
+* Generates the mesh of a scene given as `sphere:<subdivisions>`, `soup:<triangles>[:<depth>]`,
+* `interior:<bays>` or the filename of an OFF mesh. Returns false if the scene is invalid.
+*/
+inline bool generateScene(const std::string &scene, Mesh *mesh) {
+	std::vector<std::string> parts;
+	std::istringstream in(scene);
+	for (std::string part; std::getline(in, part, ':');) {
+		parts.push_back(part);
+	}
+	try {
+		if (parts.size() == 2 && parts[0] == "sphere") {
+			generate_sphere_mesh(std::stoul(parts[1]), mesh);
+		}
+		else if ((parts.size() == 2 || parts.size() == 3) && parts[0] == "soup") {
+			generate_triangle_soup(std::stoul(parts[1]), parts.size() == 3 ? std::stof(parts[2]) : SOUP_DEPTH, SOUP_SEED, mesh);
+		}
+		else if (parts.size() == 2 && parts[0] == "interior") {
+			generate_interior_mesh(std::stoul(parts[1]), mesh);
+		}
+		else if (scene.size() > 4 && scene.compare(scene.size() - 4, 4, ".off") == 0) {
+			load_off_mesh(scene, mesh);
+		}
+		else {
+			return false;
+		}
+	}
+	catch (const std::exception &) {
+		return false;
+	}
+	compute_vertex_normals(mesh);
+	return !mesh->faces.empty();
+}
+// Median and sample standard deviation of the runs of a configuration.
+struct Stats {
+	double median;
+	double stddev;
+};
+/*
+* Summarizes the measurements of all runs.
+*/
+inline Stats summarize(std::vector<double> values) {
+	std::sort(values.begin(), values.end());
+	const std::size_t n = values.size();
+	Stats stats{ 0.0, 0.0 };
+	if (n == 0) {
+		return stats;
+	}
+	stats.median = n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+	if (n > 1) {
+		double mean = 0.0;
+		for (double value : values) {
+			mean += value / n;
+		}
+		double squares = 0.0;
+		for (double value : values) {
+			squares += (value - mean) * (value - mean);
+		}
+		stats.stddev = std::sqrt(squares / (n - 1));
+	}
+	return stats;
+}
+/*
+* Returns the milliseconds elapsed since the given time, with sub-millisecond precision.
+*/
+inline double elapsedMs(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+// Settings and measurements of one configuration.
+struct Result {
+	std::string scene;
+	std::size_t triangles;
+	std::string method;
+	unsigned int leafSize;
+	std::string vertexOrder;
+	unsigned int resolution;
+	unsigned int supersamples;
+	unsigned int aoSamples;
+	Stats buildMs;
+	Stats mrays;
+	Stats uploadBytes;
+};
+/*
+* Escapes a string for CSV and JSON output, which only has to handle quotes and backslashes in filenames.
+*/
+inline std::string quote(const std::string &text, char escape) {
+	std::string quoted = "\"";
+	for (char c : text) {
+		if (c == '"' || c == escape) {
+			quoted += escape;
+		}
+		quoted += c;
+	}
+	return quoted + "\"";
+}
+/*
+* Writes one line per configuration, with the median and standard deviation of every measurement.
+*/
+inline bool writeCSV(const std::string &filename, const std::vector<Result> &results) {
+	std::ofstream out(filename);
+	if (!out.good()) {
+		return false;
+	}
+	// Byte counts are printed in full
+	out.precision(15);
+	out << "scene,triangles,method,leaf_size,vertex_order,resolution,supersamples,ao_samples,"
+		<< "build_ms_median,build_ms_stddev,mrays_per_s_median,mrays_per_s_stddev,upload_bytes_median,upload_bytes_stddev\n";
+	for (const auto &r : results) {
+		out << quote(r.scene, '"') << ',' << r.triangles << ',' << r.method << ',' << r.leafSize << ',' << r.vertexOrder << ',' << r.resolution << ',' << r.supersamples << ',' << r.aoSamples << ','
+			<< r.buildMs.median << ',' << r.buildMs.stddev << ',' << r.mrays.median << ',' << r.mrays.stddev << ',' << r.uploadBytes.median << ',' << r.uploadBytes.stddev << '\n';
+	}
+	out.close();
+	return !out.fail();
+}
+/*
+* Writes an array with one object per configuration, which holds the median and standard deviation of every measurement.
+*/
+inline bool writeJSON(const std::string &filename, const std::vector<Result> &results) {
+	std::ofstream out(filename);
+	if (!out.good()) {
+		return false;
+	}
+	const auto stats = [](const Stats &s) {
+		std::ostringstream json;
+		json.precision(15);
+		json << "{ \"median\": " << s.median << ", \"stddev\": " << s.stddev << " }";
+		return json.str();
+	};
+	out << "[\n";
+	for (std::size_t i = 0; i < results.size(); ++i) {
+		const auto &r = results[i];
+		out << "\t{ \"scene\": " << quote(r.scene, '\\') << ", \"triangles\": " << r.triangles << ", \"method\": \"" << r.method << "\", \"leaf_size\": " << r.leafSize
+			<< ", \"vertex_order\": \"" << r.vertexOrder << "\", \"resolution\": " << r.resolution << ", \"supersamples\": " << r.supersamples << ", \"ao_samples\": " << r.aoSamples
+			<< ", \"build_ms\": " << stats(r.buildMs) << ", \"mrays_per_s\": " << stats(r.mrays) << ", \"upload_bytes\": " << stats(r.uploadBytes) << " }"
+			<< (i + 1 < results.size() ? ",\n" : "\n");
+	}
+	out << "]\n";
+	out.close();
+	return !out.fail();
+}
+struct Options {
+	enum class Backend { OPENCL, CPU };
+#ifdef OPENCL_ENABLE
+	static const Backend DEFAULT_BACKEND = Backend::OPENCL;
+#else
+	static const Backend DEFAULT_BACKEND = Backend::CPU;
+#endif
+	Options(int argc, const char **argv) : scenes{ "sphere:6", "soup:100000", "interior:16" }, methods{ "binned", "lbvh" }, leafSizes{ 4 }, vertexOrders{ "file" }, resolutions{ 256 }, supersamples{ 1 }, aoSamples{ 0, 3 }, runs(5), warmup(1), bvhThreads(0), backend(DEFAULT_BACKEND)
+	{
+		args::parser args(argc, argv, "Benchmarks BVH construction and rendering over generated meshes and a sweep of settings.");
+		const int ARG_SCENES = args.add_opt("scenes", "Specifies the scenes as a comma-separated list of `sphere:<subdivisions>`, `soup:<triangles>[:<depth>]`, `interior:<bays>` or OFF files. Defaults to `sphere:6,soup:100000,interior:16`.");
+		const int ARG_METHODS = args.add_opt("methods", "Specifies the BVH strategies as a comma-separated list of [longest|sah|binned|lbvh|hlbvh]. Defaults to `binned,lbvh`.");
+		const int ARG_LEAF_SIZES = args.add_opt("leaf-sizes", "Specifies the maximum numbers of triangles per BVH leaf as a comma-separated list. Defaults to `4`.");
+		const int ARG_VERTEX_ORDERS = args.add_opt("vertex-orders", "Specifies the layouts of the vertices as a comma-separated list of [file|reordered|interleaved]: in the order of the mesh, renumbered in the order of first use along the BVH leaves, or renumbered and interleaved with their normals. Defaults to `file`.");
+		const int ARG_RESOLUTIONS = args.add_opt("resolutions", "Specifies the widths and heights of the square images as a comma-separated list. Defaults to `256`.");
+		const int ARG_SUPERSAMPLES = args.add_opt("supersamples", "Specifies the numbers of supersamples as a comma-separated list of squares. Defaults to `1`.");
+		const int ARG_AO_SAMPLES = args.add_opt("ao-samples", "Specifies the numbers of circles of uniform ambient occlusion samples as a comma-separated list, `0` disables ambient occlusion. Defaults to `0,3`.");
+		const int ARG_RUNS = args.add_opt("runs", "Specifies the number of measured runs of every configuration. Defaults to 5.");
+		const int ARG_WARMUP = args.add_opt("warmup", "Specifies the number of runs of every configuration before the measured ones. Defaults to 1.");
+		const int ARG_BVH_THREADS = args.add_opt("bvh-threads", "Specifies the number of threads used for BVH construction. If the value `0` is specified, all hardware threads will be used.");
+		const int ARG_DEVICE = args.add_opt("device", "Specifies the OpenCL device as a `platform:device` index or device type [gpu|cpu|accelerator].");
+		const int ARG_BACKEND = args.add_opt("backend", "Specifies the backend to render with [opencl|cpu].");
+		const int ARG_CSV = args.add_opt("csv", "Writes the results to the given CSV file.");
+		const int ARG_JSON = args.add_opt("json", "Writes the results to the given JSON file.");
+		for (int arg = args.next(); arg != args::parser::end; arg = args.next()) {
+			if (arg == ARG_SCENES) scenes = splitList(args.val<std::string>());
+			else if (arg == ARG_METHODS) methods = splitList(args.val<std::string>());
+			else if (arg == ARG_LEAF_SIZES) leafSizes = parseList(args.val<std::string>(), "leaf size");
+			else if (arg == ARG_VERTEX_ORDERS) vertexOrders = splitList(args.val<std::string>());
+			else if (arg == ARG_RESOLUTIONS) resolutions = parseList(args.val<std::string>(), "resolution");
+			else if (arg == ARG_SUPERSAMPLES) supersamples = parseList(args.val<std::string>(), "supersamples");
+			else if (arg == ARG_AO_SAMPLES) aoSamples = parseList(args.val<std::string>(), "ambient occlusion samples");
+			else if (arg == ARG_RUNS) runs = std::max<std::size_t>(1, args.val<std::size_t>());
+			else if (arg == ARG_WARMUP) warmup = args.val<std::size_t>();
+			else if (arg == ARG_BVH_THREADS) bvhThreads = args.val<std::size_t>();
+			else if (arg == ARG_DEVICE) device = args.val<std::string>();
+			else if (arg == ARG_BACKEND) backend = args.map(std::string("opencl"), Backend::OPENCL, std::string("cpu"), Backend::CPU);
+			else if (arg == ARG_CSV) csv = args.val<std::string>();
+			else if (arg == ARG_JSON) json = args.val<std::string>();
+		}
+	}
+	std::vector<std::string> scenes;
+	std::vector<std::string> methods;
+	std::vector<unsigned int> leafSizes;
+	std::vector<std::string> vertexOrders;
+	std::vector<unsigned int> resolutions;
+	std::vector<unsigned int> supersamples;
+	std::vector<unsigned int> aoSamples;
+	std::size_t runs;
+	std::size_t warmup;
+	unsigned int bvhThreads;
+	// Empty for the default device
+	std::string device;
+	Backend backend;
+	// Empty if the results are not written
+	std::string csv, json;
+};
+/*
+* Maps the name of a BVH strategy to the method. Exits on unknown names.
+*/
+inline BVH::Method parseMethod(const std::string &name) {
+	const std::pair<const char *, BVH::Method> methods[] = {
+		{ "longest", BVH::Method::CUT_LONGEST_AXIS },
+		{ "sah", BVH::Method::SURFACE_AREA_HEURISTIC },
+		{ "binned", BVH::Method::BINNED_SURFACE_AREA_HEURISTIC },
+		{ "lbvh", BVH::Method::LINEAR },
+		{ "hlbvh", BVH::Method::HIERARCHICAL_LINEAR }
+	};
+	for (const auto &method : methods) {
+		if (name == method.first) {
+			return method.second;
+		}
+	}
+	std::cerr << Info::Color::WARNING << "Invalid BVH strategy: " << name << Color::RESET << std::endl;
+	std::exit(EXIT_FAILURE);
+}
+int main(int argc, const char **argv) {
+	Options options(argc, argv);
+	for (const auto &method : options.methods) {
+		parseMethod(method);
+	}
+	for (const auto &vertexOrder : options.vertexOrders) {
+		if (vertexOrder != "file" && vertexOrder != "reordered" && vertexOrder != "interleaved") {
+			std::cerr << Info::Color::WARNING << "Invalid vertex order: " << vertexOrder << Color::RESET << std::endl;
+			std::exit(EXIT_FAILURE);
+		}
+	}
+	for (auto supersamples : options.supersamples) {
+		const unsigned int n = std::sqrt(supersamples);
+		if (n == 0 || n * n != supersamples) {
+			std::cerr << Info::Color::WARNING << "Invalid supersamples: " << supersamples << " is not a square." << Color::RESET << std::endl;
+			std::exit(EXIT_FAILURE);
+		}
+	}
+#ifndef OPENCL_ENABLE
+	if (options.backend == Options::Backend::OPENCL) {
+		std::cerr << Info::Color::WARNING << "This build does not support OpenCL, use the CPU backend." << Color::RESET << std::endl;
+		std::exit(EXIT_FAILURE);
+	}
+#endif
+	std::vector<Result> results;
+	for (const auto &sceneName : options.scenes) {
+		Mesh mesh;
+		if (!generateScene(sceneName, &mesh)) {
+			std::cerr << Info::Color::WARNING << "Invalid scene: " << sceneName << Color::RESET << std::endl;
+			std::exit(EXIT_FAILURE);
+		}
+		const std::size_t triangles = mesh.faces.size() / 3;
+		std::cout << Color::BLUE << "<- " << Info::Color::SECTION << sceneName << Color::BLUE << " ->" << std::endl
+			<< Color::BLUE << "- " << Info::Color::NORMAL << "Triangles: " << Info::Color::HIGHLIGHT << triangles << Color::RESET << std::endl;
+		for (const auto &methodName : options.methods) {
+			for (auto leafSize : options.leafSizes) {
+				for (const auto &vertexOrder : options.vertexOrders) {
+					// The BVH does not depend on the image, so every build is timed once and shared by all render settings
+					Scene scene;
+					std::vector<double> buildMs;
+					for (std::size_t run = 0; run < options.warmup + options.runs; ++run) {
+						// Building takes over the data of the mesh
+						Mesh copy = mesh;
+						const auto start = std::chrono::steady_clock::now();
+						BVH bvh(parseMethod(methodName), options.bvhThreads, leafSize);
+						bvh.buildBVH(copy);
+						scene.build(copy, bvh, false, vertexOrder != "file");
+						if (run >= options.warmup) {
+							buildMs.push_back(elapsedMs(start));
+						}
+					}
+					for (auto resolution : options.resolutions) {
+						for (auto supersamples : options.supersamples) {
+							for (auto aoSamples : options.aoSamples) {
+								RayTracer::Options rtOptions = RayTracer::Options();
+								rtOptions.width = rtOptions.height = resolution;
+								rtOptions.focalLength = 1.f;
+								rtOptions.nSuperSamples = supersamples;
+								rtOptions.enableShading = true;
+								rtOptions.enableAO = aoSamples != 0;
+								rtOptions.aoMaxDistance = .2f;
+								rtOptions.aoNumSamples = aoSamples;
+								rtOptions.aoMethod = RayTracer::AmbientOcclusionMethod::UNIFORM;
+								rtOptions.aoAlphaMin = 4;
+								rtOptions.aoAlphaMax = 90;
+								rtOptions.bvhMethod = parseMethod(methodName);
+								rtOptions.bvhThreads = options.bvhThreads;
+								rtOptions.bvhLeafSize = leafSize;
+								rtOptions.bvhWidth = 2;
+								rtOptions.stackTraversal = true;
+								rtOptions.adaptiveContrast = .1f;
+								rtOptions.adaptiveVariance = std::numeric_limits<float>::infinity();
+								// The upload records of the backend tell how many bytes reached the device
+								rtOptions.profileCommands = true;
+								rtOptions.reorderVertices = vertexOrder != "file";
+								rtOptions.interleaveVertices = vertexOrder == "interleaved";
+								RayTracer rt(rtOptions);
+								std::unique_ptr<RenderBackend> host;
+								if (options.backend == Options::Backend::CPU) {
+									host.reset(new CPUHost(rt));
+								}
+								else {
+#ifdef OPENCL_ENABLE
+									host.reset(new OpenCLHost(rt, scene, OpenCLHost::getDevices(options.device)));
+#endif
+								}
+								std::vector<double> uploads, mrays;
+								for (std::size_t run = 0; run < options.warmup + options.runs; ++run) {
+									const std::size_t recorded = host->getCommandTimings().size();
+									host->upload(scene);
+									const std::vector<CommandTiming> commands = host->getCommandTimings();
+									double uploadBytes = 0;
+									for (auto command = commands.begin() + recorded; command != commands.end(); ++command) {
+										if (command->type == CommandTiming::Type::UPLOAD) {
+											uploadBytes += command->bytes;
+										}
+									}
+									// Every pixel traces a primary ray per supersample, the ones which hit the scene also trace AO rays
+									const std::size_t hitsBefore = host->getHits();
+									const auto start = std::chrono::steady_clock::now();
+									if (!(*host)() || !host->resolve(resolution, resolution)) {
+										std::cerr << Info::Color::WARNING << "Rendering failed." << Color::RESET << std::endl;
+										std::exit(EXIT_FAILURE);
+									}
+									const double ms = elapsedMs(start);
+									const std::size_t rays = (std::size_t) rt.totalWidth * rt.totalHeight + (host->getHits() - hitsBefore) * rt.getAORayCount();
+									if (run >= options.warmup) {
+										uploads.push_back(uploadBytes);
+										mrays.push_back(rays / (1000.0 * std::max(ms, 1e-3)));
+									}
+								}
+								Result result{ sceneName, triangles, methodName, leafSize, vertexOrder, resolution, supersamples, aoSamples, summarize(buildMs), summarize(mrays), summarize(uploads) };
+								std::cout << Color::BLUE << "- " << Info::Color::NORMAL << methodName << ", leaf size " << leafSize << ", " << vertexOrder << " vertices, " << resolution << "², s" << supersamples << ", a" << aoSamples << ": "
+									<< Info::Color::HIGHLIGHT << result.buildMs.median << " ms build, " << result.mrays.median << " ± " << result.mrays.stddev << " Mrays/s"
+									<< Color::RESET << std::endl;
+								results.push_back(result);
+							}
+						}
+					}
+				}
+			}
+		}
+	}
+	if (!options.csv.empty() && !writeCSV(options.csv, results)) {
+		std::cerr << Info::Color::WARNING << "Error opening CSV file!" << Color::RESET << std::endl;
+		std::exit(EXIT_FAILURE);
+	}
+	if (!options.json.empty() && !writeJSON(options.json, results)) {
+		std::cerr << Info::Color::WARNING << "Error opening JSON file!" << Color::RESET << std::endl;
+		std::exit(EXIT_FAILURE);
+	}
+	return 0;
+}
\ No newline at end of file
@@ -0,0 +1,210 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <unistd.h>
+#include "hash.h"
+#include "scene.h"
+#include "thread_pool.h"
+// Changes whenever the layout of a cache file or of the device buffers changes.
+static const uint32_t SCENE_VERSION = 2;
+static const char SCENE_MAGIC[8] = { 'R', 'T', 'S', 'C', 'E', 'N', 'E', '\0' };
+// Arrays start at multiples of this size within a cache file.
+static const std::size_t SCENE_ALIGNMENT = 64;
+// Files are hashed in parallel in blocks of this size.
+static const std::size_t HASH_BLOCK_BYTES = 1 << 20;
+// The arrays in the order of a cache file.
+static Scene::Array Scene::*const SCENE_ARRAYS[] = { &Scene::faces, &Scene::nodes, &Scene::aabbs, &Scene::vertices, &Scene::vnormals, &Scene::triangles };
+static const std::size_t SCENE_NUM_ARRAYS = sizeof(SCENE_ARRAYS) / sizeof(SCENE_ARRAYS[0]);
+// Header of a cache file, followed by the arrays at the given offsets.
+struct SceneHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t vec3Size;
+	Scene::Key key;
+	uint64_t buildTime;
+	uint64_t bvhWidth;
+	uint64_t bvhStackSize;
+	uint64_t offsets[SCENE_NUM_ARRAYS];
+	uint64_t sizes[SCENE_NUM_ARRAYS];
+};
+inline std::size_t align(std::size_t offset) {
+	return (offset + SCENE_ALIGNMENT - 1) / SCENE_ALIGNMENT * SCENE_ALIGNMENT;
+}
+inline bool operator==(const Scene::Key &a, const Scene::Key &b) {
+	return a.meshHash == b.meshHash && a.bvhMethod == b.bvhMethod && a.bvhLeafSize == b.bvhLeafSize && a.bvhWidth == b.bvhWidth && a.precomputeTriangles == b.precomputeTriangles && a.reorderVertices == b.reorderVertices;
+}
+Scene::Scene() :
+	faces{ nullptr, 0 },
+	nodes{ nullptr, 0 },
+	aabbs{ nullptr, 0 },
+	vertices{ nullptr, 0 },
+	vnormals{ nullptr, 0 },
+	triangles{ nullptr, 0 },
+	bvhWidth(2),
+	bvhStackSize(0),
+	buildTime(0) {
+}
+void Scene::build(Mesh &mesh, BVH &bvh, bool precomputeTriangles, bool reorderVertices) {
+	file.reset();
+	// Sort faces along triangle order
+	faceData.clear();
+	faceData.reserve(bvh.triangles.size() * 3);
+	for (std::size_t i = 0; i < bvh.triangles.size(); ++i) {
+		const uint32_t faceID = bvh.triangles[i] * 3;
+		faceData.push_back(mesh.faces[faceID]);
+		faceData.push_back(mesh.faces[faceID + 1]);
+		faceData.push_back(mesh.faces[faceID + 2]);
+	}
+	// Precompute the first vertex and both edges of every triangle
+	triangleData.clear();
+	if (precomputeTriangles) {
+		triangleData.reserve(faceData.size());
+		for (std::size_t i = 0; i < faceData.size(); i += 3) {
+			const Vec3f &v0 = mesh.vertices[faceData[i]];
+			triangleData.push_back(v0);
+			triangleData.push_back(mesh.vertices[faceData[i + 1]] - v0);
+			triangleData.push_back(mesh.vertices[faceData[i + 2]] - v0);
+		}
+	}
+	nodeData = std::move(bvh.nodes);
+	aabbData = std::move(bvh.aabbs);
+	wideAABBData = std::move(bvh.wideAABBs);
+	vertexData = std::move(mesh.vertices);
+	vnormalData = std::move(mesh.vnormals);
+	if (reorderVertices) {
+		this->reorderVertices();
+	}
+	mesh.faces.clear();
+	bvh.triangles.clear();
+	bvhWidth = bvh.getWidth();
+	bvhStackSize = bvh.getStackSize();
+	buildTime = 0;
+	setArrays();
+}
+bool Scene::load(const std::string &filename, const Key &key) {
+	std::unique_ptr<MappedFile> mapped;
+	try {
+		mapped.reset(new MappedFile(filename));
+	}
+	catch (const std::runtime_error &) {
+		return false;
+	}
+	SceneHeader header;
+	if (mapped->size() < sizeof(header)) {
+		return false;
+	}
+	std::memcpy(&header, mapped->data(), sizeof(header));
+	if (std::memcmp(header.magic, SCENE_MAGIC, sizeof(SCENE_MAGIC)) != 0 || header.version != SCENE_VERSION || header.vec3Size != sizeof(Vec3f) || !(header.key == key)) {
+		return false;
+	}
+	for (auto i = 0u; i < SCENE_NUM_ARRAYS; ++i) {
+		if (header.offsets[i] > mapped->size() || header.sizes[i] > mapped->size() - header.offsets[i]) {
+			return false;
+		}
+	}
+	clear();
+	file = std::move(mapped);
+	for (auto i = 0u; i < SCENE_NUM_ARRAYS; ++i) {
+		this->*SCENE_ARRAYS[i] = Array{ file->data() + header.offsets[i], header.sizes[i] };
+	}
+	bvhWidth = header.bvhWidth;
+	bvhStackSize = header.bvhStackSize;
+	buildTime = header.buildTime;
+	return true;
+}
+/*
+* Writes to a temporary file first, so that other processes never map a partial file.
+*/
+void Scene::save(const std::string &filename, const Key &key, std::size_t buildTime) const {
+	SceneHeader header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, SCENE_MAGIC, sizeof(SCENE_MAGIC));
+	header.version = SCENE_VERSION;
+	header.vec3Size = sizeof(Vec3f);
+	header.key = key;
+	header.buildTime = buildTime;
+	header.bvhWidth = bvhWidth;
+	header.bvhStackSize = bvhStackSize;
+	std::size_t offset = align(sizeof(header));
+	for (auto i = 0u; i < SCENE_NUM_ARRAYS; ++i) {
+		header.offsets[i] = offset;
+		header.sizes[i] = (this->*SCENE_ARRAYS[i]).size;
+		offset = align(offset + header.sizes[i]);
+	}
+	const std::string tmp = filename + "." + std::to_string(getpid()) + ".tmp";
+	std::ofstream out(tmp, std::ios::binary);
+	if (out.fail()) {
+		throw std::runtime_error("Cannot write scene cache");
+	}
+	out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+	const std::vector<char> padding(SCENE_ALIGNMENT, 0);
+	for (auto i = 0u; i < SCENE_NUM_ARRAYS; ++i) {
+		out.write(padding.data(), header.offsets[i] - out.tellp());
+		out.write(static_cast<const char *>((this->*SCENE_ARRAYS[i]).data), header.sizes[i]);
+	}
+	out.close();
+	if (out.fail() || std::rename(tmp.c_str(), filename.c_str()) != 0) {
+		std::remove(tmp.c_str());
+		throw std::runtime_error("Cannot write scene cache");
+	}
+}
+void Scene::clear() {
+	std::vector<uint32_t>().swap(faceData);
+	std::vector<uint32_t>().swap(nodeData);
+	std::vector<Vec3f>().swap(aabbData);
+	std::vector<float>().swap(wideAABBData);
+	std::vector<Vec3f>().swap(vertexData);
+	std::vector<Vec3f>().swap(vnormalData);
+	std::vector<Vec3f>().swap(triangleData);
+	file.reset();
+	setArrays();
+}
+/*
+* Hashes blocks of the file in parallel and combines their hashes with the size of the file.
+*/
+uint64_t Scene::hashFile(const std::string &filename) {
+	const MappedFile mapped(filename);
+	const std::size_t blocks = (mapped.size() + HASH_BLOCK_BYTES - 1) / HASH_BLOCK_BYTES;
+	std::vector<uint64_t> hashes(blocks);
+	ThreadPool pool;
+	pool.parallelFor(blocks, 1, [&](std::size_t block, std::size_t) {
+		const std::size_t begin = block * HASH_BLOCK_BYTES;
+		hashes[block] = hashBytes(mapped.data() + begin, std::min(HASH_BLOCK_BYTES, mapped.size() - begin));
+	});
+	const uint64_t size = mapped.size();
+	return hashBytes(hashes.data(), hashes.size() * sizeof(uint64_t), hashBytes(&size, sizeof(size)));
+}
+/*
+* Renumbers the vertices in the order in which the faces, sorted along the BVH leaves, first use
+* them, so that neighbouring leaves read their vertices and normals from neighbouring cache lines
+* instead of wherever the mesh file put them. Vertices which no face uses are dropped.
+*/
+void Scene::reorderVertices() {
+	const uint32_t unused = std::numeric_limits<uint32_t>::max();
+	std::vector<uint32_t> remap(vertexData.size(), unused);
+	std::vector<Vec3f> vertices, vnormals;
+	vertices.reserve(vertexData.size());
+	vnormals.reserve(vnormalData.size());
+	for (auto &index : faceData) {
+		if (remap[index] == unused) {
+			remap[index] = vertices.size();
+			vertices.push_back(vertexData[index]);
+			vnormals.push_back(vnormalData[index]);
+		}
+		index = remap[index];
+	}
+	vertexData = std::move(vertices);
+	vnormalData = std::move(vnormals);
+}
+void Scene::setArrays() {
+	faces = Array{ faceData.data(), faceData.size() * sizeof(uint32_t) };
+	nodes = Array{ nodeData.data(), nodeData.size() * sizeof(uint32_t) };
+	// Collapsed trees store their bounding boxes as plain floats
+	aabbs = bvhWidth == 2 ? Array{ aabbData.data(), aabbData.size() * sizeof(Vec3f) } : Array{ wideAABBData.data(), wideAABBData.size() * sizeof(float) };
+	vertices = Array{ vertexData.data(), vertexData.size() * sizeof(Vec3f) };
+	vnormals = Array{ vnormalData.data(), vnormalData.size() * sizeof(Vec3f) };
+	triangles = Array{ triangleData.data(), triangleData.size() * sizeof(Vec3f) };
+}
\ No newline at end of file
@@ -0,0 +1,129 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <thread>
+#include "color.h"
+#include "info.h"
+#include "split_renderer.h"
+SplitRenderer::SplitRenderer(const RayTracer &rt, RenderBackend &host) :
+	rt(rt),
+	host(host),
+	shares(host.getDeviceCount(), 1.0 / host.getDeviceCount()),
+	work(host.getDeviceCount(), 0),
+	times(host.getDeviceCount(), 0) {
+}
+bool SplitRenderer::operator()(unsigned char *image) {
+	std::fill(work.begin(), work.end(), 0);
+	std::fill(times.begin(), times.end(), 0);
+	if (rt.options.tileSize == 0) {
+		if (!renderBands(image)) {
+			return false;
+		}
+		balance();
+		return true;
+	}
+	return renderTiles(image);
+}
+void SplitRenderer::printStats() const {
+	const std::string unit = rt.options.tileSize == 0 ? " rows" : " tiles";
+	for (auto i = 0u; i < host.getDeviceCount(); ++i) {
+		std::cout
+			<< Color::BLUE << "- " << Info::Color::NORMAL << "Device " << i << " (" << host.getDeviceName(i) << "): " << Info::Color::HIGHLIGHT
+			<< work[i] << unit << " in " << times[i] << " ms, " << (work[i] * 1000.0 / std::max(times[i], 1e-3)) << unit << " per second"
+			<< Color::RESET << std::endl;
+	}
+}
+/*
+* Splits the output rows by the shares of the devices. Every device gets at least one row,
+* so that its throughput can still be measured.
+*/
+bool SplitRenderer::renderBands(unsigned char *image) {
+	const std::size_t devices = host.getDeviceCount();
+	const unsigned int n = rt.totalWidth / rt.options.width;
+	const unsigned int height = rt.options.height;
+	std::vector<unsigned int> begin(devices + 1, 0);
+	double share = 0;
+	for (auto i = 0u; i < devices; ++i) {
+		share += shares[i];
+		const unsigned int minEnd = std::min<unsigned int>(height, begin[i] + 1);
+		const unsigned int maxEnd = height - std::min<unsigned int>(height, devices - i - 1);
+		begin[i + 1] = std::max(minEnd, std::min(maxEnd, (unsigned int) std::lround(share * height)));
+	}
+	begin[devices] = height;
+	std::atomic<bool> success(true);
+	std::vector<std::thread> threads;
+	for (auto i = 0u; i < devices; ++i) {
+		const unsigned int y = begin[i];
+		const unsigned int rows = begin[i + 1] - y;
+		work[i] = rows;
+		if (rows == 0) {
+			continue;
+		}
+		threads.emplace_back([&, i, y, rows] {
+			const auto start = std::chrono::steady_clock::now();
+			if (!host.render(0, y * n, rt.totalWidth, rows * n, i) || !host.resolve(rt.options.width, rows, i)) {
+				success = false;
+				return;
+			}
+			host.download(image, 0, y, rt.options.width, rows, i);
+			times[i] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		});
+	}
+	for (auto &thread : threads) {
+		thread.join();
+	}
+	return success;
+}
+/*
+* Hands out the tiles in order, so faster devices simply render more of them.
+*/
+bool SplitRenderer::renderTiles(unsigned char *image) {
+	const std::size_t devices = host.getDeviceCount();
+	const unsigned int n = rt.totalWidth / rt.options.width;
+	const unsigned int columns = (rt.totalWidth + rt.tileWidth - 1) / rt.tileWidth;
+	const unsigned int tiles = columns * ((rt.totalHeight + rt.tileHeight - 1) / rt.tileHeight);
+	std::atomic<unsigned int> next(0);
+	std::atomic<bool> success(true);
+	std::vector<std::thread> threads;
+	for (auto i = 0u; i < devices; ++i) {
+		threads.emplace_back([&, i] {
+			const auto start = std::chrono::steady_clock::now();
+			for (unsigned int tile = next++; tile < tiles && success; tile = next++) {
+				const unsigned int x = tile % columns * rt.tileWidth;
+				const unsigned int y = tile / columns * rt.tileHeight;
+				const unsigned int width = std::min(rt.tileWidth, rt.totalWidth - x);
+				const unsigned int height = std::min(rt.tileHeight, rt.totalHeight - y);
+				if (!host.render(x, y, width, height, i) || !host.resolve(width / n, height / n, i)) {
+					success = false;
+					break;
+				}
+				host.download(image, x / n, y / n, width / n, height / n, i);
+				++work[i];
+			}
+			times[i] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		});
+	}
+	for (auto &thread : threads) {
+		thread.join();
+	}
+	return success;
+}
+/*
+* Gives every device a share of the next frame proportional to its throughput in the last one.
+*/
+void SplitRenderer::balance() {
+	std::vector<double> throughput(shares.size());
+	double total = 0;
+	for (auto i = 0u; i < shares.size(); ++i) {
+		throughput[i] = work[i] / std::max(times[i], 1e-3);
+		total += throughput[i];
+	}
+	if (total <= 0) {
+		return;
+	}
+	for (auto i = 0u; i < shares.size(); ++i) {
+		shares[i] = throughput[i] / total;
+	}
+}
\ No newline at end of file
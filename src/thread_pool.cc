@@ -0,0 +1,125 @@
+#include <algorithm>
+#include "thread_pool.h"
+// Index of the queue of the current thread, threads outside of any pool use queue 0.
+static thread_local const ThreadPool *currentPool = nullptr;
+static thread_local std::size_t currentQueue = 0;
+ThreadPool::ThreadPool(std::size_t threads) : pending(0), stop(false) {
+	if (threads == 0) {
+		threads = hardwareThreads();
+	}
+	for (auto i = 0u; i < threads; ++i) {
+		queues.emplace_back(new Queue);
+	}
+	// Queue 0 belongs to the threads using the pool
+	for (auto i = 1u; i < threads; ++i) {
+		workers.emplace_back(&ThreadPool::work, this, i);
+	}
+}
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard<std::mutex> lock(sleepMutex);
+		stop = true;
+	}
+	sleep.notify_all();
+	for (auto &worker : workers) {
+		worker.join();
+	}
+}
+ThreadPool::Handle ThreadPool::spawn(std::function<void ()> job) {
+	Handle task = std::make_shared<Task>(std::move(job));
+	Queue &queue = *queues[self()];
+	{
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		queue.tasks.push_back(task);
+	}
+	{
+		std::lock_guard<std::mutex> lock(sleepMutex);
+		++pending;
+	}
+	sleep.notify_one();
+	return task;
+}
+void ThreadPool::wait(const Handle &task) {
+	const std::size_t queue = self();
+	while (!task->done) {
+		if (!runOne(queue)) {
+			std::this_thread::yield();
+		}
+	}
+	if (task->exception) {
+		std::rethrow_exception(task->exception);
+	}
+}
+void ThreadPool::parallelFor(std::size_t n, std::size_t chunkSize, const std::function<void (std::size_t, std::size_t)> &job) {
+	std::vector<Handle> tasks;
+	for (std::size_t begin = chunkSize; begin < n; begin += chunkSize) {
+		const std::size_t end = std::min(n, begin + chunkSize);
+		tasks.push_back(spawn([&job, begin, end] {
+			job(begin, end);
+		}));
+	}
+	job(0, std::min(n, chunkSize));
+	for (auto &task : tasks) {
+		wait(task);
+	}
+}
+std::size_t ThreadPool::size() const {
+	return queues.size();
+}
+std::size_t ThreadPool::hardwareThreads() {
+	return std::max(1u, std::thread::hardware_concurrency());
+}
+/*
+* Runs a task of the own queue or steals one from another queue.
+*/
+bool ThreadPool::runOne(std::size_t self) {
+	Handle task;
+	for (auto i = 0u; i < queues.size() && !task; ++i) {
+		Queue &queue = *queues[(self + i) % queues.size()];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		if (queue.tasks.empty()) {
+			continue;
+		}
+		// The own queue is used as a stack, the others are robbed from the bottom
+		if (i == 0) {
+			task = queue.tasks.back();
+			queue.tasks.pop_back();
+		}
+		else {
+			task = queue.tasks.front();
+			queue.tasks.pop_front();
+		}
+	}
+	if (!task) {
+		return false;
+	}
+	--pending;
+	try {
+		task->job();
+	}
+	catch (...) {
+		task->exception = std::current_exception();
+	}
+	task->job = nullptr;
+	task->done = true;
+	return true;
+}
+void ThreadPool::work(std::size_t self) {
+	currentPool = this;
+	currentQueue = self;
+	for (;;) {
+		if (runOne(self)) {
+			continue;
+		}
+		std::unique_lock<std::mutex> lock(sleepMutex);
+		sleep.wait(lock, [&] {
+			return pending > 0 || stop;
+		});
+		if (stop) {
+			return;
+		}
+	}
+}
+std::size_t ThreadPool::self() const {
+	return currentPool == this ? currentQueue : 0;
+}
\ No newline at end of file